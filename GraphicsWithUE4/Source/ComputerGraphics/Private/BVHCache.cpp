@@ -0,0 +1,134 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "BVHCache.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Hash/CityHash.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace BVHCache
+{
+	const uint32 Magic = 0x43485642; // BVHC
+
+	struct FHeader
+	{
+		uint32 Magic;
+		uint32 Version;
+		uint64 Key;
+		int32 ObjectCount;
+		int32 NodeCount;
+		int32 ObjectIndexCount;
+		int32 Padding;
+	};
+
+	TAutoConsoleVariable<int32> CVarEnabled(
+		TEXT("RayTracer.BVHCache"),
+		1,
+		TEXT("Read and write BVHs in Saved/BVHCache instead of building them every time"));
+
+	bool ReadView(const uint8* Data, int64 Size, uint64 Key, int32 ObjectCount, FBVHCacheView& OutView)
+	{
+		if (Size < (int64)sizeof(FHeader))
+		{
+			return false;
+		}
+		const FHeader& Header = *reinterpret_cast<const FHeader*>(Data);
+		if (Header.Magic != Magic || Header.Version != FBVHCache::Version || Header.Key != Key || Header.ObjectCount != ObjectCount
+			|| Header.NodeCount < 0 || Header.ObjectIndexCount < 0)
+		{
+			return false;
+		}
+		const int64 NodeBytes = (int64)Header.NodeCount * sizeof(FBVHFlatNode);
+		if (Size != sizeof(FHeader) + NodeBytes + (int64)Header.ObjectIndexCount * sizeof(int32))
+		{
+			return false;
+		}
+		OutView.Nodes = reinterpret_cast<const FBVHFlatNode*>(Data + sizeof(FHeader));
+		OutView.NodeCount = Header.NodeCount;
+		OutView.ObjectIndices = reinterpret_cast<const int32*>(Data + sizeof(FHeader) + NodeBytes);
+		OutView.ObjectIndexCount = Header.ObjectIndexCount;
+		return true;
+	}
+}
+
+bool FBVHCache::IsEnabled()
+{
+	return BVHCache::CVarEnabled.GetValueOnAnyThread() != 0;
+}
+
+void FBVHCache::SetEnabled(bool bEnabled)
+{
+	BVHCache::CVarEnabled->Set(bEnabled ? 1 : 0, ECVF_SetByCode);
+}
+
+uint64 FBVHCache::MakeKey(uint64 ContentHash, uint64 SettingsHash)
+{
+	const uint64 Values[] = { ContentHash, SettingsHash, Version };
+	return CityHash64(reinterpret_cast<const char*>(Values), sizeof(Values));
+}
+
+FString FBVHCache::GetPath(uint64 Key)
+{
+	return FPaths::ProjectSavedDir() / TEXT("BVHCache") / FString::Printf(TEXT("%016llx.bvh"), Key);
+}
+
+bool FBVHCache::Load(uint64 Key, int32 ObjectCount, FBVHCacheView& OutView)
+{
+	const FString Path = GetPath(Key);
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	if (!PlatformFile.FileExists(*Path))
+	{
+		return false;
+	}
+	OutView.Handle.Reset(PlatformFile.OpenMapped(*Path));
+	if (OutView.Handle)
+	{
+		OutView.Region.Reset(OutView.Handle->MapRegion(0, OutView.Handle->GetFileSize()));
+	}
+	bool bLoaded;
+	if (OutView.Region)
+	{
+		bLoaded = BVHCache::ReadView(OutView.Region->GetMappedPtr(), OutView.Region->GetMappedSize(), Key, ObjectCount, OutView);
+	}
+	else
+	{
+		bLoaded = FFileHelper::LoadFileToArray(OutView.Buffer, *Path)
+			&& BVHCache::ReadView(OutView.Buffer.GetData(), OutView.Buffer.Num(), Key, ObjectCount, OutView);
+	}
+	if (!bLoaded)
+	{
+		UE_LOG(LogTemp, Warning, TEXT(__FUNCTION__" %d:%s is stale or damaged, rebuilding."), __LINE__, *Path);
+	}
+	return bLoaded;
+}
+
+bool FBVHCache::Save(uint64 Key, int32 ObjectCount, const TArray<FBVHFlatNode>& Nodes, const TArray<int32>& ObjectIndices)
+{
+	BVHCache::FHeader Header;
+	FMemory::Memzero(Header);
+	Header.Magic = BVHCache::Magic;
+	Header.Version = Version;
+	Header.Key = Key;
+	Header.ObjectCount = ObjectCount;
+	Header.NodeCount = Nodes.Num();
+	Header.ObjectIndexCount = ObjectIndices.Num();
+
+	TArray<uint8> Data;
+	Data.Reserve(sizeof(Header) + Nodes.Num() * sizeof(FBVHFlatNode) + ObjectIndices.Num() * sizeof(int32));
+	Data.Append(reinterpret_cast<const uint8*>(&Header), sizeof(Header));
+	Data.Append(reinterpret_cast<const uint8*>(Nodes.GetData()), Nodes.Num() * sizeof(FBVHFlatNode));
+	Data.Append(reinterpret_cast<const uint8*>(ObjectIndices.GetData()), ObjectIndices.Num() * sizeof(int32));
+
+	// Written aside and moved in place, a reader never maps half a file
+	const FString Path = GetPath(Key);
+	const FString TempPath = Path + TEXT(".tmp");
+	if (!FFileHelper::SaveArrayToFile(Data, *TempPath))
+	{
+		return false;
+	}
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	PlatformFile.DeleteFile(*Path);
+	return PlatformFile.MoveFile(*Path, *TempPath);
+}
@@ -2,14 +2,798 @@
 
 
 #include "BVHTree.h"
+#include "BVHCache.h"
+#include "Algo/BinarySearch.h"
 #include "TriangleMesh.h"
 #include "Kismet/KismetSystemLibrary.h"
+#include "RenderTrace.h"
 
-void UBVHTree::BuildTree(TArray<IObjectInterface*> Objects, int32 MaxTriangleInNode)
+FTraversalCounters*& FTraversalCounters::ForThread()
 {
+    static thread_local FTraversalCounters* Counters = nullptr;
+    return Counters;
+}
+
+// Counters of the calling thread, always null when the stats are compiled out
+static FORCEINLINE FTraversalCounters* GetThreadCounters()
+{
+#if WITH_RAY_STATS
+    return FTraversalCounters::ForThread();
+#else
+    return nullptr;
+#endif
+}
+
+namespace BVHBuild
+{
+    struct FReference
+    {
+        IObjectInterface* Object;
+        FBounds3 Bound;
+    };
+
+    struct FSplit
+    {
+        float Cost = TNumericLimits<float>::Max();
+        int32 Axis = -1;
+        // Object splits: last bin on the left, spatial splits: the plane
+        int32 Bin = 0;
+        float Position = 0;
+        FBounds3 Left;
+        FBounds3 Right;
+    };
+
+    static const int32 BinCount = 16;
+    // Spatial splits are only tried when the object split children overlap by this fraction of the root area
+    static const float SpatialSplitAlpha = 1e-5f;
+
+    FBounds3 EmptyBounds()
+    {
+        FBounds3 Bound;
+        Bound.pMax = FVector(-TNumericLimits<float>::Max());
+        return Bound;
+    }
+
+    bool IsEmpty(const FBounds3& Bound)
+    {
+        return Bound.pMin.X > Bound.pMax.X || Bound.pMin.Y > Bound.pMax.Y || Bound.pMin.Z > Bound.pMax.Z;
+    }
+
+    float GetArea(const FBounds3& Bound)
+    {
+        return IsEmpty(Bound) ? 0.f : (float)Bound.SurfaceArea();
+    }
+
+    FBounds3 Union(FBounds3 A, const FBounds3& B)
+    {
+        A.Union(B);
+        return A;
+    }
+
+    FBounds3 Overlap(const FBounds3& A, const FBounds3& B)
+    {
+        FBounds3 Bound;
+        Bound.pMin = A.pMin.ComponentMax(B.pMin);
+        Bound.pMax = A.pMax.ComponentMin(B.pMax);
+        return Bound;
+    }
+
+    FORCEINLINE float Centroid(const FBounds3& Bound, int32 Axis)
+    {
+        return (Bound.pMin[Axis] + Bound.pMax[Axis]) * 0.5f;
+    }
+
+    /**
+     * Top down binned SAH build after Stich et al., "Spatial Splits in Bounding Volume Hierarchies".
+     * Nodes are split until they hold at most MaxObjects references, like the median builder, so a leaf of
+     * single objects can still be sampled by area.
+     */
+    class FBuilder
+    {
+    public:
+        FBuilder(bool bInSpatial, int32 InMaxObjects, int32 InReferenceBudget)
+            : bSpatial(bInSpatial), MaxObjects(InMaxObjects), ReferenceBudget(InReferenceBudget), RootArea(0)
+        {
+        }
+
+        FBVHNode* Build(const TArray<IObjectInterface*>& Objects)
+        {
+            if (Objects.Num() == 0)
+            {
+                return nullptr;
+            }
+            TArray<FReference> References;
+            References.Reserve(Objects.Num());
+            FBounds3 RootBound = EmptyBounds();
+            for (IObjectInterface* Object : Objects)
+            {
+                References.Add({ Object, Object->GetBounds() });
+                RootBound.Union(References.Last().Bound);
+            }
+            RootArea = FMath::Max(GetArea(RootBound), SMALL_NUMBER);
+            FBVHNode* Root = BuildNode(References);
+            // Objects split into several leaves lend each its share of their area to pick leaves by, their pdf uses the full area
+            TMap<IObjectInterface*, int32> ReferenceCounts;
+            CountReferences(*Root, ReferenceCounts);
+            SumAreas(*Root, ReferenceCounts);
+            return Root;
+        }
+
+    private:
+        bool bSpatial;
+        int32 MaxObjects;
+        int32 ReferenceBudget;
+        float RootArea;
+
+        FBVHNode* BuildNode(TArray<FReference>& References)
+        {
+            FBVHNode* Node = new FBVHNode();
+            Node->Bound = EmptyBounds();
+            FBounds3 CentroidBound = EmptyBounds();
+            for (const FReference& Reference : References)
+            {
+                Node->Bound.Union(Reference.Bound);
+                CentroidBound.Union((Reference.Bound.pMin + Reference.Bound.pMax) * 0.5f);
+            }
+            if (References.Num() <= MaxObjects)
+            {
+                for (const FReference& Reference : References)
+                {
+                    Node->Objects.Add(Reference.Object);
+                }
+                return Node;
+            }
+
+            TArray<FReference> Left, Right;
+            const FSplit ObjectSplit = FindObjectSplit(References, CentroidBound);
+            FSplit SpatialSplit;
+            if (bSpatial && ReferenceBudget > 0 && ObjectSplit.Axis >= 0
+                && GetArea(Overlap(ObjectSplit.Left, ObjectSplit.Right)) > SpatialSplitAlpha * RootArea)
+            {
+                SpatialSplit = FindSpatialSplit(References, Node->Bound);
+            }
+            if (SpatialSplit.Axis >= 0 && SpatialSplit.Cost < ObjectSplit.Cost)
+            {
+                SplitSpatial(References, SpatialSplit, Left, Right);
+            }
+            else if (ObjectSplit.Axis >= 0)
+            {
+                SplitObjects(References, ObjectSplit, CentroidBound, Left, Right);
+            }
+            if (Left.Num() == 0 || Right.Num() == 0)
+            {
+                // All centroids in one place, halve the list like the median builder
+                Left.Reset();
+                Right.Reset();
+                const int32 Middle = References.Num() / 2;
+                Left.Append(References.GetData(), Middle);
+                Right.Append(References.GetData() + Middle, References.Num() - Middle);
+            }
+            References.Empty();
+
+            Node->Left = MakeShareable(BuildNode(Left));
+            Node->Right = MakeShareable(BuildNode(Right));
+            return Node;
+        }
+
+        FSplit FindObjectSplit(const TArray<FReference>& References, const FBounds3& CentroidBound) const
+        {
+            FSplit Best;
+            for (int32 Axis = 0; Axis < 3; ++Axis)
+            {
+                const float Min = CentroidBound.pMin[Axis];
+                const float Extent = CentroidBound.pMax[Axis] - Min;
+                if (Extent <= 0)
+                {
+                    continue;
+                }
+                FBounds3 BinBounds[BinCount];
+                int32 BinCounts[BinCount] = {};
+                for (int32 Bin = 0; Bin < BinCount; ++Bin)
+                {
+                    BinBounds[Bin] = EmptyBounds();
+                }
+                for (const FReference& Reference : References)
+                {
+                    const int32 Bin = FMath::Min((int32)((Centroid(Reference.Bound, Axis) - Min) / Extent * BinCount), BinCount - 1);
+                    BinBounds[Bin].Union(Reference.Bound);
+                    ++BinCounts[Bin];
+                }
+                FBounds3 RightBounds[BinCount];
+                RightBounds[BinCount - 1] = BinBounds[BinCount - 1];
+                for (int32 Bin = BinCount - 2; Bin > 0; --Bin)
+                {
+                    RightBounds[Bin] = Union(RightBounds[Bin + 1], BinBounds[Bin]);
+                }
+                FBounds3 LeftBound = EmptyBounds();
+                int32 LeftCount = 0;
+                for (int32 Bin = 0; Bin < BinCount - 1; ++Bin)
+                {
+                    LeftBound.Union(BinBounds[Bin]);
+                    LeftCount += BinCounts[Bin];
+                    const int32 RightCount = References.Num() - LeftCount;
+                    if (LeftCount == 0 || RightCount == 0)
+                    {
+                        continue;
+                    }
+                    const float Cost = GetArea(LeftBound) * LeftCount + GetArea(RightBounds[Bin + 1]) * RightCount;
+                    if (Cost < Best.Cost)
+                    {
+                        Best.Cost = Cost;
+                        Best.Axis = Axis;
+                        Best.Bin = Bin;
+                        Best.Left = LeftBound;
+                        Best.Right = RightBounds[Bin + 1];
+                    }
+                }
+            }
+            return Best;
+        }
+
+        FSplit FindSpatialSplit(const TArray<FReference>& References, const FBounds3& NodeBound) const
+        {
+            FSplit Best;
+            for (int32 Axis = 0; Axis < 3; ++Axis)
+            {
+                const float Min = NodeBound.pMin[Axis];
+                const float Width = (NodeBound.pMax[Axis] - Min) / BinCount;
+                if (Width <= 0)
+                {
+                    continue;
+                }
+                FBounds3 BinBounds[BinCount];
+                int32 Entries[BinCount] = {};
+                int32 Exits[BinCount] = {};
+                for (int32 Bin = 0; Bin < BinCount; ++Bin)
+                {
+                    BinBounds[Bin] = EmptyBounds();
+                }
+                for (const FReference& Reference : References)
+                {
+                    const int32 FirstBin = FMath::Clamp((int32)((Reference.Bound.pMin[Axis] - Min) / Width), 0, BinCount - 1);
+                    const int32 LastBin = FMath::Clamp((int32)((Reference.Bound.pMax[Axis] - Min) / Width), FirstBin, BinCount - 1);
+                    // Chop the reference into a piece per bin it touches
+                    FBounds3 Rest = Reference.Bound;
+                    for (int32 Bin = FirstBin; Bin < LastBin; ++Bin)
+                    {
+                        FBounds3 Piece, Next;
+                        Reference.Object->SplitBounds(Rest, Axis, Min + Width * (Bin + 1), Piece, Next);
+                        if (!IsEmpty(Piece))
+                            BinBounds[Bin].Union(Piece);
+                        Rest = Next;
+                    }
+                    if (!IsEmpty(Rest))
+                        BinBounds[LastBin].Union(Rest);
+                    ++Entries[FirstBin];
+                    ++Exits[LastBin];
+                }
+                FBounds3 RightBounds[BinCount];
+                int32 RightCounts[BinCount];
+                RightBounds[BinCount - 1] = BinBounds[BinCount - 1];
+                RightCounts[BinCount - 1] = Exits[BinCount - 1];
+                for (int32 Bin = BinCount - 2; Bin > 0; --Bin)
+                {
+                    RightBounds[Bin] = Union(RightBounds[Bin + 1], BinBounds[Bin]);
+                    RightCounts[Bin] = RightCounts[Bin + 1] + Exits[Bin];
+                }
+                FBounds3 LeftBound = EmptyBounds();
+                int32 LeftCount = 0;
+                for (int32 Bin = 0; Bin < BinCount - 1; ++Bin)
+                {
+                    LeftBound.Union(BinBounds[Bin]);
+                    LeftCount += Entries[Bin];
+                    const int32 RightCount = RightCounts[Bin + 1];
+                    if (LeftCount == 0 || RightCount == 0)
+                    {
+                        continue;
+                    }
+                    const float Cost = GetArea(LeftBound) * LeftCount + GetArea(RightBounds[Bin + 1]) * RightCount;
+                    if (Cost < Best.Cost)
+                    {
+                        Best.Cost = Cost;
+                        Best.Axis = Axis;
+                        Best.Position = Min + Width * (Bin + 1);
+                        Best.Left = LeftBound;
+                        Best.Right = RightBounds[Bin + 1];
+                    }
+                }
+            }
+            return Best;
+        }
+
+        void SplitObjects(const TArray<FReference>& References, const FSplit& Split, const FBounds3& CentroidBound, TArray<FReference>& Left, TArray<FReference>& Right) const
+        {
+            const float Min = CentroidBound.pMin[Split.Axis];
+            const float Extent = CentroidBound.pMax[Split.Axis] - Min;
+            for (const FReference& Reference : References)
+            {
+                const int32 Bin = FMath::Min((int32)((Centroid(Reference.Bound, Split.Axis) - Min) / Extent * BinCount), BinCount - 1);
+                (Bin <= Split.Bin ? Left : Right).Add(Reference);
+            }
+        }
+
+        void SplitSpatial(const TArray<FReference>& References, const FSplit& Split, TArray<FReference>& Left, TArray<FReference>& Right)
+        {
+            const int32 Axis = Split.Axis;
+            FBounds3 LeftBound = EmptyBounds();
+            FBounds3 RightBound = EmptyBounds();
+            TArray<const FReference*> Straddling;
+            for (const FReference& Reference : References)
+            {
+                if (Reference.Bound.pMax[Axis] <= Split.Position)
+                {
+                    Left.Add(Reference);
+                    LeftBound.Union(Reference.Bound);
+                }
+                else if (Reference.Bound.pMin[Axis] >= Split.Position)
+                {
+                    Right.Add(Reference);
+                    RightBound.Union(Reference.Bound);
+                }
+                else
+                {
+                    Straddling.Add(&Reference);
+                }
+            }
+            // Each straddling reference is split, or moved whole to one side when that is cheaper or the budget is spent
+            int32 LeftCount = Left.Num() + Straddling.Num();
+            int32 RightCount = Right.Num() + Straddling.Num();
+            for (const FReference* Reference : Straddling)
+            {
+                FBounds3 LeftPiece, RightPiece;
+                Reference->Object->SplitBounds(Reference->Bound, Axis, Split.Position, LeftPiece, RightPiece);
+                const float SplitCost = ReferenceBudget > 0 && !IsEmpty(LeftPiece) && !IsEmpty(RightPiece)
+                    ? GetArea(Union(LeftBound, LeftPiece)) * LeftCount + GetArea(Union(RightBound, RightPiece)) * RightCount
+                    : TNumericLimits<float>::Max();
+                const float LeftCost = GetArea(Union(LeftBound, Reference->Bound)) * LeftCount + GetArea(RightBound) * (RightCount - 1);
+                const float RightCost = GetArea(LeftBound) * (LeftCount - 1) + GetArea(Union(RightBound, Reference->Bound)) * RightCount;
+                if (SplitCost <= LeftCost && SplitCost <= RightCost)
+                {
+                    Left.Add({ Reference->Object, LeftPiece });
+                    Right.Add({ Reference->Object, RightPiece });
+                    LeftBound.Union(LeftPiece);
+                    RightBound.Union(RightPiece);
+                    --ReferenceBudget;
+                }
+                else if (LeftCost <= RightCost)
+                {
+                    Left.Add(*Reference);
+                    LeftBound.Union(Reference->Bound);
+                    --RightCount;
+                }
+                else
+                {
+                    Right.Add(*Reference);
+                    RightBound.Union(Reference->Bound);
+                    --LeftCount;
+                }
+            }
+        }
+
+        void CountReferences(const FBVHNode& Node, TMap<IObjectInterface*, int32>& ReferenceCounts) const
+        {
+            for (IObjectInterface* Object : Node.Objects)
+            {
+                ++ReferenceCounts.FindOrAdd(Object);
+            }
+            if (Node.Left)
+                CountReferences(*Node.Left, ReferenceCounts);
+            if (Node.Right)
+                CountReferences(*Node.Right, ReferenceCounts);
+        }
+
+        void SumAreas(FBVHNode& Node, const TMap<IObjectInterface*, int32>& ReferenceCounts) const
+        {
+            Node.Area = 0;
+            for (IObjectInterface* Object : Node.Objects)
+            {
+                Node.Area += Object->GetArea() / ReferenceCounts.FindChecked(Object);
+            }
+            if (Node.Left && Node.Right)
+            {
+                SumAreas(*Node.Left, ReferenceCounts);
+                SumAreas(*Node.Right, ReferenceCounts);
+                Node.Area = Node.Left->Area + Node.Right->Area;
+            }
+        }
+    };
+}
+
+void UBVHTree::BuildTree(TArray<IObjectInterface*> Objects, int32 MaxTriangleInNode, uint64 ContentHash)
+{
+    RENDER_TRACE_SCOPE(BuildBVH);
     check(MaxTriangleInNode > 0);
     _MaxTriangleInNode = MaxTriangleInNode;
-    RootNode = MakeShareable(RecursiveBuild(Objects));
+    uint32 SettingsHash = HashCombine(GetTypeHash(MaxTriangleInNode), GetTypeHash((uint8)SplitMethod));
+    if (SplitMethod == EBVHSplitMethod::Spatial)
+    {
+        SettingsHash = HashCombine(SettingsHash, GetTypeHash(MaxReferenceGrowth));
+    }
+    const uint64 CacheKey = ContentHash && FBVHCache::IsEnabled() ? FBVHCache::MakeKey(ContentHash, SettingsHash) : 0;
+    QuantizedNodes.Empty();
+    LeafObjects.Empty();
+    LeafAreaSums.Empty();
+    bool bLoaded = false;
+    if (CacheKey)
+    {
+        RENDER_TRACE_SCOPE(LoadCachedBVH);
+        FBVHCacheView View;
+        if (FBVHCache::Load(CacheKey, Objects.Num(), View))
+        {
+            RootNode = MakeShareable(View.NodeCount > 0 ? Unflatten(View, Objects, 0, 0) : nullptr);
+            bLoaded = RootNode || View.NodeCount == 0;
+        }
+    }
+    if (!bLoaded)
+    {
+        if (SplitMethod == EBVHSplitMethod::Median)
+        {
+            RootNode = MakeShareable(RecursiveBuild(Objects));
+        }
+        else
+        {
+            const int32 ReferenceBudget = SplitMethod == EBVHSplitMethod::Spatial ? FMath::FloorToInt(Objects.Num() * FMath::Max(MaxReferenceGrowth, 0.f)) : 0;
+            RootNode = MakeShareable(BVHBuild::FBuilder(SplitMethod == EBVHSplitMethod::Spatial, MaxTriangleInNode, ReferenceBudget).Build(Objects));
+        }
+    }
+    if (CacheKey && !bLoaded)
+    {
+        TMap<IObjectInterface*, int32> ObjectIndices;
+        ObjectIndices.Reserve(Objects.Num());
+        for (int32 i = 0; i < Objects.Num(); ++i)
+        {
+            ObjectIndices.Add(Objects[i], i);
+        }
+        TArray<FBVHFlatNode> Nodes;
+        TArray<int32> ObjectOrder;
+        if (RootNode)
+        {
+            Flatten(*RootNode, ObjectIndices, Nodes, ObjectOrder);
+        }
+        FBVHCache::Save(CacheKey, Objects.Num(), Nodes, ObjectOrder);
+    }
+    // Leaf sizes have to fit the 8 bit counts
+    if (NodeLayout == EBVHNodeLayout::Quantized && RootNode && ensure(MaxTriangleInNode <= MAX_uint8))
+    {
+        RENDER_TRACE_SCOPE(QuantizeBVH);
+        QuantizedBound = RootNode->Bound;
+        Quantize(*RootNode);
+        RootNode.Reset();
+    }
+}
+
+int32 UBVHTree::Quantize(const FBVHNode& Node)
+{
+    // Open the biggest interior child until there are four, a leaf root becomes the only child
+    TArray<const FBVHNode*, TInlineAllocator<4>> Children;
+    if (Node.Left && Node.Right)
+    {
+        Children.Add(Node.Left.Get());
+        Children.Add(Node.Right.Get());
+    }
+    else
+    {
+        Children.Add(&Node);
+    }
+    while (Children.Num() < 4)
+    {
+        int32 Widest = INDEX_NONE;
+        double WidestArea = -1;
+        for (int32 i = 0; i < Children.Num(); ++i)
+        {
+            if (Children[i]->Left && Children[i]->Right && Children[i]->Bound.SurfaceArea() > WidestArea)
+            {
+                Widest = i;
+                WidestArea = Children[i]->Bound.SurfaceArea();
+            }
+        }
+        if (Widest == INDEX_NONE)
+        {
+            break;
+        }
+        const FBVHNode* Opened = Children[Widest];
+        Children[Widest] = Opened->Left.Get();
+        Children.Add(Opened->Right.Get());
+    }
+
+    FBounds3 Bound(Children[0]->Bound.pMin, Children[0]->Bound.pMax);
+    for (const FBVHNode* Child : Children)
+    {
+        Bound.Union(Child->Bound);
+    }
+    const int32 Index = QuantizedNodes.AddZeroed();
+    FBVHQuantizedNode& Quantized = QuantizedNodes[Index];
+    for (int32 Axis = 0; Axis < 3; ++Axis)
+    {
+        const float Origin = Bound.pMin[Axis];
+        const float Extent = Bound.pMax[Axis] - Origin;
+        int32 Exponent = Extent > 0 ? FMath::Clamp(FMath::CeilToInt(FMath::Log2(Extent / MAX_uint8)), -126, 127) : -126;
+        Quantized.Origin[Axis] = Origin;
+        Quantized.Exponent[Axis] = (int8)Exponent;
+        // Rounding may leave the last step short of the box
+        while (Exponent < 127 && Origin + MAX_uint8 * Quantized.GetScale(Axis) < Bound.pMax[Axis])
+        {
+            Quantized.Exponent[Axis] = (int8)++Exponent;
+        }
+        const float Scale = Quantized.GetScale(Axis);
+        for (int32 i = 0; i < 4; ++i)
+        {
+            if (i >= Children.Num())
+            {
+                continue;
+            }
+            const FBounds3& ChildBound = Children[i]->Bound;
+            int32 Min = FMath::Clamp(FMath::FloorToInt((ChildBound.pMin[Axis] - Origin) / Scale), 0, (int32)MAX_uint8);
+            int32 Max = FMath::Clamp(FMath::CeilToInt((ChildBound.pMax[Axis] - Origin) / Scale), 0, (int32)MAX_uint8);
+            // The decoded box must contain the child after float rounding too
+            if (Min > 0 && Origin + Min * Scale > ChildBound.pMin[Axis])
+                --Min;
+            if (Max < MAX_uint8 && Origin + Max * Scale < ChildBound.pMax[Axis])
+                ++Max;
+            Quantized.QuantizedMin[Axis][i] = (uint8)Min;
+            Quantized.QuantizedMax[Axis][i] = (uint8)Max;
+        }
+    }
+    Quantized.ChildMask = (1 << Children.Num()) - 1;
+    for (int32 i = 0; i < 4; ++i)
+    {
+        QuantizedNodes[Index].Child[i] = INDEX_NONE;
+    }
+
+    for (int32 i = 0; i < Children.Num(); ++i)
+    {
+        const FBVHNode& Child = *Children[i];
+        if (Child.Left && Child.Right)
+        {
+            // Recursion grows the array, index instead of holding on to Quantized
+            const int32 ChildIndex = Quantize(Child);
+            QuantizedNodes[Index].Child[i] = ChildIndex;
+        }
+        else
+        {
+            QuantizedNodes[Index].Child[i] = LeafObjects.Num();
+            QuantizedNodes[Index].LeafCount[i] = (uint8)Child.Objects.Num();
+            // The leaf area is shared in proportion to the objects' own areas
+            float ObjectArea = 0;
+            for (IObjectInterface* Object : Child.Objects)
+            {
+                ObjectArea += Object->GetArea();
+            }
+            for (IObjectInterface* Object : Child.Objects)
+            {
+                const float Share = ObjectArea > 0 ? Child.Area * Object->GetArea() / ObjectArea : 0;
+                LeafObjects.Add(Object);
+                LeafAreaSums.Add((LeafAreaSums.Num() > 0 ? LeafAreaSums.Last() : 0) + Share);
+            }
+        }
+    }
+    return Index;
+}
+
+FBounds3 FBVHQuantizedNode::GetChildBounds(int32 Index) const
+{
+    FBounds3 Bound;
+    for (int32 Axis = 0; Axis < 3; ++Axis)
+    {
+        const float Scale = GetScale(Axis);
+        Bound.pMin[Axis] = Origin[Axis] + QuantizedMin[Axis][Index] * Scale;
+        Bound.pMax[Axis] = Origin[Axis] + QuantizedMax[Axis][Index] * Scale;
+    }
+    return Bound;
+}
+
+FIntersection UBVHTree::IntersectQuantized(const FLightRay& Ray, FTraversalCounters* Counters) const
+{
+    FIntersection Closest;
+    bool IsNeg[] = { Ray.Direction.X > 0, Ray.Direction.Y > 0, Ray.Direction.Z > 0 };
+    if (QuantizedNodes.Num() == 0 || !QuantizedBound.IntersectP(Ray, Ray.DirectionInv, IsNeg))
+    {
+        return Closest;
+    }
+    // Hits report distances, boxes are tested in ray parameters
+    const float DirectionLength = Ray.Direction.Size();
+    VectorRegister TMax = VectorSetFloat1(TNumericLimits<float>::Max());
+    const VectorRegister Origin[3] = { VectorSetFloat1(Ray.Origin.X), VectorSetFloat1(Ray.Origin.Y), VectorSetFloat1(Ray.Origin.Z) };
+    const VectorRegister Inv[3] = { VectorSetFloat1(Ray.DirectionInv.X), VectorSetFloat1(Ray.DirectionInv.Y), VectorSetFloat1(Ray.DirectionInv.Z) };
+    TArray<int32, TInlineAllocator<128>> Stack;
+    Stack.Add(0);
+    while (Stack.Num() > 0)
+    {
+        const FBVHQuantizedNode& Node = QuantizedNodes[Stack.Pop(false)];
+#if WITH_RAY_STATS
+        if (Counters)
+        {
+            ++Counters->Nodes;
+        }
+#endif
+        VectorRegister EntryRegister;
+        uint32 HitMask = Node.IntersectChildren(Origin, Inv, TMax, EntryRegister);
+        MS_ALIGN(16) float Entry[4] GCC_ALIGN(16);
+        VectorStoreAligned(EntryRegister, Entry);
+        // Push the far children first so the nearest is traced next
+        while (HitMask)
+        {
+            int32 Farthest = FMath::CountTrailingZeros(HitMask);
+            for (uint32 Rest = HitMask & (HitMask - 1); Rest; Rest &= Rest - 1)
+            {
+                const int32 i = FMath::CountTrailingZeros(Rest);
+                if (Entry[i] > Entry[Farthest])
+                    Farthest = i;
+            }
+            HitMask &= ~(1u << Farthest);
+            if (Node.LeafCount[Farthest] == 0)
+            {
+                Stack.Add(Node.Child[Farthest]);
+                continue;
+            }
+#if WITH_RAY_STATS
+            if (Counters)
+            {
+                ++Counters->Leaves;
+                Counters->Primitives += Node.LeafCount[Farthest];
+            }
+#endif
+            for (int32 i = Node.Child[Farthest]; i < Node.Child[Farthest] + Node.LeafCount[Farthest]; ++i)
+            {
+                const FIntersection Hit = LeafObjects[i]->GetIntersection(Ray);
+                if (Hit.bBlockingHit && Hit.Distance < Closest.Distance)
+                {
+                    Closest = Hit;
+                    TMax = VectorSetFloat1(Hit.Distance / DirectionLength);
+                }
+            }
+        }
+    }
+    return Closest;
+}
+
+void UBVHTree::IntersectPacketQuantized(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits, FTraversalCounters* Counters) const
+{
+    struct FStackEntry
+    {
+        int32 Node;
+        uint32 Mask;
+    };
+    ActiveMask = Packet.IntersectBounds(QuantizedBound, ActiveMask);
+    if (QuantizedNodes.Num() == 0 || !ActiveMask)
+    {
+        return;
+    }
+    TArray<FStackEntry, TInlineAllocator<128>> Stack;
+    Stack.Add({ 0, ActiveMask });
+    while (Stack.Num() > 0)
+    {
+        const FStackEntry Entry = Stack.Pop(false);
+        const FBVHQuantizedNode& Node = QuantizedNodes[Entry.Node];
+#if WITH_RAY_STATS
+        if (Counters)
+        {
+            Counters->Nodes += FMath::CountBits(Entry.Mask);
+        }
+#endif
+        for (int32 i = 0; i < 4; ++i)
+        {
+            if (!(Node.ChildMask & (1 << i)))
+            {
+                continue;
+            }
+            const uint32 Mask = Packet.IntersectBounds(Node.GetChildBounds(i), Entry.Mask);
+            if (!Mask)
+            {
+                continue;
+            }
+            if (Node.LeafCount[i] == 0)
+            {
+                Stack.Add({ Node.Child[i], Mask });
+                continue;
+            }
+#if WITH_RAY_STATS
+            if (Counters)
+            {
+                Counters->Leaves += FMath::CountBits(Mask);
+                Counters->Primitives += FMath::CountBits(Mask) * Node.LeafCount[i];
+            }
+#endif
+            for (int32 Object = Node.Child[i]; Object < Node.Child[i] + Node.LeafCount[i]; ++Object)
+            {
+                LeafObjects[Object]->GetIntersectionPacket(Packet, Mask, Hits);
+            }
+        }
+    }
+}
+
+void UBVHTree::DrawQuantized(UObject* WorldContextObject, int32 NodeIndex, int32 Depth) const
+{
+    const FBVHQuantizedNode& Node = QuantizedNodes[NodeIndex];
+    for (int32 i = 0; i < 4; ++i)
+    {
+        if (!(Node.ChildMask & (1 << i)))
+        {
+            continue;
+        }
+        if (Depth == 0)
+        {
+            FBounds3 Bound = Node.GetChildBounds(i);
+            FVector Center = Bound.Centroid();
+            FLinearColor Color = (Center / Center.GetAbsMax()).GetAbs();
+            UKismetSystemLibrary::DrawDebugBox(WorldContextObject, Center, (Bound.pMax - Bound.pMin) * 0.52f, Color);
+        }
+        else if (Node.LeafCount[i] == 0)
+        {
+            DrawQuantized(WorldContextObject, Node.Child[i], Depth - 1);
+        }
+    }
+}
+
+void UBVHTree::Flatten(const FBVHNode& Node, const TMap<IObjectInterface*, int32>& ObjectIndices, TArray<FBVHFlatNode>& OutNodes, TArray<int32>& OutObjectIndices) const
+{
+    const int32 Index = OutNodes.AddUninitialized();
+    FBVHFlatNode& Flat = OutNodes[Index];
+    Flat.Min = Node.Bound.pMin;
+    Flat.Max = Node.Bound.pMax;
+    Flat.Area = Node.Area;
+    if (Node.Left && Node.Right)
+    {
+        Flat.Count = 0;
+        Flatten(*Node.Left, ObjectIndices, OutNodes, OutObjectIndices);
+        // The array may have grown, Flat is stale
+        OutNodes[Index].RightOrFirst = OutNodes.Num();
+        Flatten(*Node.Right, ObjectIndices, OutNodes, OutObjectIndices);
+    }
+    else
+    {
+        Flat.RightOrFirst = OutObjectIndices.Num();
+        Flat.Count = Node.Objects.Num();
+        for (IObjectInterface* Object : Node.Objects)
+        {
+            OutObjectIndices.Add(ObjectIndices.FindChecked(Object));
+        }
+    }
+}
+
+FBVHNode* UBVHTree::Unflatten(const FBVHCacheView& View, const TArray<IObjectInterface*>& Objects, int32 NodeIndex, int32 Depth) const
+{
+    // Children always come after their parent, so a bad index can not loop, but it can run too deep
+    if (NodeIndex < 0 || NodeIndex >= View.NodeCount || Depth > 256)
+    {
+        return nullptr;
+    }
+    const FBVHFlatNode& Flat = View.Nodes[NodeIndex];
+    TUniquePtr<FBVHNode> Node(new FBVHNode());
+    Node->Bound.pMin = Flat.Min;
+    Node->Bound.pMax = Flat.Max;
+    Node->Area = Flat.Area;
+    if (Flat.Count == 0)
+    {
+        if (Flat.RightOrFirst <= NodeIndex + 1)
+        {
+            return nullptr;
+        }
+        Node->Left = MakeShareable(Unflatten(View, Objects, NodeIndex + 1, Depth + 1));
+        Node->Right = MakeShareable(Unflatten(View, Objects, Flat.RightOrFirst, Depth + 1));
+        if (!Node->Left || !Node->Right)
+        {
+            return nullptr;
+        }
+    }
+    else
+    {
+        if (Flat.Count < 0 || Flat.RightOrFirst < 0 || Flat.RightOrFirst + Flat.Count > View.ObjectIndexCount)
+        {
+            return nullptr;
+        }
+        Node->Objects.Reserve(Flat.Count);
+        for (int32 i = 0; i < Flat.Count; ++i)
+        {
+            const int32 ObjectIndex = View.ObjectIndices[Flat.RightOrFirst + i];
+            if (!Objects.IsValidIndex(ObjectIndex))
+            {
+                return nullptr;
+            }
+            Node->Objects.Add(Objects[ObjectIndex]);
+        }
+    }
+    return Node.Release();
 }
 
 FBVHNode* UBVHTree::RecursiveBuild(TArray<IObjectInterface*> Objects)
@@ -81,6 +865,10 @@ FBVHNode* UBVHTree::RecursiveBuild(TArray<IObjectInterface*> Objects)
 
 FIntersection UBVHTree::Intersect(const FLightRay& Ray, bool bDraw)
 {
+    if (QuantizedNodes.Num() > 0)
+    {
+        return IntersectQuantized(Ray, GetThreadCounters());
+    }
     if (RootNode)
     {
         if (bDraw && IsInGameThread())
@@ -91,11 +879,100 @@ FIntersection UBVHTree::Intersect(const FLightRay& Ray, bool bDraw)
                 DrawDepth = 0;
             }
         }
-        return GetIntersection(RootNode.ToSharedRef(), Ray, bDraw, 0);
+        return GetIntersection(RootNode.ToSharedRef(), Ray, bDraw, 0, GetThreadCounters());
     }
     return FIntersection();
 }
 
+void UBVHTree::IntersectPacket(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits)
+{
+    struct FStackEntry
+    {
+        FBVHNode* Node;
+        uint32 Mask;
+    };
+    if (QuantizedNodes.Num() > 0)
+    {
+        IntersectPacketQuantized(Packet, ActiveMask, Hits, GetThreadCounters());
+        return;
+    }
+    if (!RootNode || !ActiveMask)
+    {
+        return;
+    }
+    FTraversalCounters* Counters = GetThreadCounters();
+    TArray<FStackEntry, TInlineAllocator<64>> Stack;
+    Stack.Add({ RootNode.Get(), ActiveMask });
+    while (Stack.Num() > 0)
+    {
+        const FStackEntry Entry = Stack.Pop(false);
+        FBVHNode& Node = *Entry.Node;
+#if WITH_RAY_STATS
+        if (Counters)
+        {
+            Counters->Nodes += FMath::CountBits(Entry.Mask);
+        }
+#endif
+        const uint32 Mask = Packet.IntersectBounds(Node.Bound, Entry.Mask);
+        if (!Mask)
+        {
+            continue;
+        }
+        if (FMath::CountBits(Mask) < PacketMinActiveRays)
+        {
+            // Diverged, finish the subtree with the single ray traversal
+#if WITH_RAY_STATS
+            if (Counters)
+            {
+                Counters->Nodes -= FMath::CountBits(Mask);
+            }
+#endif
+            for (int32 i = 0; i < Packet.Num; ++i)
+            {
+                if (Mask & (1u << i))
+                {
+                    FIntersection Hit = GetIntersection(Node.AsShared(), Packet.Rays[i], false, 0, Counters);
+                    if (Hit.bBlockingHit && Hit.Distance < Hits[i].Distance)
+                    {
+                        Hits[i] = Hit;
+                        Packet.TMax[i] = Hit.Distance;
+                    }
+                }
+            }
+        }
+        else if (Node.Left && Node.Right)
+        {
+            // Visit the child nearer along the first active ray first, so TMax shrinks early
+            const int32 First = FMath::CountTrailingZeros(Mask);
+            const FVector Towards = Node.Right->Bound.Centroid() - Node.Left->Bound.Centroid();
+            if (FVector::DotProduct(Towards, Packet.Rays[First].Direction) < 0)
+            {
+                Stack.Add({ Node.Left.Get(), Mask });
+                Stack.Add({ Node.Right.Get(), Mask });
+            }
+            else
+            {
+                Stack.Add({ Node.Right.Get(), Mask });
+                Stack.Add({ Node.Left.Get(), Mask });
+            }
+        }
+        else
+        {
+#if WITH_RAY_STATS
+            if (Counters)
+            {
+                Counters->Leaves += FMath::CountBits(Mask);
+                Counters->Primitives += FMath::CountBits(Mask) * Node.Objects.Num();
+            }
+#endif
+            for (IObjectInterface* Obj : Node.Objects)
+            {
+                Obj->GetIntersectionPacket(Packet, Mask, Hits);
+            }
+        }
+    }
+}
+
 void UBVHTree::ClearTriangleColor()
 {
     if (RootNode)
@@ -103,10 +980,26 @@ void UBVHTree::ClearTriangleColor()
         ColorTriangle(RootNode.ToSharedRef(), FLinearColor::Gray);
         DrawDepth = 0;
     }
+    for (IObjectInterface* Obj : LeafObjects)
+    {
+        Obj->SetColor(FLinearColor::Gray);
+    }
 }
 
 void UBVHTree::Sample(FIntersection& Position, float& Pdf)
 {
+    if (LeafAreaSums.Num() > 0)
+    {
+        // Same distribution as the pointer tree, searched in the summed leaf areas
+        const float Area = LeafAreaSums.Last();
+        const float p = FMath::Sqrt(FMath::FRand()) * Area;
+        const int32 Index = FMath::Min(Algo::UpperBound(LeafAreaSums, p), LeafAreaSums.Num() - 1);
+        LeafObjects[Index]->Sample(Position, Pdf);
+        // All the leaves of a split object add up to its whole area
+        Pdf *= LeafObjects[Index]->GetArea();
+        Pdf /= Area;
+        return;
+    }
     float p = FMath::Sqrt(FMath::FRand()) * RootNode->Area;
     GetSample(RootNode.ToSharedRef(), p, Position, Pdf);
     Pdf /= RootNode->Area;
@@ -118,9 +1011,22 @@ void UBVHTree::DrawTree(UObject* WorldContextObject, int32 Depth)
     {
         RootNode->DrawNode(WorldContextObject, Depth);
     }
+    else if (QuantizedNodes.Num() > 0 && IsInGameThread())
+    {
+        DrawQuantized(WorldContextObject, 0, Depth);
+    }
 }
 
-FIntersection UBVHTree::GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, const FLightRay& Ray, bool bDraw, int32 Depth)
+FBounds3 UBVHTree::GetBounds() const
+{
+    if (QuantizedNodes.Num() > 0)
+    {
+        return QuantizedBound;
+    }
+    return RootNode ? RootNode->Bound : FBounds3();
+}
+
+FIntersection UBVHTree::GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, const FLightRay& Ray, bool bDraw, int32 Depth, FTraversalCounters* Counters)
 {
     if (DrawDepthMax < Depth)
     {
@@ -128,6 +1034,12 @@ FIntersection UBVHTree::GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe
     }
     FIntersection HitResult;
     FBVHNode& Node = NodeRef.Get();
+#if WITH_RAY_STATS
+    if (Counters)
+    {
+        ++Counters->Nodes;
+    }
+#endif
     bool IsNeg[] = { Ray.Direction.X > 0, Ray.Direction.Y > 0, Ray.Direction.Z > 0 };
     if (Node.Bound.IntersectP(Ray, Ray.DirectionInv, IsNeg))
     {
@@ -135,11 +1047,11 @@ FIntersection UBVHTree::GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe
         ensure(!!Node.Left == !!Node.Right);
         if (Node.Left)
         {
-            L = GetIntersection(Node.Left.ToSharedRef(), Ray, bDraw, Depth + 1);
+            L = GetIntersection(Node.Left.ToSharedRef(), Ray, bDraw, Depth + 1, Counters);
         }
         if (Node.Right)
         {
-            R = GetIntersection(Node.Right.ToSharedRef(), Ray, bDraw, Depth + 1);
+            R = GetIntersection(Node.Right.ToSharedRef(), Ray, bDraw, Depth + 1, Counters);
         }
         if (L.bBlockingHit && R.bBlockingHit)
         {
@@ -155,6 +1067,13 @@ FIntersection UBVHTree::GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe
         }
         else
         {
+#if WITH_RAY_STATS
+            if (Counters && Node.Objects.Num() > 0)
+            {
+                ++Counters->Leaves;
+                Counters->Primitives += Node.Objects.Num();
+            }
+#endif
             IObjectInterface* HitObject = nullptr;
             float MinDistance = TNumericLimits<float>::Max();
             for (IObjectInterface* Obj : Node.Objects)
@@ -180,6 +1099,66 @@ FIntersection UBVHTree::GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe
     return HitResult;
 }
 
+int32 UBVHTree::GetNodeCount() const
+{
+    int32 Count = QuantizedNodes.Num();
+    TArray<const FBVHNode*, TInlineAllocator<64>> Stack;
+    if (RootNode)
+    {
+        Stack.Add(RootNode.Get());
+    }
+    while (Stack.Num() > 0)
+    {
+        const FBVHNode* Node = Stack.Pop(false);
+        ++Count;
+        if (Node->Left)
+            Stack.Add(Node->Left.Get());
+        if (Node->Right)
+            Stack.Add(Node->Right.Get());
+    }
+    return Count;
+}
+
+int32 UBVHTree::GetReferenceCount() const
+{
+    int32 Count = LeafObjects.Num();
+    TArray<const FBVHNode*, TInlineAllocator<64>> Stack;
+    if (RootNode)
+    {
+        Stack.Add(RootNode.Get());
+    }
+    while (Stack.Num() > 0)
+    {
+        const FBVHNode* Node = Stack.Pop(false);
+        Count += Node->Objects.Num();
+        if (Node->Left)
+            Stack.Add(Node->Left.Get());
+        if (Node->Right)
+            Stack.Add(Node->Right.Get());
+    }
+    return Count;
+}
+
+SIZE_T UBVHTree::GetAllocatedSize() const
+{
+    SIZE_T Size = QuantizedNodes.GetAllocatedSize() + LeafObjects.GetAllocatedSize() + LeafAreaSums.GetAllocatedSize();
+    TArray<const FBVHNode*, TInlineAllocator<64>> Stack;
+    if (RootNode)
+    {
+        Stack.Add(RootNode.Get());
+    }
+    while (Stack.Num() > 0)
+    {
+        const FBVHNode* Node = Stack.Pop(false);
+        Size += sizeof(FBVHNode) + Node->Objects.GetAllocatedSize();
+        if (Node->Left)
+            Stack.Add(Node->Left.Get());
+        if (Node->Right)
+            Stack.Add(Node->Right.Get());
+    }
+    return Size;
+}
+
 void UBVHTree::ColorTriangle(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, FLinearColor Color)
 {
     FBVHNode& Node = NodeRef.Get();
@@ -197,7 +1176,8 @@ void UBVHTree::GetSample(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, floa
 {
     if (!NodeRef->Left.IsValid() || !NodeRef->Right.IsValid()) {
         NodeRef->Objects[0]->Sample(Position, Pdf);
-        Pdf *= NodeRef->Area;
+        // The leaf only holds a share of a split object, but any of its leaves may pick it
+        Pdf *= NodeRef->Objects[0]->GetArea();
         return;
     }
     if (p < NodeRef->Left->Area)
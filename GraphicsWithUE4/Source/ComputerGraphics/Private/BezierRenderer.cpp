@@ -0,0 +1,324 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "BezierRenderer.h"
+#include "Async/ParallelFor.h"
+#include "DynamicTextureComponent.h"
+#include "RenderStats.h"
+#include "RenderTrace.h"
+
+DECLARE_CYCLE_STAT(TEXT("Bezier Tessellate"), STAT_BezierTessellate, STATGROUP_RayTracer);
+DECLARE_CYCLE_STAT(TEXT("Bezier Tiles"), STAT_BezierTiles, STATGROUP_RayTracer);
+
+// Segments are binned in at most this many chunks, each with bins of its own so no locks are needed
+static const int32 MaxChunks = 16;
+static const int32 MinSegmentsPerChunk = 4096;
+
+void FBezierRenderer::Resize(int32 InWidth, int32 InHeight)
+{
+	Width = FMath::Max(InWidth, 0);
+	Height = FMath::Max(InHeight, 0);
+	TilesX = FMath::DivideAndRoundUp(Width, TileSize);
+	TilesY = FMath::DivideAndRoundUp(Height, TileSize);
+
+	Points.Reset();
+	Curves.Reset();
+	Segments.Reset();
+	Bins.Reset();
+	ChunkCount = 0;
+}
+
+void FBezierRenderer::Begin()
+{
+	Points.Reset();
+	Curves.Reset();
+}
+
+void FBezierRenderer::AddCurves(const FVector2D* ControlPoints, int32 Degree, int32 CurveCount, const FLinearColor* Colors, float Thickness)
+{
+	if (!ControlPoints || CurveCount <= 0)
+	{
+		return;
+	}
+	if (Degree < 1 || Degree > MaxDegree)
+	{
+		UE_LOG(LogTemp, Warning, TEXT(__FUNCTION__" %d:degree %d is not in [1, %d]."), __LINE__, Degree, MaxDegree);
+		return;
+	}
+	const int32 FirstPoint = Points.Num();
+	Points.Append(ControlPoints, CurveCount * (Degree + 1));
+	Curves.Reserve(Curves.Num() + CurveCount);
+	for (int32 Index = 0; Index < CurveCount; ++Index)
+	{
+		FCurve& Curve = Curves.AddDefaulted_GetRef();
+		Curve.FirstPoint = FirstPoint + Index * (Degree + 1);
+		Curve.Degree = Degree;
+		Curve.Color = Colors ? Colors[Index] : FLinearColor::White;
+		Curve.HalfThickness = FMath::Max(Thickness, 0.f) * 0.5f;
+		Curve.FirstSegment = 0;
+		Curve.SegmentCount = 0;
+	}
+}
+
+int32 FBezierRenderer::GetCurveSegmentCount(const FCurve& Curve) const
+{
+	if (Curve.Degree < 2)
+	{
+		return 1;
+	}
+	// A curve with second differences of at most M is within n (n - 1) M / (8 N^2) of its N uniform segments
+	const FVector2D* Control = &Points[Curve.FirstPoint];
+	float MaxSizeSquared = 0.f;
+	for (int32 Index = 0; Index + 2 <= Curve.Degree; ++Index)
+	{
+		MaxSizeSquared = FMath::Max(MaxSizeSquared, (Control[Index + 2] - Control[Index + 1] * 2.f + Control[Index]).SizeSquared());
+	}
+	const float Count = FMath::Sqrt(Curve.Degree * (Curve.Degree - 1) * FMath::Sqrt(MaxSizeSquared) / (8.f * FMath::Max(Tolerance, 0.01f)));
+	// Written so NaNs end up at the limit as well
+	return Count < MaxSegmentsPerCurve ? FMath::Max(FMath::CeilToInt(Count), 1) : MaxSegmentsPerCurve;
+}
+
+void FBezierRenderer::Tessellate(int32 CurveIndex)
+{
+	const FCurve& Curve = Curves[CurveIndex];
+	const FVector2D* Control = &Points[Curve.FirstPoint];
+	FSegment* Out = &Segments[Curve.FirstSegment];
+	const VectorRegister Lane = MakeVectorRegister(0.f, 1.f, 2.f, 3.f);
+	const VectorRegister Step = VectorSetFloat1(1.f / Curve.SegmentCount);
+
+	MS_ALIGN(16) float CurveX[4] GCC_ALIGN(16);
+	MS_ALIGN(16) float CurveY[4] GCC_ALIGN(16);
+	FVector2D Previous = Control[0];
+	for (int32 First = 1; First <= Curve.SegmentCount; First += 4)
+	{
+		// End points of segments First .. First + 3, de Casteljau on all 4 parameters at once
+		const VectorRegister T = VectorMin(VectorMultiply(VectorAdd(VectorSetFloat1(float(First)), Lane), Step), VectorOne());
+		VectorRegister X[MaxDegree + 1];
+		VectorRegister Y[MaxDegree + 1];
+		for (int32 Index = 0; Index <= Curve.Degree; ++Index)
+		{
+			X[Index] = VectorSetFloat1(Control[Index].X);
+			Y[Index] = VectorSetFloat1(Control[Index].Y);
+		}
+		for (int32 Level = Curve.Degree; Level > 0; --Level)
+		{
+			for (int32 Index = 0; Index < Level; ++Index)
+			{
+				X[Index] = VectorMultiplyAdd(VectorSubtract(X[Index + 1], X[Index]), T, X[Index]);
+				Y[Index] = VectorMultiplyAdd(VectorSubtract(Y[Index + 1], Y[Index]), T, Y[Index]);
+			}
+		}
+		VectorStoreAligned(X[0], CurveX);
+		VectorStoreAligned(Y[0], CurveY);
+
+		const int32 Count = FMath::Min(4, Curve.SegmentCount - First + 1);
+		for (int32 Index = 0; Index < Count; ++Index)
+		{
+			// The last segment ends exactly on the last control point, so chained curves meet without gaps
+			const FVector2D Point = First + Index == Curve.SegmentCount ? Control[Curve.Degree] : FVector2D(CurveX[Index], CurveY[Index]);
+			FSegment& Segment = Out[First + Index - 1];
+			Segment.Start = Previous;
+			Segment.End = Point;
+			Segment.Curve = CurveIndex;
+			Previous = Point;
+		}
+	}
+}
+
+void FBezierRenderer::BinSegments()
+{
+	const int32 TileCount = TilesX * TilesY;
+	for (int32 Bin = 0; Bin < ChunkCount * TileCount; ++Bin)
+	{
+		Bins[Bin].Reset();
+	}
+	ChunkCount = FMath::Clamp(FMath::DivideAndRoundUp(Segments.Num(), MinSegmentsPerChunk), 1, MaxChunks);
+	if (Bins.Num() < ChunkCount * TileCount)
+	{
+		Bins.SetNum(ChunkCount * TileCount);
+	}
+
+	// Chunks are contiguous and tiles walk them in order, so the segments of a curve stay together in every tile
+	ParallelFor(ChunkCount, [this, TileCount](int32 Chunk)
+	{
+		TArray<int32>* ChunkBins = &Bins[Chunk * TileCount];
+		const int32 End = int64(Segments.Num()) * (Chunk + 1) / ChunkCount;
+		for (int32 Index = int64(Segments.Num()) * Chunk / ChunkCount; Index < End; ++Index)
+		{
+			const FSegment& Segment = Segments[Index];
+			const float Extent = Curves[Segment.Curve].HalfThickness + 1.f;
+			const float MinX = FMath::Min(Segment.Start.X, Segment.End.X) - Extent;
+			const float MinY = FMath::Min(Segment.Start.Y, Segment.End.Y) - Extent;
+			const float MaxX = FMath::Max(Segment.Start.X, Segment.End.X) + Extent;
+			const float MaxY = FMath::Max(Segment.Start.Y, Segment.End.Y) + Extent;
+			// Written so NaNs fail as well
+			if (!(MaxX >= 0.f && MaxY >= 0.f && MinX < Width && MinY < Height))
+			{
+				continue;
+			}
+			const int32 FirstTileX = FMath::Max(FMath::FloorToInt(MinX / TileSize), 0);
+			const int32 FirstTileY = FMath::Max(FMath::FloorToInt(MinY / TileSize), 0);
+			const int32 LastTileX = FMath::Min(FMath::FloorToInt(FMath::Min(MaxX, float(Width)) / TileSize), TilesX - 1);
+			const int32 LastTileY = FMath::Min(FMath::FloorToInt(FMath::Min(MaxY, float(Height)) / TileSize), TilesY - 1);
+			for (int32 TileY = FirstTileY; TileY <= LastTileY; ++TileY)
+			{
+				for (int32 TileX = FirstTileX; TileX <= LastTileX; ++TileX)
+				{
+					ChunkBins[TileY * TilesX + TileX].Add(Index);
+				}
+			}
+		}
+	});
+}
+
+void FBezierRenderer::RenderTile(int32 Tile, UDynamicTextureComponent* Target) const
+{
+	const int32 TileX = Tile % TilesX * TileSize;
+	const int32 TileY = Tile / TilesX * TileSize;
+	const int32 TileWidth = FMath::Min(TileSize, Width - TileX);
+	const int32 TileHeight = FMath::Min(TileSize, Height - TileY);
+
+	FLinearColor Colors[TileSize * TileSize];
+	for (int32 Index = 0; Index < TileSize * TileSize; ++Index)
+	{
+		Colors[Index] = FLinearColor(ClearColor.R, ClearColor.G, ClearColor.B, 1.f);
+	}
+
+	// Coverage of the current curve, the maximum over its segments. Only the rectangle it touched is non zero
+	MS_ALIGN(16) float Coverage[TileSize * TileSize] GCC_ALIGN(16);
+	FMemory::Memzero(Coverage, sizeof(Coverage));
+	int32 CoverMinX = TileSize, CoverMinY = TileSize, CoverMaxX = -1, CoverMaxY = -1;
+	int32 CurrentCurve = INDEX_NONE;
+
+	auto Composite = [&]()
+	{
+		const FLinearColor& Color = Curves[CurrentCurve].Color;
+		for (int32 Y = CoverMinY; Y <= CoverMaxY; ++Y)
+		{
+			for (int32 X = CoverMinX; X <= CoverMaxX; ++X)
+			{
+				float& Cover = Coverage[Y * TileSize + X];
+				if (Cover > 0.f)
+				{
+					FLinearColor& Dest = Colors[Y * TileSize + X];
+					const float Alpha = Cover * Color.A;
+					Dest.R += (Color.R - Dest.R) * Alpha;
+					Dest.G += (Color.G - Dest.G) * Alpha;
+					Dest.B += (Color.B - Dest.B) * Alpha;
+					Cover = 0.f;
+				}
+			}
+		}
+		CoverMinX = CoverMinY = TileSize;
+		CoverMaxX = CoverMaxY = -1;
+	};
+
+	const VectorRegister Lane = MakeVectorRegister(0.f, 1.f, 2.f, 3.f);
+	const VectorRegister Zero = VectorZero();
+	const VectorRegister One = VectorOne();
+	const VectorRegister Tiny = VectorSetFloat1(SMALL_NUMBER);
+	const int32 TileCount = TilesX * TilesY;
+	for (int32 Chunk = 0; Chunk < ChunkCount; ++Chunk)
+	{
+		for (int32 Index : Bins[Chunk * TileCount + Tile])
+		{
+			const FSegment& Segment = Segments[Index];
+			if (Segment.Curve != CurrentCurve)
+			{
+				if (CurrentCurve != INDEX_NONE)
+				{
+					Composite();
+				}
+				CurrentCurve = Segment.Curve;
+			}
+			const float HalfThickness = Curves[Segment.Curve].HalfThickness;
+
+			// Pixels whose center is within HalfThickness + 0.5 of the segment, in tile coordinates. Clamped before the
+			// conversion, segments may reach far outside the target
+			const float Extent = HalfThickness + 0.5f;
+			auto ToTile = [](float Coordinate, int32 Origin)
+			{
+				return FMath::FloorToInt(FMath::Clamp(Coordinate - Origin, -1.f, float(TileSize)));
+			};
+			const int32 MinX = FMath::Max(ToTile(FMath::Min(Segment.Start.X, Segment.End.X) - Extent, TileX), 0) & ~3;
+			const int32 MinY = FMath::Max(ToTile(FMath::Min(Segment.Start.Y, Segment.End.Y) - Extent, TileY), 0);
+			const int32 MaxX = FMath::Min(ToTile(FMath::Max(Segment.Start.X, Segment.End.X) + Extent, TileX), TileWidth - 1);
+			const int32 MaxY = FMath::Min(ToTile(FMath::Max(Segment.Start.Y, Segment.End.Y) + Extent, TileY), TileHeight - 1);
+			if (MinX > MaxX || MinY > MaxY)
+			{
+				continue;
+			}
+			// Whole groups of 4 are written, TileSize is a multiple of 4
+			CoverMinX = FMath::Min(CoverMinX, MinX);
+			CoverMinY = FMath::Min(CoverMinY, MinY);
+			CoverMaxX = FMath::Max(CoverMaxX, MaxX | 3);
+			CoverMaxY = FMath::Max(CoverMaxY, MaxY);
+
+			// Distance to the segment 4 pixels at a time, coverage falls off linearly over the pixel at the stroke border
+			const FVector2D Direction = Segment.End - Segment.Start;
+			const VectorRegister DirectionX = VectorSetFloat1(Direction.X);
+			const VectorRegister DirectionY = VectorSetFloat1(Direction.Y);
+			const VectorRegister InvSizeSquared = VectorSetFloat1(1.f / FMath::Max(Direction.SizeSquared(), SMALL_NUMBER));
+			const VectorRegister Radius = VectorSetFloat1(Extent);
+			// Strokes thinner than a pixel are fainter instead
+			const VectorRegister MaxCover = VectorSetFloat1(FMath::Min(HalfThickness * 2.f, 1.f));
+			for (int32 Y = MinY; Y <= MaxY; ++Y)
+			{
+				const VectorRegister PixelY = VectorSetFloat1(TileY + Y + 0.5f - Segment.Start.Y);
+				for (int32 X = MinX; X <= MaxX; X += 4)
+				{
+					const VectorRegister PixelX = VectorAdd(VectorSetFloat1(TileX + X + 0.5f - Segment.Start.X), Lane);
+					const VectorRegister T = VectorMin(VectorMax(VectorMultiply(VectorMultiplyAdd(PixelX, DirectionX, VectorMultiply(PixelY, DirectionY)), InvSizeSquared), Zero), One);
+					const VectorRegister OffsetX = VectorSubtract(PixelX, VectorMultiply(T, DirectionX));
+					const VectorRegister OffsetY = VectorSubtract(PixelY, VectorMultiply(T, DirectionY));
+					const VectorRegister DistanceSquared = VectorMultiplyAdd(OffsetX, OffsetX, VectorMultiply(OffsetY, OffsetY));
+					const VectorRegister Distance = VectorMultiply(DistanceSquared, VectorReciprocalSqrtAccurate(VectorMax(DistanceSquared, Tiny)));
+					const VectorRegister Cover = VectorMin(VectorMax(VectorSubtract(Radius, Distance), Zero), MaxCover);
+					float* Dest = Coverage + Y * TileSize + X;
+					VectorStoreAligned(VectorMax(VectorLoadAligned(Dest), Cover), Dest);
+				}
+			}
+		}
+	}
+	if (CurrentCurve != INDEX_NONE)
+	{
+		Composite();
+	}
+	Target->SetPixels(TileX, TileY, TileWidth, TileHeight, Colors, TileSize);
+}
+
+void FBezierRenderer::Render(UDynamicTextureComponent* Target)
+{
+	if (!Target || Target->Width != Width || Target->Height != Height || !Target->IsRectInside(0, 0, Width, Height))
+	{
+		UE_LOG(LogTemp, Warning, TEXT(__FUNCTION__" %d:the target does not match the %dx%d renderer."), __LINE__, Width, Height);
+		return;
+	}
+	{
+		SCOPE_CYCLE_COUNTER(STAT_BezierTessellate);
+		RENDER_TRACE_SCOPE(BezierTessellate);
+		ParallelFor(Curves.Num(), [this](int32 Index)
+		{
+			Curves[Index].SegmentCount = GetCurveSegmentCount(Curves[Index]);
+		});
+		int32 SegmentCount = 0;
+		for (FCurve& Curve : Curves)
+		{
+			Curve.FirstSegment = SegmentCount;
+			SegmentCount += Curve.SegmentCount;
+		}
+		Segments.SetNumUninitialized(SegmentCount, false);
+		ParallelFor(Curves.Num(), [this](int32 Index)
+		{
+			Tessellate(Index);
+		});
+		BinSegments();
+	}
+
+	SCOPE_CYCLE_COUNTER(STAT_BezierTiles);
+	RENDER_TRACE_SCOPE(BezierTiles);
+	ParallelFor(TilesX * TilesY, [this, Target](int32 Tile)
+	{
+		RenderTile(Tile, Target);
+	});
+}
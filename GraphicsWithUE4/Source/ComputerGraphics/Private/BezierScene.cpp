@@ -0,0 +1,98 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "BezierScene.h"
+#include "Components/StaticMeshComponent.h"
+#include "DynamicTextureComponent.h"
+#include "RenderTrace.h"
+
+// Sets default values
+ABezierScene::ABezierScene()
+{
+ 	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+
+	Root = CreateDefaultSubobject<USceneComponent>(TEXT("Root"));
+	RootComponent = Root;
+
+	StaticMesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("StaticMesh"));
+	StaticMesh->SetupAttachment(RootComponent);
+	static ConstructorHelpers::FObjectFinder<UStaticMesh> StaticMeshObject(TEXT("StaticMesh'/Game/HW01/Plane.Plane'"));
+	if (StaticMeshObject.Succeeded()) {
+		StaticMesh->SetStaticMesh(StaticMeshObject.Object);
+	}
+	static ConstructorHelpers::FObjectFinder<UMaterial> MaterialObject(TEXT("Material'/Game/HW06/TextureMaterial.TextureMaterial'"));
+	if (MaterialObject.Succeeded()) {
+		StaticMesh->SetMaterial(0, MaterialObject.Object);
+	}
+
+	Texture = CreateDefaultSubobject<UDynamicTextureComponent>(TEXT("Texture"));
+}
+
+// Called when the game starts or when spawned
+void ABezierScene::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (RandomCurveCount > 0)
+	{
+		FRandomStream Stream(RandomCurveCount);
+		ControlPoints.SetNumUninitialized(RandomCurveCount * (Degree + 1));
+		for (FVector2D& Point : ControlPoints)
+		{
+			Point = FVector2D(Stream.FRand() * Texture->Width, Stream.FRand() * Texture->Height);
+		}
+		Colors.SetNumUninitialized(RandomCurveCount);
+		for (FLinearColor& CurveColor : Colors)
+		{
+			CurveColor = FLinearColor(Stream.FRand(), Stream.FRand(), Stream.FRand());
+		}
+	}
+	Draw();
+}
+
+void ABezierScene::Draw()
+{
+	RENDER_TRACE_SCOPE(DrawBezier);
+	if (Renderer.GetWidth() != Texture->Width || Renderer.GetHeight() != Texture->Height)
+	{
+		Renderer.Resize(Texture->Width, Texture->Height);
+	}
+	Renderer.ClearColor = ClearColor;
+	Renderer.Tolerance = Tolerance;
+
+	// Any other degree would group ControlPoints into the wrong curves
+	if (Degree < 1 || Degree > FBezierRenderer::MaxDegree)
+	{
+		UE_LOG(LogTemp, Warning, TEXT(__FUNCTION__" %d:degree %d is not in [1, %d], nothing is drawn."), __LINE__, Degree, FBezierRenderer::MaxDegree);
+		return;
+	}
+	const int32 CurveCount = ControlPoints.Num() / (Degree + 1);
+	CurveColors.SetNumUninitialized(CurveCount);
+	for (int32 Index = 0; Index < CurveCount; ++Index)
+	{
+		CurveColors[Index] = Colors.IsValidIndex(Index) ? Colors[Index] : Color;
+	}
+	Renderer.Begin();
+	Renderer.AddCurves(ControlPoints.GetData(), Degree, CurveCount, CurveColors.GetData(), Thickness);
+	Renderer.Render(Texture);
+}
+
+void ABezierScene::DrawCurves(const TArray<FVector2D>& InControlPoints, int32 InDegree, const TArray<FLinearColor>& InColors)
+{
+	ControlPoints = InControlPoints;
+	Degree = InDegree;
+	Colors = InColors;
+	Draw();
+}
+
+// Called every frame
+void ABezierScene::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+
+	if (bDrawEveryTick)
+	{
+		Draw();
+	}
+}
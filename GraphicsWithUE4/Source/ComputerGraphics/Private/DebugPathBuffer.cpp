@@ -0,0 +1,99 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "DebugPathBuffer.h"
+#include "Components/LineBatchComponent.h"
+#include "Engine/World.h"
+
+void FDebugPathBuffer::Reset(int32 Capacity)
+{
+	const int32 SlotCount = FMath::RoundUpToPowerOfTwo(FMath::Max(Capacity, 2));
+	Slots.SetNumUninitialized(SlotCount);
+	for (int32 i = 0; i < SlotCount; ++i)
+	{
+		Slots[i].Sequence = i;
+	}
+	Mask = SlotCount - 1;
+	WriteIndex = 0;
+	ReadIndex = 0;
+	Dropped = 0;
+	FPlatformMisc::MemoryBarrier();
+}
+
+bool FDebugPathBuffer::Sample(int32 Interval)
+{
+	static thread_local uint32 Counter = 0;
+	return Interval <= 1 || ++Counter % Interval == 0;
+}
+
+bool FDebugPathBuffer::Add(const FDebugPathSegment& Segment)
+{
+	if (Slots.Num() == 0)
+	{
+		return false;
+	}
+	int64 Position = FPlatformAtomics::AtomicRead(&WriteIndex);
+	FSlot* Slot;
+	for (;;)
+	{
+		Slot = &Slots[Position & Mask];
+		const int64 Turn = FPlatformAtomics::AtomicRead(&Slot->Sequence) - Position;
+		if (Turn == 0)
+		{
+			// The slot is free for this position, claim it
+			const int64 Claimed = FPlatformAtomics::InterlockedCompareExchange(&WriteIndex, Position + 1, Position);
+			if (Claimed == Position)
+			{
+				break;
+			}
+			Position = Claimed;
+		}
+		else if (Turn < 0)
+		{
+			// Still holds the segment of the previous lap, the game thread is behind
+			FPlatformAtomics::InterlockedIncrement(&Dropped);
+			return false;
+		}
+		else
+		{
+			Position = FPlatformAtomics::AtomicRead(&WriteIndex);
+		}
+	}
+	Slot->Segment = Segment;
+	FPlatformMisc::MemoryBarrier();
+	FPlatformAtomics::AtomicStore(&Slot->Sequence, Position + 1);
+	return true;
+}
+
+int32 FDebugPathBuffer::Flush(UWorld* World)
+{
+	TArray<FBatchedLine> Lines;
+	TArray<FBatchedLine> PersistentLines;
+	int32 Count = 0;
+	while (Slots.Num() > 0)
+	{
+		FSlot& Slot = Slots[ReadIndex & Mask];
+		if (FPlatformAtomics::AtomicRead(&Slot.Sequence) != ReadIndex + 1)
+		{
+			// Not published yet, picked up next tick
+			break;
+		}
+		const FDebugPathSegment& Segment = Slot.Segment;
+		(Segment.LifeTime > 0 ? PersistentLines : Lines).Emplace(Segment.Start, Segment.End, Segment.Color, Segment.LifeTime, Segment.Thickness, SDPG_World);
+		FPlatformMisc::MemoryBarrier();
+		FPlatformAtomics::AtomicStore(&Slot.Sequence, ReadIndex + Slots.Num());
+		++ReadIndex;
+		++Count;
+	}
+#if ENABLE_DRAW_DEBUG
+	if (World && World->LineBatcher && Lines.Num() > 0)
+	{
+		World->LineBatcher->DrawLines(Lines);
+	}
+	if (World && World->PersistentLineBatcher && PersistentLines.Num() > 0)
+	{
+		World->PersistentLineBatcher->DrawLines(PersistentLines);
+	}
+#endif
+	return Count;
+}
@@ -0,0 +1,127 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "Denoiser.h"
+#include "Async/ParallelFor.h"
+#include "RenderStats.h"
+#include "RenderTrace.h"
+
+DECLARE_CYCLE_STAT(TEXT("Denoise"), STAT_Denoise, STATGROUP_RayTracer);
+
+// Albedo below this is not divided out, the noise would blow up
+static const float MinAlbedo = 0.01f;
+
+void FDenoiser::Resize(int32 InWidth, int32 InHeight)
+{
+	Width = FMath::Max(InWidth, 0);
+	Height = FMath::Max(InHeight, 0);
+	const int32 PixelCount = Width * Height;
+	InputColors.Reset(PixelCount);
+	InputColors.AddZeroed(PixelCount);
+	InputGuides.Reset(PixelCount);
+	InputGuides.AddZeroed(PixelCount);
+}
+
+void FDenoiser::SetInput(int32 Pixel, const FLinearColor& Color, const FIntersection& Hit)
+{
+	FGuide& Guide = InputGuides[Pixel];
+	InputColors[Pixel] = Color;
+	Guide.Albedo = Hit.Kd.ComponentMax(FVector(MinAlbedo));
+	Guide.Normal = Hit.Normal;
+	Guide.Depth = Hit.bBlockingHit && Hit.Emit.IsNearlyZero() ? Hit.Distance : -1.f;
+}
+
+void FDenoiser::Snapshot()
+{
+	check(!bRunning);
+	Swap(Colors, InputColors);
+	Swap(Guides, InputGuides);
+	if (InputColors.Num() != Colors.Num())
+	{
+		InputColors = Colors;
+		InputGuides = Guides;
+	}
+}
+
+void FDenoiser::Run(const FDenoiseSettings& Settings, TArray<FLinearColor>& Output)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Denoise);
+	RENDER_TRACE_SCOPE(Denoise);
+	const int32 PixelCount = Width * Height;
+	Output.SetNumUninitialized(PixelCount, false);
+	if (Colors.Num() != PixelCount || PixelCount == 0)
+	{
+		return;
+	}
+	Ping.SetNumUninitialized(PixelCount, false);
+	Pong.SetNumUninitialized(PixelCount, false);
+
+	// Filter the irradiance, texture detail comes back with the albedo
+	for (int32 Pixel = 0; Pixel < PixelCount; ++Pixel)
+	{
+		const FGuide& Guide = Guides[Pixel];
+		const FLinearColor& Color = Colors[Pixel];
+		Ping[Pixel] = Guide.Depth < 0 ? Color : FLinearColor(Color.R / Guide.Albedo.X, Color.G / Guide.Albedo.Y, Color.B / Guide.Albedo.Z, 1);
+	}
+
+	static const float Kernel[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+	for (int32 Iteration = 0; Iteration < Settings.Iterations; ++Iteration)
+	{
+		RENDER_TRACE_SCOPE(DenoiseIteration);
+		const int32 Step = 1 << Iteration;
+		const float ColorScale = 1.f / FMath::Max(Settings.ColorSigma / Step, SMALL_NUMBER);
+		const TArray<FLinearColor>& Source = Ping;
+		TArray<FLinearColor>& Dest = Pong;
+		ParallelFor(Height, [&](int32 Y)
+		{
+			for (int32 X = 0; X < Width; ++X)
+			{
+				const int32 Pixel = Y * Width + X;
+				const FGuide& Center = Guides[Pixel];
+				const FLinearColor& CenterColor = Source[Pixel];
+				if (Center.Depth < 0)
+				{
+					Dest[Pixel] = CenterColor;
+					continue;
+				}
+				const float CenterLuminance = CenterColor.GetLuminance();
+				const float DepthScale = 1.f / FMath::Max(Settings.DepthSigma * Center.Depth * Step, SMALL_NUMBER);
+				FLinearColor Sum(0, 0, 0, 0);
+				float WeightSum = 0;
+				for (int32 DY = -2; DY <= 2; ++DY)
+				{
+					const int32 TapY = Y + DY * Step;
+					if (TapY < 0 || TapY >= Height)
+						continue;
+					for (int32 DX = -2; DX <= 2; ++DX)
+					{
+						const int32 TapX = X + DX * Step;
+						if (TapX < 0 || TapX >= Width)
+							continue;
+						const int32 Tap = TapY * Width + TapX;
+						const FGuide& Guide = Guides[Tap];
+						if (Guide.Depth < 0)
+							continue;
+						const FLinearColor& TapColor = Source[Tap];
+						const float NormalWeight = FMath::Pow(FMath::Max(FVector::DotProduct(Center.Normal, Guide.Normal), 0.f), Settings.NormalPower);
+						const float Exponent = FMath::Abs(Center.Depth - Guide.Depth) * DepthScale + FMath::Abs(CenterLuminance - TapColor.GetLuminance()) * ColorScale;
+						const float Weight = Kernel[DX + 2] * Kernel[DY + 2] * NormalWeight * FMath::Exp(-Exponent);
+						Sum += TapColor * Weight;
+						WeightSum += Weight;
+					}
+				}
+				// The center tap always has weight, unless the normal is degenerate
+				Dest[Pixel] = WeightSum > SMALL_NUMBER ? Sum / WeightSum : CenterColor;
+			}
+		});
+		Swap(Ping, Pong);
+	}
+
+	for (int32 Pixel = 0; Pixel < PixelCount; ++Pixel)
+	{
+		const FGuide& Guide = Guides[Pixel];
+		const FLinearColor& Filtered = Ping[Pixel];
+		Output[Pixel] = Guide.Depth < 0 ? FLinearColor(Filtered.R, Filtered.G, Filtered.B, 1)
+			: FLinearColor(Filtered.R * Guide.Albedo.X, Filtered.G * Guide.Albedo.Y, Filtered.B * Guide.Albedo.Z, 1);
+	}
+}
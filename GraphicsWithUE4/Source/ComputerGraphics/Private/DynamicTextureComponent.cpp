@@ -3,6 +3,26 @@
 
 #include "DynamicTextureComponent.h"
 #include "Components/StaticMeshComponent.h"
+#include "Misc/ScopeExit.h"
+#include "RenderStats.h"
+#include "RenderTrace.h"
+
+DECLARE_CYCLE_STAT(TEXT("Texture upload"), STAT_TextureUpload, STATGROUP_RayTracer);
+
+static FORCEINLINE int64 MakeSpan(int32 MinX, int32 MaxX)
+{
+	return int64(uint64(uint32(MinX)) << 32 | uint32(MaxX));
+}
+
+static FORCEINLINE int32 GetSpanMinX(int64 Span)
+{
+	return int32(uint64(Span) >> 32);
+}
+
+static FORCEINLINE int32 GetSpanMaxX(int64 Span)
+{
+	return int32(uint32(uint64(Span)));
+}
 
 // Sets default values for this component's properties
 UDynamicTextureComponent::UDynamicTextureComponent()
@@ -12,7 +32,6 @@ UDynamicTextureComponent::UDynamicTextureComponent()
 	PrimaryComponentTick.bCanEverTick = true;
 	Width = 1920;
 	Height = 1080;
-	DataLocked = nullptr;
 	// ...
 }
 
@@ -20,14 +39,43 @@ UDynamicTextureComponent::UDynamicTextureComponent()
 void UDynamicTextureComponent::BeginPlay()
 {
 	Super::BeginPlay();
+	Allocate();
+}
+
+void UDynamicTextureComponent::Resize(int32 InWidth, int32 InHeight)
+{
+	if (InWidth != Width || InHeight != Height || Pixels.Num() != Width * Height || bHeadless != bAllocatedHeadless)
+	{
+		Width = InWidth;
+		Height = InHeight;
+		Allocate();
+	}
+}
+
+void UDynamicTextureComponent::Allocate()
+{
+	Texture = nullptr;
+	Pixels.Reset();
+	bAllocatedHeadless = bHeadless;
 	if (Width > 0 && Height > 0)
 	{
+		Pixels.AddZeroed(Width * Height);
+		DirtySpans.Init(MakeSpan(Width, -1), Height);
+		bDirty = false;
+		ToneMapper.Setup(ToneMapOperator, Exposure, bSRGB);
+		if (bHeadless)
+		{
+			return;
+		}
 		Texture = UTexture2D::CreateTransient(Width, Height);
 		FTexture2DMipMap& Mip = Texture->PlatformData->Mips[0];
 		FColor* Data = (FColor*)Mip.BulkData.Lock(LOCK_READ_WRITE);
 		FMemory::Memzero(Data, Width * Height * sizeof(FColor));
 		Mip.BulkData.Unlock();
-		bDirty = true;
+		// Creates the resource once, later changes go through UpdateTextureRegions
+		Texture->UpdateResource();
+		Upload = MakeShared<FDynamicTextureUpload, ESPMode::ThreadSafe>();
+		Upload->Pixels.AddZeroed(Width * Height);
 		Mesh = Cast<UStaticMeshComponent>(GetOwner()->GetComponentByClass(UStaticMeshComponent::StaticClass()));
 		if (ensure(Mesh))
 		{
@@ -42,38 +90,106 @@ void UDynamicTextureComponent::BeginPlay()
 void UDynamicTextureComponent::TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction)
 {
 	Super::TickComponent(DeltaTime, TickType, ThisTickFunction);
-	if (bDirty)
-	{ 
-		Texture->UpdateResource();
+	if (bDirty && Texture && Upload.IsValid() && !Upload->bInFlight)
+	{
 		bDirty = false;
+		UploadDirtyRegions();
 	}
 }
 
-// https://www.ue4community.wiki/legacy/dynamic-textures-a5iczbuy
-bool UDynamicTextureComponent::SetPixel(int X, int Y, FColor Color)
+// Grows the span to cover [MinX, MaxX], both ends change in the same compare exchange
+static void AtomicUnion(volatile int64* Span, int32 MinX, int32 MaxX)
 {
-	if (Texture && ensure(X < Width && Y < Height))
+	int64 Current = *Span;
+	for (;;)
 	{
-		FTexture2DMipMap& Mip = Texture->PlatformData->Mips[0];
-		FColor* Data = (FColor*)Mip.BulkData.Lock(LOCK_READ_WRITE);
-		Data[Y * Texture->GetSizeX() + X] = Color;
-		Mip.BulkData.Unlock();
-		bDirty = true;
-		return true;
+		const int64 Desired = MakeSpan(FMath::Min(GetSpanMinX(Current), MinX), FMath::Max(GetSpanMaxX(Current), MaxX));
+		if (Desired == Current)
+			break;
+		const int64 Previous = FPlatformAtomics::InterlockedCompareExchange(Span, Desired, Current);
+		if (Previous == Current)
+			break;
+		Current = Previous;
 	}
-	return false;
+}
+
+void UDynamicTextureComponent::MarkDirty(int32 X, int32 Y, int32 SizeX, int32 SizeY)
+{
+	for (int32 Row = Y; Row < Y + SizeY; ++Row)
+	{
+		AtomicUnion(&DirtySpans[Row], X, X + SizeX - 1);
+	}
+	// Ordered after the spans, the tick never sees the flag without them
+	bDirty = true;
+}
+
+void UDynamicTextureComponent::UploadDirtyRegions()
+{
+	SCOPE_CYCLE_COUNTER(STAT_TextureUpload);
+	RENDER_TRACE_SCOPE(TextureUpload);
+	const double StartTime = FPlatformTime::Seconds();
+	ON_SCOPE_EXIT
+	{
+		UploadSeconds += FPlatformTime::Seconds() - StartTime;
+	};
+	// Take the dirty spans first, rows written after this are picked up by the next upload
+	TArray<FUpdateTextureRegion2D> Regions;
+	for (int32 Row = 0; Row < Height; ++Row)
+	{
+		const int64 Span = FPlatformAtomics::InterlockedExchange(&DirtySpans[Row], MakeSpan(Width, -1));
+		const int32 MinX = GetSpanMinX(Span);
+		const int32 MaxX = GetSpanMaxX(Span);
+		if (MinX > MaxX)
+		{
+			continue;
+		}
+		FMemory::Memcpy(&Upload->Pixels[Row * Width + MinX], &Pixels[Row * Width + MinX], (MaxX - MinX + 1) * sizeof(FColor));
+		// Rows with the same span become one rectangle
+		FUpdateTextureRegion2D* Last = Regions.Num() > 0 ? &Regions.Last() : nullptr;
+		if (Last && Last->DestY + Last->Height == Row && Last->DestX == MinX && Last->Width == MaxX - MinX + 1)
+		{
+			++Last->Height;
+		}
+		else
+		{
+			Regions.Add(FUpdateTextureRegion2D(MinX, Row, MinX, Row, MaxX - MinX + 1, 1));
+		}
+	}
+	if (Regions.Num() == 0)
+	{
+		return;
+	}
+
+	FUpdateTextureRegion2D* RegionData = new FUpdateTextureRegion2D[Regions.Num()];
+	FMemory::Memcpy(RegionData, Regions.GetData(), Regions.Num() * sizeof(FUpdateTextureRegion2D));
+	Upload->bInFlight = true;
+	TSharedPtr<FDynamicTextureUpload, ESPMode::ThreadSafe> InFlight = Upload;
+	Texture->UpdateTextureRegions(0, Regions.Num(), RegionData, Width * sizeof(FColor), sizeof(FColor), (uint8*)Upload->Pixels.GetData(),
+		[InFlight](uint8* SrcData, const FUpdateTextureRegion2D* InRegions)
+		{
+			delete[] InRegions;
+			InFlight->bInFlight = false;
+		});
+}
+
+// https://www.ue4community.wiki/legacy/dynamic-textures-a5iczbuy
+bool UDynamicTextureComponent::SetPixel(int X, int Y, FColor Color)
+{
+	// Pixels are only copied to the texture on tick, so there is nothing to lock anymore
+	return SetPixelWithoutLock(X, Y, Color);
 }
 
 bool UDynamicTextureComponent::SetPixel(int X, int Y, FLinearColor Color)
 {
-	return SetPixel(X, Y, Color.ToFColor(true));
+	return SetPixel(X, Y, ToneMapper.Convert(Color));
 }
 
 bool UDynamicTextureComponent::SetPixelWithoutLock(int X, int Y, FColor Color)
 {
-	if (Texture && ensure(X < Width && Y < Height) && DataLocked)
+	if (ensure(IsRectInside(X, Y, 1, 1)))
 	{
-		DataLocked[Y * Texture->GetSizeX() + X] = Color;
+		Pixels[Y * Width + X] = Color;
+		MarkDirty(X, Y, 1, 1);
 		return true;
 	}
 	return false;
@@ -81,6 +197,71 @@ bool UDynamicTextureComponent::SetPixelWithoutLock(int X, int Y, FColor Color)
 
 bool UDynamicTextureComponent::SetPixelWithoutLock(int X, int Y, FLinearColor Color)
 {
-	return SetPixelWithoutLock(X, Y, Color.ToFColor(true));
+	return SetPixelWithoutLock(X, Y, ToneMapper.Convert(Color));
+}
+
+bool UDynamicTextureComponent::SetPixels(int32 X, int32 Y, int32 SizeX, int32 SizeY, const FColor* Colors, int32 SourcePitch)
+{
+	if (!Colors || !ensure(IsRectInside(X, Y, SizeX, SizeY)))
+	{
+		return false;
+	}
+	SourcePitch = SourcePitch > 0 ? SourcePitch : SizeX;
+	for (int32 Row = 0; Row < SizeY; ++Row)
+	{
+		FMemory::Memcpy(&Pixels[(Y + Row) * Width + X], Colors + Row * SourcePitch, SizeX * sizeof(FColor));
+	}
+	MarkDirty(X, Y, SizeX, SizeY);
+	return true;
+}
+
+bool UDynamicTextureComponent::SetPixels(int32 X, int32 Y, int32 SizeX, int32 SizeY, const FLinearColor* Colors, int32 SourcePitch)
+{
+	if (!Colors || !ensure(IsRectInside(X, Y, SizeX, SizeY)))
+	{
+		return false;
+	}
+	SourcePitch = SourcePitch > 0 ? SourcePitch : SizeX;
+	for (int32 Row = 0; Row < SizeY; ++Row)
+	{
+		ToneMapper.Convert(Colors + Row * SourcePitch, &Pixels[(Y + Row) * Width + X], SizeX);
+	}
+	MarkDirty(X, Y, SizeX, SizeY);
+	return true;
+}
+
+bool UDynamicTextureComponent::SetPixelRect(int32 X, int32 Y, int32 SizeX, int32 SizeY, const TArray<FColor>& Colors)
+{
+	return ensure(Colors.Num() >= SizeX * SizeY) && SetPixels(X, Y, SizeX, SizeY, Colors.GetData());
+}
+
+bool UDynamicTextureComponent::SetPixelRectLinear(int32 X, int32 Y, int32 SizeX, int32 SizeY, const TArray<FLinearColor>& Colors)
+{
+	return ensure(Colors.Num() >= SizeX * SizeY) && SetPixels(X, Y, SizeX, SizeY, Colors.GetData());
 }
 
+void UDynamicTextureComponent::SetToneMapping(EToneMapOperator InOperator, float InExposure, bool bInSRGB)
+{
+	ToneMapOperator = InOperator;
+	Exposure = InExposure;
+	bSRGB = bInSRGB;
+	ToneMapper.Setup(ToneMapOperator, Exposure, bSRGB);
+}
+
+bool UDynamicTextureComponent::FillPixels(int32 X, int32 Y, int32 SizeX, int32 SizeY, FColor Color)
+{
+	if (!ensure(IsRectInside(X, Y, SizeX, SizeY)))
+	{
+		return false;
+	}
+	for (int32 Row = 0; Row < SizeY; ++Row)
+	{
+		FColor* Dest = &Pixels[(Y + Row) * Width + X];
+		for (int32 Column = 0; Column < SizeX; ++Column)
+		{
+			Dest[Column] = Color;
+		}
+	}
+	MarkDirty(X, Y, SizeX, SizeY);
+	return true;
+}
@@ -0,0 +1,126 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RasterScene.h"
+#include "Components/StaticMeshComponent.h"
+#include "Kismet/GameplayStatics.h"
+#include "Camera/PlayerCameraManager.h"
+#include "EngineUtils.h"
+#include "ProceduralMeshComponent.h"
+#include "DynamicTextureComponent.h"
+#include "StaticMeshDataComponent.h"
+#include "TriangleMesh.h"
+#include "RenderTrace.h"
+
+// Sets default values
+ARasterScene::ARasterScene()
+{
+ 	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+
+	Root = CreateDefaultSubobject<USceneComponent>(TEXT("Root"));
+	RootComponent = Root;
+
+	StaticMesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("StaticMesh"));
+	StaticMesh->SetupAttachment(RootComponent);
+	static ConstructorHelpers::FObjectFinder<UStaticMesh> StaticMeshObject(TEXT("StaticMesh'/Game/HW01/Plane.Plane'"));
+	if (StaticMeshObject.Succeeded()) {
+		StaticMesh->SetStaticMesh(StaticMeshObject.Object);
+	}
+	static ConstructorHelpers::FObjectFinder<UMaterial> MaterialObject(TEXT("Material'/Game/HW06/TextureMaterial.TextureMaterial'"));
+	if (MaterialObject.Succeeded()) {
+		StaticMesh->SetMaterial(0, MaterialObject.Object);
+	}
+
+	Texture = CreateDefaultSubobject<UDynamicTextureComponent>(TEXT("Texture"));
+}
+
+// Called when the game starts or when spawned
+void ARasterScene::BeginPlay()
+{
+	Super::BeginPlay();
+
+	// Meshes are skipped until their data is ready
+	for (TActorIterator<AActor> It(GetWorld()); It; ++It)
+	{
+		if (UStaticMeshDataComponent* MeshData = It->FindComponentByClass<UStaticMeshDataComponent>())
+		{
+			Meshes.Add(MeshData);
+		}
+	}
+}
+
+FMatrix ARasterScene::GetViewProjection() const
+{
+	FVector Location = FVector::ZeroVector;
+	FRotator Rotation = FRotator::ZeroRotator;
+	float VerticalFOV = FOV;
+	const float AspectRatio = float(Texture->Width) / FMath::Max(Texture->Height, 1);
+	APlayerCameraManager* CameraManager = bUsePlayerView ? UGameplayStatics::GetPlayerCameraManager(this, 0) : nullptr;
+	if (CameraManager)
+	{
+		Location = CameraManager->GetCameraLocation();
+		Rotation = CameraManager->GetCameraRotation();
+		// Player FOV is horizontal, ours is vertical
+		const float TanHalf = FMath::Tan(CameraManager->GetFOVAngle() / 360 * PI) / AspectRatio;
+		VerticalFOV = FMath::Atan(TanHalf) * 360 / PI;
+	}
+	return FVertexPipeline::MakeViewMatrix(Location, Rotation) * FVertexPipeline::MakeProjectionMatrix(Projection, VerticalFOV, OrthoWidth, AspectRatio, NearPlane, FarPlane);
+}
+
+void ARasterScene::Draw()
+{
+	RENDER_TRACE_SCOPE(Rasterize);
+	if (Rasterizer.GetWidth() != Texture->Width || Rasterizer.GetHeight() != Texture->Height || Rasterizer.GetSampleCount() != 1 << FMath::FloorLog2(FMath::Clamp(SampleCount, 1, FRasterizer::MaxSamples)))
+	{
+		Rasterizer.Resize(Texture->Width, Texture->Height, SampleCount);
+	}
+	Rasterizer.ClearColor = ClearColor;
+	Rasterizer.bShadePerSample = bShadePerSample;
+	Rasterizer.bCullBackFaces = bCullBackFaces;
+
+	// Clip well inside the guard band of the rasterizer, clipped vertices land on the band up to rounding
+	Pipeline.SetViewport(Texture->Width, Texture->Height, FRasterizer::GuardBand / 2);
+	const FMatrix ViewProjection = GetViewProjection();
+	MeshStreams.SetNum(Meshes.Num());
+	Rasterizer.Begin();
+	for (int32 Index = 0; Index < Meshes.Num(); ++Index)
+	{
+		const UStaticMeshDataComponent* MeshData = Meshes[Index];
+		if (!MeshData || !MeshData->IsReady() || MeshData->Indices.Num() < 3)
+		{
+			continue;
+		}
+		FVertexStream& Stream = MeshStreams[Index];
+		if (Stream.Num != MeshData->Vertices.Num())
+		{
+			Stream.Set(MeshData->Vertices);
+		}
+		const UProceduralMeshComponent* RenderMesh = MeshData->GetOwner()->FindComponentByClass<UProceduralMeshComponent>();
+		const FTransform& Transform = RenderMesh ? RenderMesh->GetComponentTransform() : MeshData->GetOwner()->GetActorTransform();
+		Pipeline.SetTransform(Transform.ToMatrixWithScale(), ViewProjection);
+
+		const FLinearColor* Colors = MeshData->Colors.Num() == MeshData->Vertices.Num() ? MeshData->Colors.GetData() : nullptr;
+		const FVector2D* UVs = MeshData->UVs.Num() == MeshData->Vertices.Num() ? MeshData->UVs.GetData() : nullptr;
+		// Textured meshes modulate their vertex colors with the Kd texture
+		const ATriangleMesh* TriangleMesh = Cast<ATriangleMesh>(MeshData->GetOwner());
+		const FSoftwareTexture* KdMap = TriangleMesh && UVs ? &TriangleMesh->GetKdMap() : nullptr;
+		const int32 TriangleCount = MeshData->Indices.Num() / 3;
+		Pipeline.Run(Stream, Colors, UVs, MeshData->Indices.GetData(), TriangleCount, Transformed);
+		Rasterizer.AddTriangles(Transformed.Positions.GetData(), Colors, UVs, MeshData->Indices.GetData(), TriangleCount, KdMap);
+		const FClippedTriangles& Clipped = Transformed.Clipped;
+		Rasterizer.AddTriangles(Clipped.Positions.GetData(), Clipped.Colors.GetData(), Clipped.UVs.GetData(), Clipped.Indices.GetData(), Clipped.Indices.Num() / 3, KdMap);
+	}
+	Rasterizer.Render(Texture);
+}
+
+// Called every frame
+void ARasterScene::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+
+	if (bDrawEveryTick)
+	{
+		Draw();
+	}
+}
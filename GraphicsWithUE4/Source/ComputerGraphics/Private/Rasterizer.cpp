@@ -0,0 +1,395 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "Rasterizer.h"
+#include "Async/ParallelFor.h"
+#include "DynamicTextureComponent.h"
+#include "SoftwareTexture.h"
+#include "RenderStats.h"
+#include "RenderTrace.h"
+
+DECLARE_CYCLE_STAT(TEXT("Raster Setup"), STAT_RasterSetup, STATGROUP_RayTracer);
+DECLARE_CYCLE_STAT(TEXT("Raster Tiles"), STAT_RasterTiles, STATGROUP_RayTracer);
+
+static const int32 SubPixelBits = 3;
+static const int32 SubPixels = 1 << SubPixelBits;
+
+// Every AddTriangles call is binned in at most this many chunks, each with bins of its own so no locks are needed
+static const int32 MaxChunksPerCall = 16;
+static const int32 MinTrianglesPerChunk = 1024;
+
+// Sample offsets from the pixel center in 1/8 pixels, the standard D3D patterns for 1, 2 and 4 samples
+static const int32 SampleOffsets[3][FRasterizer::MaxSamples][2] =
+{
+	{ { 0, 0 } },
+	{ { 2, 2 }, { -2, -2 } },
+	{ { -1, -3 }, { 3, -1 }, { -3, 1 }, { 1, 3 } },
+};
+
+void FRasterizer::Resize(int32 InWidth, int32 InHeight, int32 InSampleCount)
+{
+	Width = FMath::Max(InWidth, 0);
+	Height = FMath::Max(InHeight, 0);
+	Pitch = Align(Width, 4);
+	SampleCount = 1 << FMath::FloorLog2(FMath::Clamp(InSampleCount, 1, MaxSamples));
+	TilesX = FMath::DivideAndRoundUp(Width, TileSize);
+	TilesY = FMath::DivideAndRoundUp(Height, TileSize);
+
+	// Every tile clears its samples before drawing
+	const int32 PlaneSize = SampleCount * Height * Pitch;
+	Depth.SetNumUninitialized(PlaneSize, false);
+	Red.SetNumUninitialized(PlaneSize, false);
+	Green.SetNumUninitialized(PlaneSize, false);
+	Blue.SetNumUninitialized(PlaneSize, false);
+
+	Triangles.Reset();
+	Bins.Reset();
+	ChunkCount = 0;
+}
+
+void FRasterizer::Begin()
+{
+	const int32 BinCount = ChunkCount * TilesX * TilesY;
+	for (int32 Bin = 0; Bin < BinCount; ++Bin)
+	{
+		Bins[Bin].Reset();
+	}
+	ChunkCount = 0;
+	Triangles.Reset();
+}
+
+void FRasterizer::AddTriangles(const FVector4* Positions, const FLinearColor* Colors, const FVector2D* UVs, const int32* Indices, int32 TriangleCount, const FSoftwareTexture* Texture)
+{
+	SCOPE_CYCLE_COUNTER(STAT_RasterSetup);
+	RENDER_TRACE_SCOPE(RasterSetup);
+	const int32 TileCount = TilesX * TilesY;
+	if (TriangleCount <= 0 || TileCount == 0)
+	{
+		return;
+	}
+	const int32 FirstTriangle = Triangles.Num();
+	Triangles.AddUninitialized(TriangleCount);
+
+	const int32 Chunks = FMath::Clamp(FMath::DivideAndRoundUp(TriangleCount, MinTrianglesPerChunk), 1, MaxChunksPerCall);
+	const int32 FirstChunk = ChunkCount;
+	ChunkCount += Chunks;
+	if (Bins.Num() < ChunkCount * TileCount)
+	{
+		Bins.SetNum(ChunkCount * TileCount);
+	}
+
+	ParallelFor(Chunks, [&](int32 Chunk)
+	{
+		TArray<int32>* ChunkBins = &Bins[(FirstChunk + Chunk) * TileCount];
+		const int32 End = int64(TriangleCount) * (Chunk + 1) / Chunks;
+		for (int32 Index = int64(TriangleCount) * Chunk / Chunks; Index < End; ++Index)
+		{
+			FTriangle& Triangle = Triangles[FirstTriangle + Index];
+			if (!SetupTriangle(Positions, Colors, UVs, Indices + Index * 3, Triangle))
+			{
+				Triangle.MinX = Triangle.MinY = 1;
+				Triangle.MaxX = Triangle.MaxY = 0;
+				continue;
+			}
+			Triangle.Texture = Texture && Texture->IsValid() ? Texture : nullptr;
+			for (int32 TileY = Triangle.MinY / TileSize; TileY <= Triangle.MaxY / TileSize; ++TileY)
+			{
+				for (int32 TileX = Triangle.MinX / TileSize; TileX <= Triangle.MaxX / TileSize; ++TileX)
+				{
+					ChunkBins[TileY * TilesX + TileX].Add(FirstTriangle + Index);
+				}
+			}
+		}
+	});
+}
+
+bool FRasterizer::SetupTriangle(const FVector4* Positions, const FLinearColor* Colors, const FVector2D* UVs, const int32* Corners, FTriangle& Out) const
+{
+	int32 Vertex[3] = { Corners[0], Corners[1], Corners[2] };
+	int32 FixedX[3];
+	int32 FixedY[3];
+	for (int32 Corner = 0; Corner < 3; ++Corner)
+	{
+		const FVector4& Position = Positions[Vertex[Corner]];
+		// Written so NaNs fail as well
+		if (!(Position.W > 0.f && Position.X >= -GuardBand && Position.X <= Width + GuardBand && Position.Y >= -GuardBand && Position.Y <= Height + GuardBand))
+		{
+			return false;
+		}
+		FixedX[Corner] = FMath::RoundToInt(Position.X * SubPixels);
+		FixedY[Corner] = FMath::RoundToInt(Position.Y * SubPixels);
+	}
+
+	// Positive when clockwise on screen
+	int64 Area = int64(FixedX[1] - FixedX[0]) * (FixedY[2] - FixedY[0]) - int64(FixedX[2] - FixedX[0]) * (FixedY[1] - FixedY[0]);
+	if (Area == 0)
+	{
+		return false;
+	}
+	if (Area < 0)
+	{
+		if (bCullBackFaces)
+		{
+			return false;
+		}
+		Swap(Vertex[1], Vertex[2]);
+		Swap(FixedX[1], FixedX[2]);
+		Swap(FixedY[1], FixedY[2]);
+	}
+
+	// Samples of pixel X lie at X * 8 + 4 + [-3, 3]
+	Out.MinX = FMath::Max((FMath::Min3(FixedX[0], FixedX[1], FixedX[2]) - SubPixels + 1) >> SubPixelBits, 0);
+	Out.MinY = FMath::Max((FMath::Min3(FixedY[0], FixedY[1], FixedY[2]) - SubPixels + 1) >> SubPixelBits, 0);
+	Out.MaxX = FMath::Min((FMath::Max3(FixedX[0], FixedX[1], FixedX[2]) - 1) >> SubPixelBits, Width - 1);
+	Out.MaxY = FMath::Min((FMath::Max3(FixedY[0], FixedY[1], FixedY[2]) - 1) >> SubPixelBits, Height - 1);
+	if (Out.MinX > Out.MaxX || Out.MinY > Out.MaxY)
+	{
+		return false;
+	}
+
+	for (int32 Edge = 0; Edge < 3; ++Edge)
+	{
+		// The edge opposite corner Edge, positive on the side of that corner
+		const int32 From = (Edge + 1) % 3;
+		const int32 To = (Edge + 2) % 3;
+		Out.A[Edge] = FixedY[From] - FixedY[To];
+		Out.B[Edge] = FixedX[To] - FixedX[From];
+		Out.C[Edge] = -(int64(Out.A[Edge]) * FixedX[From] + int64(Out.B[Edge]) * FixedY[From]);
+		// Samples exactly on an edge belong to the triangle only if it is a left or top edge, so shared edges are drawn once
+		const bool bTopLeft = Out.A[Edge] > 0 || (Out.A[Edge] == 0 && Out.B[Edge] > 0);
+		if (!bTopLeft)
+		{
+			--Out.C[Edge];
+		}
+	}
+
+	float Values[PlaneCount][3];
+	for (int32 Corner = 0; Corner < 3; ++Corner)
+	{
+		const FVector4& Position = Positions[Vertex[Corner]];
+		const FLinearColor Color = Colors ? Colors[Vertex[Corner]] : FLinearColor::White;
+		const FVector2D UV = UVs ? UVs[Vertex[Corner]] : FVector2D::ZeroVector;
+		Values[PlaneDepth][Corner] = Position.Z;
+		Values[PlaneInvW][Corner] = Position.W;
+		Values[PlaneRed][Corner] = Color.R * Position.W;
+		Values[PlaneGreen][Corner] = Color.G * Position.W;
+		Values[PlaneBlue][Corner] = Color.B * Position.W;
+		Values[PlaneU][Corner] = UV.X * Position.W;
+		Values[PlaneV][Corner] = UV.Y * Position.W;
+	}
+
+	Out.OriginX = float(FixedX[0]) / SubPixels;
+	Out.OriginY = float(FixedY[0]) / SubPixels;
+	const float X1 = float(FixedX[1] - FixedX[0]) / SubPixels;
+	const float Y1 = float(FixedY[1] - FixedY[0]) / SubPixels;
+	const float X2 = float(FixedX[2] - FixedX[0]) / SubPixels;
+	const float Y2 = float(FixedY[2] - FixedY[0]) / SubPixels;
+	const float InvDeterminant = 1.f / (X1 * Y2 - X2 * Y1);
+	for (int32 Plane = 0; Plane < PlaneCount; ++Plane)
+	{
+		const float Delta1 = Values[Plane][1] - Values[Plane][0];
+		const float Delta2 = Values[Plane][2] - Values[Plane][0];
+		Out.Plane[Plane][0] = Values[Plane][0];
+		Out.Plane[Plane][1] = (Delta1 * Y2 - Delta2 * Y1) * InvDeterminant;
+		Out.Plane[Plane][2] = (Delta2 * X1 - Delta1 * X2) * InvDeterminant;
+	}
+	return true;
+}
+
+void FRasterizer::RasterizeTriangle(const FTriangle& Triangle, int32 TileX, int32 TileY, int32 TileWidth, int32 TileHeight)
+{
+	// Whole groups of 4 pixels, tiles are a multiple of 4 wide and the planes are padded to one
+	const int32 MinX = FMath::Max(Triangle.MinX, TileX) & ~3;
+	const int32 MaxX = FMath::Min(Triangle.MaxX, TileX + TileWidth - 1);
+	const int32 MinY = FMath::Max(Triangle.MinY, TileY);
+	const int32 MaxY = FMath::Min(Triangle.MaxY, TileY + TileHeight - 1);
+	if (MinX > MaxX || MinY > MaxY)
+	{
+		return;
+	}
+
+	const int32(*Offsets)[2] = SampleOffsets[FMath::FloorLog2(SampleCount)];
+	const VectorRegister Lane = MakeVectorRegister(0.f, 1.f, 2.f, 3.f);
+	const VectorRegister Zero = VectorZero();
+
+	// Edge values step by A per sub-pixel, all of them are integers well below 2^24 so the float sums stay exact
+	VectorRegister EdgeLane[3];
+	VectorRegister EdgeStep[3];
+	for (int32 Edge = 0; Edge < 3; ++Edge)
+	{
+		EdgeLane[Edge] = VectorMultiply(VectorSetFloat1(float(Triangle.A[Edge] * SubPixels)), Lane);
+		EdgeStep[Edge] = VectorSetFloat1(float(Triangle.A[Edge] * SubPixels * 4));
+	}
+	const float* DepthPlane = Triangle.Plane[PlaneDepth];
+	const VectorRegister DepthLane = VectorMultiply(VectorSetFloat1(DepthPlane[1]), Lane);
+	const VectorRegister DepthStep = VectorSetFloat1(DepthPlane[1] * 4);
+
+	auto Shade = [&Triangle, &Lane, &Zero](float X, float Y, VectorRegister& OutRed, VectorRegister& OutGreen, VectorRegister& OutBlue)
+	{
+		const VectorRegister PlaneX = VectorAdd(VectorSetFloat1(X - Triangle.OriginX), Lane);
+		const VectorRegister PlaneY = VectorSetFloat1(Y - Triangle.OriginY);
+		auto Evaluate = [&](int32 Plane)
+		{
+			const float* Coefficients = Triangle.Plane[Plane];
+			return VectorMultiplyAdd(VectorSetFloat1(Coefficients[1]), PlaneX, VectorMultiplyAdd(VectorSetFloat1(Coefficients[2]), PlaneY, VectorSetFloat1(Coefficients[0])));
+		};
+		// MSAA shades pixel centers slightly outside the triangle, keep the extrapolated 1 / w positive
+		const VectorRegister W = VectorDivide(VectorOne(), VectorMax(Evaluate(PlaneInvW), VectorSetFloat1(SMALL_NUMBER)));
+		OutRed = VectorMax(VectorMultiply(Evaluate(PlaneRed), W), Zero);
+		OutGreen = VectorMax(VectorMultiply(Evaluate(PlaneGreen), W), Zero);
+		OutBlue = VectorMax(VectorMultiply(Evaluate(PlaneBlue), W), Zero);
+		if (Triangle.Texture)
+		{
+			const VectorRegister U = VectorMultiply(Evaluate(PlaneU), W);
+			const VectorRegister V = VectorMultiply(Evaluate(PlaneV), W);
+			// Screen derivatives from the next lane and from the pixel below the first one
+			auto EvaluateBelow = [&](int32 Plane)
+			{
+				const float* Coefficients = Triangle.Plane[Plane];
+				return Coefficients[0] + Coefficients[1] * (X - Triangle.OriginX) + Coefficients[2] * (Y + 1.f - Triangle.OriginY);
+			};
+			const float BelowW = 1.f / FMath::Max(EvaluateBelow(PlaneInvW), SMALL_NUMBER);
+			const FVector2D First(VectorGetComponent(U, 0), VectorGetComponent(V, 0));
+			const FVector2D Right(VectorGetComponent(U, 1), VectorGetComponent(V, 1));
+			const FVector2D Below(EvaluateBelow(PlaneU) * BelowW, EvaluateBelow(PlaneV) * BelowW);
+			const float Lod = Triangle.Texture->GetLod(Right - First, Below - First);
+
+			VectorRegister TexelRed, TexelGreen, TexelBlue, TexelAlpha;
+			Triangle.Texture->SampleQuad(U, V, Lod, TexelRed, TexelGreen, TexelBlue, TexelAlpha);
+			OutRed = VectorMultiply(OutRed, TexelRed);
+			OutGreen = VectorMultiply(OutGreen, TexelGreen);
+			OutBlue = VectorMultiply(OutBlue, TexelBlue);
+		}
+	};
+
+	float* DepthData = Depth.GetData();
+	float* RedData = Red.GetData();
+	float* GreenData = Green.GetData();
+	float* BlueData = Blue.GetData();
+
+	VectorRegister Edges[MaxSamples][3];
+	VectorRegister Depths[MaxSamples];
+	for (int32 Y = MinY; Y <= MaxY; ++Y)
+	{
+		for (int32 Sample = 0; Sample < SampleCount; ++Sample)
+		{
+			const int32 SampleX = MinX * SubPixels + SubPixels / 2 + Offsets[Sample][0];
+			const int32 SampleY = Y * SubPixels + SubPixels / 2 + Offsets[Sample][1];
+			for (int32 Edge = 0; Edge < 3; ++Edge)
+			{
+				const int64 RowValue = Triangle.C[Edge] + int64(Triangle.A[Edge]) * SampleX + int64(Triangle.B[Edge]) * SampleY;
+				Edges[Sample][Edge] = VectorAdd(VectorSetFloat1(float(RowValue)), EdgeLane[Edge]);
+			}
+			const float DepthX = float(SampleX) / SubPixels - Triangle.OriginX;
+			const float DepthY = float(SampleY) / SubPixels - Triangle.OriginY;
+			Depths[Sample] = VectorAdd(VectorSetFloat1(DepthPlane[0] + DepthPlane[1] * DepthX + DepthPlane[2] * DepthY), DepthLane);
+		}
+
+		for (int32 X = MinX; X <= MaxX; X += 4)
+		{
+			bool bShaded = false;
+			VectorRegister ColorRed = Zero;
+			VectorRegister ColorGreen = Zero;
+			VectorRegister ColorBlue = Zero;
+			for (int32 Sample = 0; Sample < SampleCount; ++Sample)
+			{
+				const VectorRegister Inside = VectorBitwiseAnd(VectorBitwiseAnd(VectorCompareGE(Edges[Sample][0], Zero), VectorCompareGE(Edges[Sample][1], Zero)), VectorCompareGE(Edges[Sample][2], Zero));
+				if (VectorMaskBits(Inside))
+				{
+					const int32 Index = GetSampleIndex(Sample, X, Y);
+					const VectorRegister Stored = VectorLoadAligned(DepthData + Index);
+					const VectorRegister Pass = VectorBitwiseAnd(Inside, VectorCompareLT(Depths[Sample], Stored));
+					if (VectorMaskBits(Pass))
+					{
+						if (bShadePerSample)
+						{
+							Shade(X + 0.5f + float(Offsets[Sample][0]) / SubPixels, Y + 0.5f + float(Offsets[Sample][1]) / SubPixels, ColorRed, ColorGreen, ColorBlue);
+						}
+						else if (!bShaded)
+						{
+							Shade(X + 0.5f, Y + 0.5f, ColorRed, ColorGreen, ColorBlue);
+							bShaded = true;
+						}
+						VectorStoreAligned(VectorSelect(Pass, Depths[Sample], Stored), DepthData + Index);
+						VectorStoreAligned(VectorSelect(Pass, ColorRed, VectorLoadAligned(RedData + Index)), RedData + Index);
+						VectorStoreAligned(VectorSelect(Pass, ColorGreen, VectorLoadAligned(GreenData + Index)), GreenData + Index);
+						VectorStoreAligned(VectorSelect(Pass, ColorBlue, VectorLoadAligned(BlueData + Index)), BlueData + Index);
+					}
+				}
+				for (int32 Edge = 0; Edge < 3; ++Edge)
+				{
+					Edges[Sample][Edge] = VectorAdd(Edges[Sample][Edge], EdgeStep[Edge]);
+				}
+				Depths[Sample] = VectorAdd(Depths[Sample], DepthStep);
+			}
+		}
+	}
+}
+
+void FRasterizer::RenderTile(int32 Tile, UDynamicTextureComponent* Target)
+{
+	const int32 TileX = Tile % TilesX * TileSize;
+	const int32 TileY = Tile / TilesX * TileSize;
+	const int32 TileWidth = FMath::Min(TileSize, Width - TileX);
+	const int32 TileHeight = FMath::Min(TileSize, Height - TileY);
+
+	const int32 ClearWidth = Align(TileWidth, 4);
+	for (int32 Sample = 0; Sample < SampleCount; ++Sample)
+	{
+		for (int32 Y = TileY; Y < TileY + TileHeight; ++Y)
+		{
+			const int32 Index = GetSampleIndex(Sample, TileX, Y);
+			for (int32 X = 0; X < ClearWidth; ++X)
+			{
+				Depth[Index + X] = 1.f;
+				Red[Index + X] = ClearColor.R;
+				Green[Index + X] = ClearColor.G;
+				Blue[Index + X] = ClearColor.B;
+			}
+		}
+	}
+
+	const int32 TileCount = TilesX * TilesY;
+	for (int32 Chunk = 0; Chunk < ChunkCount; ++Chunk)
+	{
+		for (int32 Index : Bins[Chunk * TileCount + Tile])
+		{
+			RasterizeTriangle(Triangles[Index], TileX, TileY, TileWidth, TileHeight);
+		}
+	}
+
+	// Box filter over the samples of each pixel
+	FLinearColor Resolved[TileSize * TileSize];
+	const float Weight = 1.f / SampleCount;
+	for (int32 Y = 0; Y < TileHeight; ++Y)
+	{
+		for (int32 X = 0; X < TileWidth; ++X)
+		{
+			FLinearColor Sum(0.f, 0.f, 0.f, 1.f);
+			for (int32 Sample = 0; Sample < SampleCount; ++Sample)
+			{
+				const int32 Index = GetSampleIndex(Sample, TileX + X, TileY + Y);
+				Sum.R += Red[Index];
+				Sum.G += Green[Index];
+				Sum.B += Blue[Index];
+			}
+			Resolved[Y * TileSize + X] = FLinearColor(Sum.R * Weight, Sum.G * Weight, Sum.B * Weight, 1.f);
+		}
+	}
+	Target->SetPixels(TileX, TileY, TileWidth, TileHeight, Resolved, TileSize);
+}
+
+void FRasterizer::Render(UDynamicTextureComponent* Target)
+{
+	SCOPE_CYCLE_COUNTER(STAT_RasterTiles);
+	RENDER_TRACE_SCOPE(RasterTiles);
+	if (!Target || Target->Width != Width || Target->Height != Height || !Target->IsRectInside(0, 0, Width, Height))
+	{
+		UE_LOG(LogTemp, Warning, TEXT(__FUNCTION__" %d:the target does not match the %dx%d rasterizer."), __LINE__, Width, Height);
+		return;
+	}
+	ParallelFor(TilesX * TilesY, [this, Target](int32 Tile)
+	{
+		RenderTile(Tile, Target);
+	});
+}
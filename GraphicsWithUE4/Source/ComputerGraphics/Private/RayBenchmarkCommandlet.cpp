@@ -0,0 +1,373 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RayBenchmarkCommandlet.h"
+#include "Dom/JsonObject.h"
+#include "Engine/World.h"
+#include "EngineUtils.h"
+#include "Misc/DateTime.h"
+#include "Misc/EngineVersion.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+#include "BVHCache.h"
+#include "BVHTree.h"
+#include "RayCamera.h"
+#include "RenderSceneCommandlet.h"
+#include "ScreenSceneMultiThread.h"
+#include "TriangleMesh.h"
+
+namespace RayBenchmark
+{
+	// Fastest of Repeat runs, Counters hold the work of the last run
+	template <typename FunctionType>
+	double TimeBest(int32 Repeat, FTraversalCounters& Counters, FunctionType Function)
+	{
+		double Best = TNumericLimits<double>::Max();
+		for (int32 i = 0; i < FMath::Max(Repeat, 1); ++i)
+		{
+			Counters = FTraversalCounters();
+			FTraversalCounters::ForThread() = &Counters;
+			const double StartTime = FPlatformTime::Seconds();
+			Function();
+			Best = FMath::Min(Best, FPlatformTime::Seconds() - StartTime);
+			FTraversalCounters::ForThread() = nullptr;
+		}
+		return Best;
+	}
+
+	TSharedPtr<FJsonObject> RayReport(int32 Rays, int32 Hits, double Seconds, const FTraversalCounters& Counters)
+	{
+		TSharedPtr<FJsonObject> Report = MakeShared<FJsonObject>();
+		const double SafeRays = FMath::Max(Rays, 1);
+		Report->SetNumberField(TEXT("rays"), Rays);
+		Report->SetNumberField(TEXT("hit_rate"), Hits / SafeRays);
+		Report->SetNumberField(TEXT("ms"), Seconds * 1000);
+		Report->SetNumberField(TEXT("mrays_per_s"), Seconds > 0 ? Rays / Seconds / 1e6 : 0);
+		Report->SetNumberField(TEXT("ns_per_ray"), Seconds * 1e9 / SafeRays);
+		Report->SetNumberField(TEXT("nodes_per_ray"), Counters.Nodes / SafeRays);
+		Report->SetNumberField(TEXT("leaves_per_ray"), Counters.Leaves / SafeRays);
+		Report->SetNumberField(TEXT("primitives_per_ray"), Counters.Primitives / SafeRays);
+		return Report;
+	}
+}
+
+URayBenchmarkCommandlet::URayBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = true;
+	LogToConsole = true;
+}
+
+int32 URayBenchmarkCommandlet::Main(const FString& Params)
+{
+	FString ScenesParam = TEXT("bunny=/Game/HW06/HW06,cornell=/Game/HW07/HW07_MultiThread");
+	FString OutputPath = FPaths::ProjectSavedDir() / TEXT("Benchmark") / (FDateTime::Now().ToString() + TEXT(".json"));
+	FParse::Value(*Params, TEXT("Scenes="), ScenesParam, false);
+	FParse::Value(*Params, TEXT("Output="), OutputPath);
+	FParse::Value(*Params, TEXT("Width="), Width);
+	FParse::Value(*Params, TEXT("Height="), Height);
+	FParse::Value(*Params, TEXT("Repeat="), Repeat);
+	FParse::Value(*Params, TEXT("Seed="), Seed);
+	FParse::Value(*Params, TEXT("PathSpp="), PathSpp);
+	FParse::Value(*Params, TEXT("Threads="), Threads);
+	FParse::Value(*Params, TEXT("Split="), SplitMethod);
+	FParse::Value(*Params, TEXT("Layout="), NodeLayout);
+
+	TSharedPtr<FJsonObject> Root = MakeShared<FJsonObject>();
+	Root->SetStringField(TEXT("date"), FDateTime::UtcNow().ToIso8601());
+	Root->SetStringField(TEXT("engine"), FEngineVersion::Current().ToString());
+	Root->SetNumberField(TEXT("cores"), FPlatformMisc::NumberOfCoresIncludingHyperthreads());
+	Root->SetNumberField(TEXT("width"), Width);
+	Root->SetNumberField(TEXT("height"), Height);
+	Root->SetNumberField(TEXT("repeat"), Repeat);
+	Root->SetNumberField(TEXT("seed"), Seed);
+	Root->SetStringField(TEXT("split"), SplitMethod.IsEmpty() ? TEXT("actor") : *SplitMethod);
+	Root->SetStringField(TEXT("layout"), NodeLayout.IsEmpty() ? TEXT("actor") : *NodeLayout);
+
+	TArray<TSharedPtr<FJsonValue>> Scenes;
+	TArray<FString> Entries;
+	ScenesParam.ParseIntoArray(Entries, TEXT(","));
+	int32 Result = 0;
+	for (const FString& Entry : Entries)
+	{
+		FString Name, MapName;
+		if (!Entry.Split(TEXT("="), &Name, &MapName))
+		{
+			Name = MapName = Entry;
+		}
+		TSharedPtr<FJsonObject> Scene = RunScene(Name, MapName);
+		if (Scene.IsValid())
+		{
+			Scenes.Add(MakeShared<FJsonValueObject>(Scene));
+		}
+		else
+		{
+			Result = 1;
+		}
+	}
+	Root->SetArrayField(TEXT("scenes"), Scenes);
+
+	FString Json;
+	TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&Json);
+	FJsonSerializer::Serialize(Root.ToSharedRef(), Writer);
+	UE_LOG(LogTemp, Display, TEXT("%s"), *Json);
+	if (!FFileHelper::SaveStringToFile(Json, *OutputPath))
+	{
+		UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:can not write %s."), __LINE__, *OutputPath);
+		return 1;
+	}
+	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:results written to %s."), __LINE__, *OutputPath);
+	return Result;
+}
+
+TSharedPtr<FJsonObject> URayBenchmarkCommandlet::RunScene(const FString& Name, const FString& MapName) const
+{
+	UWorld* World = URenderSceneCommandlet::LoadWorld(MapName);
+	if (!World)
+	{
+		UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:can not load map %s."), __LINE__, *MapName);
+		return nullptr;
+	}
+	AScreenScene* Screen = nullptr;
+	for (TActorIterator<AScreenScene> It(World); It; ++It)
+	{
+		Screen = *It;
+		break;
+	}
+	AScreenSceneMultiThread* MultiThreadScreen = Cast<AScreenSceneMultiThread>(Screen);
+	if (MultiThreadScreen)
+	{
+		MultiThreadScreen->Spp = FMath::Max(PathSpp, 1);
+		MultiThreadScreen->WorkerThreads = Threads;
+		MultiThreadScreen->bDrawDebugPaths = false;
+	}
+	const int64 Split = SplitMethod.IsEmpty() ? INDEX_NONE : StaticEnum<EBVHSplitMethod>()->GetValueByNameString(SplitMethod);
+	if (Split != INDEX_NONE)
+	{
+		for (TActorIterator<ATriangleMesh> It(World); It; ++It)
+		{
+			It->SplitMethod = (EBVHSplitMethod)Split;
+		}
+		if (Screen)
+		{
+			Screen->SplitMethod = (EBVHSplitMethod)Split;
+		}
+	}
+	const int64 Layout = NodeLayout.IsEmpty() ? INDEX_NONE : StaticEnum<EBVHNodeLayout>()->GetValueByNameString(NodeLayout);
+	if (Layout != INDEX_NONE)
+	{
+		for (TActorIterator<ATriangleMesh> It(World); It; ++It)
+		{
+			It->NodeLayout = (EBVHNodeLayout)Layout;
+		}
+		if (Screen)
+		{
+			Screen->NodeLayout = (EBVHNodeLayout)Layout;
+		}
+	}
+	// Meshes read their vertices and build their own trees in BeginPlay
+	URenderSceneCommandlet::BeginPlay(World);
+
+	TSharedPtr<FJsonObject> Report = MakeShared<FJsonObject>();
+	Report->SetStringField(TEXT("name"), Name);
+	Report->SetStringField(TEXT("map"), MapName);
+
+	TArray<ATriangleMesh*> Meshes;
+	TArray<IObjectInterface*> Objects;
+	TArray<ATriangleMesh*> Lights;
+	for (TActorIterator<ATriangleMesh> It(World); It; ++It)
+	{
+		Meshes.Add(*It);
+		Objects.Add(Cast<IObjectInterface>(*It));
+		if (!It->GetEmit().IsZero())
+		{
+			Lights.Add(*It);
+		}
+	}
+
+	// Build: every mesh tree and the scene tree over the meshes, from scratch and then from the cache BeginPlay filled
+	FTraversalCounters Counters;
+	UBVHTree* Tree = nullptr;
+	const bool bCacheEnabled = FBVHCache::IsEnabled();
+	FBVHCache::SetEnabled(false);
+	const double BuildSeconds = RayBenchmark::TimeBest(Repeat, Counters, [&]()
+	{
+		for (ATriangleMesh* Mesh : Meshes)
+		{
+			Mesh->BuildTree();
+		}
+		Tree = NewObject<UBVHTree>();
+		if (Screen)
+		{
+			Tree->SplitMethod = Screen->SplitMethod;
+			Tree->MaxReferenceGrowth = Screen->MaxReferenceGrowth;
+			Tree->NodeLayout = Screen->NodeLayout;
+		}
+		Tree->BuildTree(Objects);
+	});
+	FBVHCache::SetEnabled(true);
+	const double CachedBuildSeconds = RayBenchmark::TimeBest(Repeat, Counters, [&]()
+	{
+		for (ATriangleMesh* Mesh : Meshes)
+		{
+			Mesh->BuildTree();
+		}
+	});
+	FBVHCache::SetEnabled(bCacheEnabled);
+	int32 Triangles = 0;
+	int32 Nodes = Tree->GetNodeCount();
+	int32 References = Tree->GetReferenceCount();
+	SIZE_T Bytes = Tree->GetAllocatedSize();
+	for (ATriangleMesh* Mesh : Meshes)
+	{
+		Triangles += Mesh->GetTriangleCount();
+		if (Mesh->GetTree())
+		{
+			Nodes += Mesh->GetTree()->GetNodeCount();
+			References += Mesh->GetTree()->GetReferenceCount();
+			Bytes += Mesh->GetTree()->GetAllocatedSize();
+		}
+	}
+	Report->SetNumberField(TEXT("meshes"), Meshes.Num());
+	Report->SetNumberField(TEXT("triangles"), Triangles);
+	Report->SetNumberField(TEXT("build_ms"), BuildSeconds * 1000);
+	Report->SetNumberField(TEXT("cached_build_ms"), CachedBuildSeconds * 1000);
+	Report->SetNumberField(TEXT("bvh_nodes"), Nodes);
+	Report->SetNumberField(TEXT("bvh_references"), References);
+	Report->SetNumberField(TEXT("bvh_bytes"), (double)Bytes);
+
+	FRayCamera Camera;
+	Camera.Setup(FVector::ZeroVector, FRotator::ZeroRotator, Screen ? Screen->FOV : 90.f, Width, Height);
+	TArray<FLightRay> Rays;
+	Rays.Reserve(Width * Height);
+	TArray<FLightRay> RowRays;
+	for (int32 Y = 0; Y < Height; ++Y)
+	{
+		Camera.GenerateTileRays(0, Y, Width, 1, RowRays);
+		Rays.Append(RowRays);
+	}
+	TArray<FIntersection> Hits;
+	Hits.SetNum(Rays.Num());
+
+	// Primary rays one at a time
+	const double PrimarySeconds = RayBenchmark::TimeBest(Repeat, Counters, [&]()
+	{
+		for (int32 i = 0; i < Rays.Num(); ++i)
+		{
+			Hits[i] = Tree->Intersect(Rays[i]);
+		}
+	});
+	int32 HitCount = 0;
+	for (const FIntersection& Hit : Hits)
+	{
+		HitCount += Hit.bBlockingHit ? 1 : 0;
+	}
+	Report->SetObjectField(TEXT("primary"), RayBenchmark::RayReport(Rays.Num(), HitCount, PrimarySeconds, Counters));
+
+	// Primary rays as packets of neighbours along a row
+	TArray<FIntersection> PacketHits;
+	PacketHits.SetNum(Rays.Num());
+	const double PacketSeconds = RayBenchmark::TimeBest(Repeat, Counters, [&]()
+	{
+		FLightRayPacket Packet;
+		for (int32 i = 0; i < Rays.Num(); i += FLightRayPacket::MaxSize)
+		{
+			const int32 Count = FMath::Min(FLightRayPacket::MaxSize, Rays.Num() - i);
+			for (int32 j = 0; j < Count; ++j)
+			{
+				PacketHits[i + j] = FIntersection();
+			}
+			Packet.Init(&Rays[i], Count);
+			Tree->IntersectPacket(Packet, Packet.FullMask(), &PacketHits[i]);
+		}
+	});
+	int32 PacketHitCount = 0;
+	for (const FIntersection& Hit : PacketHits)
+	{
+		PacketHitCount += Hit.bBlockingHit ? 1 : 0;
+	}
+	if (PacketHitCount != HitCount)
+	{
+		UE_LOG(LogTemp, Warning, TEXT(__FUNCTION__" %d:packets hit %d primary rays, single rays %d."), __LINE__, PacketHitCount, HitCount);
+	}
+	Report->SetObjectField(TEXT("primary_packet"), RayBenchmark::RayReport(Rays.Num(), PacketHitCount, PacketSeconds, Counters));
+
+	// Shadow rays from every primary hit to a point on a light, the same points for every run
+	if (Lights.Num() > 0)
+	{
+		FMath::RandInit(Seed);
+		float LightArea = 0;
+		for (ATriangleMesh* Light : Lights)
+		{
+			LightArea += Light->GetArea();
+		}
+		TArray<FLightRay> ShadowRays;
+		TArray<float> ShadowDistances;
+		for (const FIntersection& Hit : Hits)
+		{
+			if (!Hit.bBlockingHit || !Hit.Emit.IsNearlyZero())
+				continue;
+			float Pick = FMath::FRand() * LightArea;
+			ATriangleMesh* Light = Lights.Last();
+			for (ATriangleMesh* Candidate : Lights)
+			{
+				Pick -= Candidate->GetArea();
+				if (Pick <= 0)
+				{
+					Light = Candidate;
+					break;
+				}
+			}
+			FIntersection LightPoint;
+			float Pdf;
+			Light->Sample(LightPoint, Pdf);
+			const FVector Origin = Hit.Coords + Hit.Normal * EPSILON;
+			ShadowRays.Add(FLightRay(Origin, (LightPoint.Coords - Origin).GetSafeNormal()));
+			ShadowDistances.Add(FVector::Dist(Origin, LightPoint.Coords));
+		}
+		int32 Blocked = 0;
+		const double ShadowSeconds = RayBenchmark::TimeBest(Repeat, Counters, [&]()
+		{
+			Blocked = 0;
+			for (int32 i = 0; i < ShadowRays.Num(); ++i)
+			{
+				const FIntersection Hit = Tree->Intersect(ShadowRays[i]);
+				Blocked += Hit.bBlockingHit && Hit.Distance < ShadowDistances[i] - EPSILON ? 1 : 0;
+			}
+		});
+		Report->SetObjectField(TEXT("shadow"), RayBenchmark::RayReport(ShadowRays.Num(), Blocked, ShadowSeconds, Counters));
+	}
+
+	// Full frames on the worker threads, which count into sets of their own, so only the time is reported
+	if (MultiThreadScreen)
+	{
+		TArray<FLinearColor> Colors;
+		double PathSeconds = TNumericLimits<double>::Max();
+		for (int32 i = 0; i < FMath::Max(Repeat, 1); ++i)
+		{
+			const double StartTime = FPlatformTime::Seconds();
+			if (!MultiThreadScreen->RenderOffline(Width, Height, Colors))
+			{
+				break;
+			}
+			PathSeconds = FMath::Min(PathSeconds, FPlatformTime::Seconds() - StartTime);
+		}
+		if (PathSeconds < TNumericLimits<double>::Max())
+		{
+			const double Paths = (double)Width * Height * MultiThreadScreen->Spp;
+			TSharedPtr<FJsonObject> Path = MakeShared<FJsonObject>();
+			Path->SetNumberField(TEXT("spp"), MultiThreadScreen->Spp);
+			Path->SetNumberField(TEXT("threads"), MultiThreadScreen->WorkerThreads);
+			Path->SetNumberField(TEXT("ms"), PathSeconds * 1000);
+			Path->SetNumberField(TEXT("mpaths_per_s"), Paths / PathSeconds / 1e6);
+			Path->SetNumberField(TEXT("ns_per_path"), PathSeconds * 1e9 / Paths);
+			Report->SetObjectField(TEXT("path"), Path);
+		}
+	}
+
+	URenderSceneCommandlet::UnloadWorld(World);
+	return Report;
+}
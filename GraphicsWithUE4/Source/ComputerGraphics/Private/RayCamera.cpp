@@ -0,0 +1,134 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RayCamera.h"
+
+FRayCamera::FRayCamera()
+{
+	Setup(FVector::ZeroVector, FRotator::ZeroRotator, 90.f, 1, 1);
+}
+
+void FRayCamera::Setup(const FVector& InLocation, const FRotator& InRotation, float InFOV, int32 InWidth, int32 InHeight, float InLensRadius, float InFocusDistance)
+{
+	Location = InLocation;
+	Width = FMath::Max(InWidth, 1);
+	Height = FMath::Max(InHeight, 1);
+	LensRadius = FMath::Max(InLensRadius, 0.f);
+	FocusDistance = FMath::Max(InFocusDistance, KINDA_SMALL_NUMBER);
+
+	const FRotationMatrix Basis(InRotation);
+	Forward = Basis.GetUnitAxis(EAxis::X);
+	Right = Basis.GetUnitAxis(EAxis::Y);
+	Up = Basis.GetUnitAxis(EAxis::Z);
+
+	Focal = (Height - 1) * 0.5f / FMath::Tan(InFOV / 360 * PI);
+	PixelOrigin = Forward * Focal - Right * ((Width - 1) * 0.5f) + Up * ((Height - 1) * 0.5f);
+}
+
+bool FRayCamera::Equals(const FRayCamera& Other) const
+{
+	return Location == Other.Location && Forward == Other.Forward && Right == Other.Right && Up == Other.Up && PixelOrigin == Other.PixelOrigin
+		&& Width == Other.Width && Height == Other.Height && LensRadius == Other.LensRadius && FocusDistance == Other.FocusDistance;
+}
+
+bool FRayCamera::Project(const FVector& Position, float& OutX, float& OutY, float& OutDepth) const
+{
+	const FVector Offset = Position - Location;
+	OutDepth = FVector::DotProduct(Offset, Forward);
+	if (OutDepth <= KINDA_SMALL_NUMBER)
+	{
+		return false;
+	}
+	const float Scale = Focal / OutDepth;
+	OutX = FVector::DotProduct(Offset, Right) * Scale + (Width - 1) * 0.5f;
+	OutY = (Height - 1) * 0.5f - FVector::DotProduct(Offset, Up) * Scale;
+	return true;
+}
+
+FLightRay FRayCamera::GenerateRay(float X, float Y) const
+{
+	return FLightRay(Location, (PixelOrigin + Right * X - Up * Y).GetSafeNormal());
+}
+
+void FRayCamera::ApplyLens(FLightRay& Ray, FRandomStream& Stream) const
+{
+	// Rays through the same pixel converge on the focus plane
+	const FVector FocusPoint = Ray(FocusDistance / FVector::DotProduct(Ray.Direction, Forward));
+	float LensX, LensY;
+	do
+	{
+		LensX = Stream.FRandRange(-1.f, 1.f);
+		LensY = Stream.FRandRange(-1.f, 1.f);
+	} while (LensX * LensX + LensY * LensY > 1.f);
+	const FVector Origin = Location + (Right * LensX + Up * LensY) * LensRadius;
+	Ray = FLightRay(Origin, (FocusPoint - Origin).GetSafeNormal());
+}
+
+void FRayCamera::GenerateTileRays(int32 X, int32 Y, int32 TileWidth, int32 TileHeight, TArray<FLightRay>& OutRays, FRandomStream* JitterStream, FRandomStream* LensStream) const
+{
+	OutRays.SetNumUninitialized(TileWidth * TileHeight, false);
+
+	const VectorRegister RightX = VectorSetFloat1(Right.X);
+	const VectorRegister RightY = VectorSetFloat1(Right.Y);
+	const VectorRegister RightZ = VectorSetFloat1(Right.Z);
+	const VectorRegister Lane = MakeVectorRegister(0.f, 1.f, 2.f, 3.f);
+	const VectorRegister One = VectorOne();
+
+	MS_ALIGN(16) float DirX[4] GCC_ALIGN(16);
+	MS_ALIGN(16) float DirY[4] GCC_ALIGN(16);
+	MS_ALIGN(16) float DirZ[4] GCC_ALIGN(16);
+	MS_ALIGN(16) float InvX[4] GCC_ALIGN(16);
+	MS_ALIGN(16) float InvY[4] GCC_ALIGN(16);
+	MS_ALIGN(16) float InvZ[4] GCC_ALIGN(16);
+
+	int32 Index = 0;
+	for (int32 Row = 0; Row < TileHeight; ++Row)
+	{
+		for (int32 Column = 0; Column < TileWidth; Column += 4)
+		{
+			// Four pixels of the row at once: Dir = PixelOrigin + Right * PixelX - Up * PixelY
+			VectorRegister PixelX = VectorAdd(VectorSetFloat1((float)(X + Column)), Lane);
+			VectorRegister PixelY = VectorSetFloat1((float)(Y + Row));
+			if (JitterStream)
+			{
+				PixelX = VectorAdd(PixelX, MakeVectorRegister(JitterStream->GetFraction() - .5f, JitterStream->GetFraction() - .5f, JitterStream->GetFraction() - .5f, JitterStream->GetFraction() - .5f));
+				PixelY = VectorAdd(PixelY, MakeVectorRegister(JitterStream->GetFraction() - .5f, JitterStream->GetFraction() - .5f, JitterStream->GetFraction() - .5f, JitterStream->GetFraction() - .5f));
+			}
+			VectorRegister DX = VectorMultiplyAdd(PixelX, RightX, VectorSubtract(VectorSetFloat1(PixelOrigin.X), VectorMultiply(PixelY, VectorSetFloat1(Up.X))));
+			VectorRegister DY = VectorMultiplyAdd(PixelX, RightY, VectorSubtract(VectorSetFloat1(PixelOrigin.Y), VectorMultiply(PixelY, VectorSetFloat1(Up.Y))));
+			VectorRegister DZ = VectorMultiplyAdd(PixelX, RightZ, VectorSubtract(VectorSetFloat1(PixelOrigin.Z), VectorMultiply(PixelY, VectorSetFloat1(Up.Z))));
+
+			const VectorRegister LengthSquared = VectorMultiplyAdd(DX, DX, VectorMultiplyAdd(DY, DY, VectorMultiply(DZ, DZ)));
+			const VectorRegister LengthInv = VectorReciprocalSqrtAccurate(LengthSquared);
+			DX = VectorMultiply(DX, LengthInv);
+			DY = VectorMultiply(DY, LengthInv);
+			DZ = VectorMultiply(DZ, LengthInv);
+
+			VectorStoreAligned(DX, DirX);
+			VectorStoreAligned(DY, DirY);
+			VectorStoreAligned(DZ, DirZ);
+			VectorStoreAligned(VectorDivide(One, DX), InvX);
+			VectorStoreAligned(VectorDivide(One, DY), InvY);
+			VectorStoreAligned(VectorDivide(One, DZ), InvZ);
+
+			const int32 Count = FMath::Min(4, TileWidth - Column);
+			for (int32 i = 0; i < Count; ++i)
+			{
+				FLightRay& Ray = OutRays[Index++];
+				Ray.Origin = Location;
+				Ray.Direction = FVector(DirX[i], DirY[i], DirZ[i]);
+				Ray.DirectionInv = FVector(InvX[i], InvY[i], InvZ[i]);
+				Ray.t_min = 0.0;
+				Ray.t_max = TNumericLimits<float>::Max();
+			}
+		}
+	}
+
+	if (LensRadius > 0 && LensStream)
+	{
+		for (FLightRay& Ray : OutRays)
+		{
+			ApplyLens(Ray, *LensStream);
+		}
+	}
+}
@@ -0,0 +1,43 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RaySorter.h"
+
+// Spreads the low 10 bits so two zero bits follow each of them
+static uint32 SpreadBits(uint32 Value)
+{
+	Value &= 0x3ff;
+	Value = (Value | (Value << 16)) & 0x030000ff;
+	Value = (Value | (Value << 8)) & 0x0300f00f;
+	Value = (Value | (Value << 4)) & 0x030c30c3;
+	Value = (Value | (Value << 2)) & 0x09249249;
+	return Value;
+}
+
+uint32 FRaySorter::GetMortonCode(const FVector& Point, const FBounds3& Bound)
+{
+	const FVector Cell = Bound.Offset(Point).BoundToBox(FVector::ZeroVector, FVector::OneVector) * 1023.f;
+	return SpreadBits((uint32)Cell.X) | (SpreadBits((uint32)Cell.Y) << 1) | (SpreadBits((uint32)Cell.Z) << 2);
+}
+
+uint64 FRaySorter::GetKey(const FLightRay& Ray, const FBounds3& SceneBound)
+{
+	const uint32 Morton = GetMortonCode(Ray.Origin, SceneBound);
+	const uint32 Octant = (Ray.Direction.X < 0 ? 1 : 0) | (Ray.Direction.Y < 0 ? 2 : 0) | (Ray.Direction.Z < 0 ? 4 : 0);
+	return ((uint64)Octant << 30) | Morton;
+}
+
+void FRaySorter::Sort(const TArray<FLightRay>& Rays, const FBounds3& SceneBound, TArray<int32>& Order)
+{
+	Keys.Reset(Rays.Num());
+	for (int32 i = 0; i < Rays.Num(); ++i)
+	{
+		Keys.Add({ GetKey(Rays[i], SceneBound), i });
+	}
+	Keys.Sort([](const FRayKey& A, const FRayKey& B) { return A.Key < B.Key; });
+	Order.Reset(Keys.Num());
+	for (const FRayKey& Key : Keys)
+	{
+		Order.Add(Key.Index);
+	}
+}
@@ -0,0 +1,182 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RenderSceneCommandlet.h"
+#include "Engine/Engine.h"
+#include "Engine/World.h"
+#include "EngineUtils.h"
+#include "IImageWrapper.h"
+#include "IImageWrapperModule.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Modules/ModuleManager.h"
+#include "RenderTrace.h"
+#include "ScreenSceneMultiThread.h"
+#include "ToneMapper.h"
+
+URenderSceneCommandlet::URenderSceneCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = true;
+	LogToConsole = true;
+}
+
+int32 URenderSceneCommandlet::Main(const FString& Params)
+{
+	FString MapName = TEXT("/Game/HW07/HW07_MultiThread");
+	FString OutputPath = FPaths::ProjectSavedDir() / TEXT("Render") / TEXT("Render");
+	FString ToneMapName = TEXT("ACES");
+	int32 Width = 784;
+	int32 Height = 784;
+	int32 Spp = 16;
+	int32 Threads = 0;
+	float Exposure = 1.f;
+	FParse::Value(*Params, TEXT("Map="), MapName);
+	FParse::Value(*Params, TEXT("Output="), OutputPath);
+	FParse::Value(*Params, TEXT("ToneMap="), ToneMapName);
+	FParse::Value(*Params, TEXT("Width="), Width);
+	FParse::Value(*Params, TEXT("Height="), Height);
+	FParse::Value(*Params, TEXT("Spp="), Spp);
+	FParse::Value(*Params, TEXT("Threads="), Threads);
+	FParse::Value(*Params, TEXT("Exposure="), Exposure);
+	const bool bDenoise = FParse::Param(*Params, TEXT("Denoise"));
+	FString TracePath;
+	const bool bTrace = FParse::Value(*Params, TEXT("Trace="), TracePath) || FParse::Param(*Params, TEXT("Trace"));
+	if (bTrace && TracePath.IsEmpty())
+	{
+		TracePath = OutputPath + TEXT(".json");
+	}
+
+	UWorld* World = LoadWorld(MapName);
+	if (!World)
+	{
+		UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:can not load map %s."), __LINE__, *MapName);
+		return 1;
+	}
+
+	// Settings have to be in place before BeginPlay starts the workers
+	AScreenSceneMultiThread* Scene = nullptr;
+	for (TActorIterator<AScreenSceneMultiThread> It(World); It; ++It)
+	{
+		Scene = *It;
+		Scene->Spp = FMath::Max(Spp, 1);
+		Scene->WorkerThreads = Threads;
+		Scene->bDenoise = bDenoise;
+		Scene->bDrawDebugPaths = false;
+		break;
+	}
+
+	int32 Result = 1;
+	if (Scene)
+	{
+		// BeginPlay builds the BVHs, they belong on the timeline too
+		if (bTrace)
+		{
+			FRenderTrace::StartCapture();
+		}
+		BeginPlay(World);
+
+		TArray<FLinearColor> Colors;
+		const bool bRendered = Scene->RenderOffline(Width, Height, Colors);
+		if (bTrace)
+		{
+			FRenderTrace::StopCapture(TracePath);
+		}
+		if (bRendered)
+		{
+			FToneMapper ToneMapper;
+			const EToneMapOperator Operator = ToneMapName == TEXT("Clamp") ? EToneMapOperator::Clamp : ToneMapName == TEXT("Reinhard") ? EToneMapOperator::Reinhard : EToneMapOperator::ACES;
+			ToneMapper.Setup(Operator, Exposure, true);
+			Result = SaveImages(OutputPath, Width, Height, Colors, ToneMapper) ? 0 : 1;
+		}
+		else
+		{
+			UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:%s has no scene to render."), __LINE__, *MapName);
+		}
+	}
+	else
+	{
+		UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:%s has no AScreenSceneMultiThread."), __LINE__, *MapName);
+	}
+
+	// The workers stop once the scene actor is gone
+	UnloadWorld(World);
+	return Result;
+}
+
+UWorld* URenderSceneCommandlet::LoadWorld(const FString& MapName)
+{
+	UPackage* Package = LoadPackage(nullptr, *MapName, LOAD_None);
+	UWorld* World = Package ? UWorld::FindWorldInPackage(Package) : nullptr;
+	if (!World)
+	{
+		return nullptr;
+	}
+
+	World->WorldType = EWorldType::Game;
+	World->AddToRoot();
+	if (!World->bIsWorldInitialized)
+	{
+		World->InitWorld(UWorld::InitializationValues()
+			.AllowAudioPlayback(false)
+			.CreatePhysicsScene(false)
+			.RequiresHitProxies(false)
+			.CreateNavigation(false)
+			.CreateAISystem(false)
+			.ShouldSimulatePhysics(false)
+			.SetTransactional(false));
+	}
+	FWorldContext& WorldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+	WorldContext.SetCurrentWorld(World);
+	World->UpdateWorldComponents(true, false);
+	return World;
+}
+
+void URenderSceneCommandlet::BeginPlay(UWorld* World)
+{
+	const FURL URL;
+	World->SetGameMode(URL);
+	World->InitializeActorsForPlay(URL);
+	World->BeginPlay();
+}
+
+void URenderSceneCommandlet::UnloadWorld(UWorld* World)
+{
+	// DestroyWorld routes EndPlay to the actors
+	GEngine->DestroyWorldContext(World);
+	World->DestroyWorld(false);
+	World->RemoveFromRoot();
+}
+
+bool URenderSceneCommandlet::SaveImages(const FString& OutputPath, int32 Width, int32 Height, const TArray<FLinearColor>& Colors, const FToneMapper& ToneMapper) const
+{
+	IImageWrapperModule& ImageWrapperModule = FModuleManager::LoadModuleChecked<IImageWrapperModule>(TEXT("ImageWrapper"));
+	bool bSaved = true;
+
+	TSharedPtr<IImageWrapper> ExrWrapper = ImageWrapperModule.CreateImageWrapper(EImageFormat::EXR);
+	if (ExrWrapper.IsValid() && ExrWrapper->SetRaw(Colors.GetData(), Colors.Num() * sizeof(FLinearColor), Width, Height, ERGBFormat::RGBA, 32))
+	{
+		bSaved &= FFileHelper::SaveArrayToFile(ExrWrapper->GetCompressed(), *(OutputPath + TEXT(".exr")));
+	}
+	else
+	{
+		bSaved = false;
+	}
+
+	TArray<FColor> Pixels;
+	Pixels.SetNumUninitialized(Colors.Num());
+	ToneMapper.Convert(Colors.GetData(), Pixels.GetData(), Colors.Num());
+	TSharedPtr<IImageWrapper> PngWrapper = ImageWrapperModule.CreateImageWrapper(EImageFormat::PNG);
+	if (PngWrapper.IsValid() && PngWrapper->SetRaw(Pixels.GetData(), Pixels.Num() * sizeof(FColor), Width, Height, ERGBFormat::BGRA, 8))
+	{
+		bSaved &= FFileHelper::SaveArrayToFile(PngWrapper->GetCompressed(), *(OutputPath + TEXT(".png")));
+	}
+	else
+	{
+		bSaved = false;
+	}
+
+	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:%s.exr / .png %s."), __LINE__, *OutputPath, bSaved ? TEXT("written") : TEXT("failed"));
+	return bSaved;
+}
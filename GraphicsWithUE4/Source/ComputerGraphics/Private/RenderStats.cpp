@@ -0,0 +1,50 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RenderStats.h"
+
+void FRenderCounters::Accumulate(const FRenderCounters& Other)
+{
+	Traversal.Nodes += Other.Traversal.Nodes;
+	Traversal.Leaves += Other.Traversal.Leaves;
+	Traversal.Primitives += Other.Traversal.Primitives;
+	CameraRays += Other.CameraRays;
+	ShadowRays += Other.ShadowRays;
+	IndirectRays += Other.IndirectRays;
+	Paths += Other.Paths;
+	PathSegments += Other.PathSegments;
+	RouletteTerminations += Other.RouletteTerminations;
+	Tiles += Other.Tiles;
+	BusySeconds += Other.BusySeconds;
+	IdleSeconds += Other.IdleSeconds;
+}
+
+FRenderCounters FRenderCounters::operator-(const FRenderCounters& Other) const
+{
+	FRenderCounters Result;
+	Result.Traversal.Nodes = Traversal.Nodes - Other.Traversal.Nodes;
+	Result.Traversal.Leaves = Traversal.Leaves - Other.Traversal.Leaves;
+	Result.Traversal.Primitives = Traversal.Primitives - Other.Traversal.Primitives;
+	Result.CameraRays = CameraRays - Other.CameraRays;
+	Result.ShadowRays = ShadowRays - Other.ShadowRays;
+	Result.IndirectRays = IndirectRays - Other.IndirectRays;
+	Result.Paths = Paths - Other.Paths;
+	Result.PathSegments = PathSegments - Other.PathSegments;
+	Result.RouletteTerminations = RouletteTerminations - Other.RouletteTerminations;
+	Result.Tiles = Tiles - Other.Tiles;
+	Result.BusySeconds = BusySeconds - Other.BusySeconds;
+	Result.IdleSeconds = IdleSeconds - Other.IdleSeconds;
+	return Result;
+}
+
+FRenderCounters*& FRenderCounters::ForThread()
+{
+	static thread_local FRenderCounters* Counters = nullptr;
+	return Counters;
+}
+
+void FRenderCounters::Install(FRenderCounters* Counters)
+{
+	ForThread() = Counters;
+	FTraversalCounters::ForThread() = Counters ? &Counters->Traversal : nullptr;
+}
@@ -0,0 +1,126 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "RenderTrace.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/ThreadManager.h"
+#include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace RenderTrace
+{
+	struct FEvent
+	{
+		const TCHAR* Name;
+		uint64 StartCycles;
+		uint64 EndCycles;
+	};
+
+	// Events of one thread, the lock is only contended while a capture is written
+	struct FThreadEvents
+	{
+		uint32 ThreadId;
+		FCriticalSection Lock;
+		TArray<FEvent> Events;
+	};
+
+	FCriticalSection RegistryLock;
+	TArray<FThreadEvents*> Registry;
+	uint64 CaptureStartCycles = 0;
+
+	FThreadEvents& GetThreadEvents()
+	{
+		// Never freed, worker threads may outlive a capture
+		static thread_local FThreadEvents* Events = nullptr;
+		if (!Events)
+		{
+			Events = new FThreadEvents();
+			Events->ThreadId = FPlatformTLS::GetCurrentThreadId();
+			FScopeLock Lock(&RegistryLock);
+			Registry.Add(Events);
+		}
+		return *Events;
+	}
+
+	double ToMicroseconds(uint64 Cycles)
+	{
+		return FPlatformTime::ToMilliseconds64(Cycles - CaptureStartCycles) * 1000;
+	}
+}
+
+volatile bool FRenderTrace::bCapturing = false;
+
+void FRenderTrace::StartCapture()
+{
+	using namespace RenderTrace;
+	FScopeLock RegistryScope(&RegistryLock);
+	for (FThreadEvents* Events : Registry)
+	{
+		FScopeLock Lock(&Events->Lock);
+		Events->Events.Reset();
+	}
+	CaptureStartCycles = FPlatformTime::Cycles64();
+	FPlatformMisc::MemoryBarrier();
+	bCapturing = true;
+}
+
+bool FRenderTrace::StopCapture(const FString& Path)
+{
+	using namespace RenderTrace;
+	if (!bCapturing)
+	{
+		return false;
+	}
+	bCapturing = false;
+	FPlatformMisc::MemoryBarrier();
+
+	FString Json = TEXT("{\"traceEvents\":[");
+	bool bFirst = true;
+	FScopeLock RegistryScope(&RegistryLock);
+	for (FThreadEvents* Events : Registry)
+	{
+		FScopeLock Lock(&Events->Lock);
+		if (Events->Events.Num() == 0)
+		{
+			continue;
+		}
+		const FString& ThreadName = FThreadManager::Get().GetThreadName(Events->ThreadId);
+		Json += FString::Printf(TEXT("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}"),
+			bFirst ? TEXT("") : TEXT(","), Events->ThreadId, ThreadName.IsEmpty() ? TEXT("GameThread") : *ThreadName);
+		bFirst = false;
+		for (const FEvent& Event : Events->Events)
+		{
+			const double Start = ToMicroseconds(Event.StartCycles);
+			Json += FString::Printf(TEXT(",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}"),
+				Event.Name, Events->ThreadId, Start, ToMicroseconds(Event.EndCycles) - Start);
+		}
+		Events->Events.Reset();
+	}
+	Json += TEXT("]}");
+
+	const FString FilePath = Path.IsEmpty() ? FPaths::ProfilingDir() / FString::Printf(TEXT("RayTracer-%s.json"), *FDateTime::Now().ToString()) : Path;
+	const bool bSaved = FFileHelper::SaveStringToFile(Json, *FilePath);
+	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:trace %s %s."), __LINE__, *FilePath, bSaved ? TEXT("written") : TEXT("failed"));
+	return bSaved;
+}
+
+void FRenderTrace::Record(const TCHAR* Name, uint64 StartCycles, uint64 EndCycles)
+{
+	RenderTrace::FThreadEvents& Events = RenderTrace::GetThreadEvents();
+	FScopeLock Lock(&Events.Lock);
+	Events.Events.Add({ Name, StartCycles, EndCycles });
+}
+
+static FAutoConsoleCommand StartTraceCommand(
+	TEXT("RayTracer.Trace.Start"),
+	TEXT("Starts recording the render jobs for a Chrome trace file"),
+	FConsoleCommandDelegate::CreateStatic(&FRenderTrace::StartCapture));
+
+static FAutoConsoleCommand StopTraceCommand(
+	TEXT("RayTracer.Trace.Stop"),
+	TEXT("Writes the recorded render jobs as Chrome trace JSON, optionally to the given path"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FRenderTrace::StopCapture(Args.Num() > 0 ? Args[0] : FString());
+	}));
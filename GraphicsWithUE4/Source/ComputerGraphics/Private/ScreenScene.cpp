@@ -9,6 +9,9 @@
 #include "DynamicTextureComponent.h"
 #include "Kismet/KismetSystemLibrary.h"
 #include "Engine/PointLight.h"
+#include "Camera/PlayerCameraManager.h"
+#include "RenderTrace.h"
+#include "Hash/CityHash.h"
 
 // Sets default values
 AScreenScene::AScreenScene()
@@ -50,13 +53,39 @@ void AScreenScene::BeginPlay()
     {
         Lights.Add(Light->GetActorLocation());
     }
+    UpdateCamera();
+    DebugPaths.Reset(DebugPathCapacity);
+}
+
+void AScreenScene::UpdateCamera()
+{
+    Camera = GetViewCamera();
+}
+
+FRayCamera AScreenScene::GetViewCamera() const
+{
+    FVector Location = FVector::ZeroVector;
+    FRotator Rotation = FRotator::ZeroRotator;
+    float VerticalFOV = FOV;
+    APlayerCameraManager* CameraManager = bUsePlayerView ? UGameplayStatics::GetPlayerCameraManager(this, 0) : nullptr;
+    if (CameraManager)
+    {
+        Location = CameraManager->GetCameraLocation();
+        Rotation = CameraManager->GetCameraRotation();
+        // Player FOV is horizontal, ours is vertical
+        const float TanHalf = FMath::Tan(CameraManager->GetFOVAngle() / 360 * PI) * (Texture->Height - 1) / FMath::Max(Texture->Width - 1, 1);
+        VerticalFOV = FMath::Atan(TanHalf) * 360 / PI;
+    }
+    FRayCamera ViewCamera;
+    ViewCamera.Setup(Location, Rotation, VerticalFOV, Texture->Width, Texture->Height, LensRadius, FocusDistance);
+    return ViewCamera;
 }
 
 void AScreenScene::DrawOnePixel()
 {
     if (CurrentDrawingY < Texture->Height)   
     {
-        FLightRay Ray(FVector(0), FVector((Texture->Height - 1) * 0.5f / FMath::Tan(FOV/360 * 3.141593f), CurrentDrawingX - (Texture->Width - 1) * 0.5f, (Texture->Height - 1) * 0.5f - CurrentDrawingY).GetSafeNormal());
+        FLightRay Ray = Camera.GenerateRay(CurrentDrawingX, CurrentDrawingY);
         if (Texture->SetPixelWithoutLock(CurrentDrawingX, CurrentDrawingY, CastRayWithSpp(Ray, 0)))
         {
             ++CurrentDrawingX;
@@ -76,8 +105,6 @@ void AScreenScene::DrawOnePixel()
 
 void AScreenScene::DrawOneLinePixel()
 {
-    struct FDynamicTextureLock Lock(Texture);
-    FPlatformMisc::MemoryBarrier();
     for (int32 i = 0; i < Texture->Width; ++i)
     {
         DrawOnePixel();
@@ -106,14 +133,14 @@ void AScreenScene::Tick(float DeltaTime)
     }
     else if (bEnableDrawPath)
     {
-        FLightRay Ray(FVector(0), FVector((Texture->Height - 1) * 0.5f / FMath::Tan(FOV / 360 * 3.141593f), CurrentDrawingX - (Texture->Width - 1) * 0.5f, (Texture->Height - 1) * 0.5f - CurrentDrawingY).GetSafeNormal());
-        CastRay(Ray, 0);
+        CastRay(Camera.GenerateRay(CurrentDrawingX, CurrentDrawingY), 0);
     }
 
     if (ShowTree && BvhTree)
     {
         BvhTree->DrawTree(GetWorld(), TreeDepth);
     }
+    DebugPaths.Flush(GetWorld());
 }
 
 void AScreenScene::BeginDraw()
@@ -121,6 +148,7 @@ void AScreenScene::BeginDraw()
     bEnableDrawFrame = true;
     CurrentDrawingX = 0;
     CurrentDrawingY = 0;
+    UpdateCamera();
     TArray<AActor*> OutActors;
     UGameplayStatics::GetAllActorsOfClass(this, ATriangleMesh::StaticClass(), OutActors);
     for (AActor* A : OutActors)
@@ -136,6 +164,7 @@ void AScreenScene::BeginPath(FVector Location)
     if (!bEnableDrawFrame)
     {
         bEnableDrawPath = true;
+        UpdateCamera();
         CurrentDrawingX = FMath::RoundToInt((Texture->Width - 1) * 0.5f + Location.Y);
         CurrentDrawingY = FMath::RoundToInt((Texture->Height - 1) * 0.5f - Location.Z);
     }
@@ -145,18 +174,28 @@ void AScreenScene::BuildTree()
 {
     if (IsValid(BvhTree))
         return;
+    RENDER_TRACE_SCOPE(BuildSceneBVH);
     BvhTree = NewObject<UBVHTree>();
+    BvhTree->SplitMethod = SplitMethod;
+    BvhTree->MaxReferenceGrowth = MaxReferenceGrowth;
+    BvhTree->NodeLayout = NodeLayout;
     TArray<AActor*> OutActors;
     UGameplayStatics::GetAllActorsOfClass(this, ATriangleMesh::StaticClass(), OutActors);
     TArray<IObjectInterface*> Objects;
     Objects.Reserve(OutActors.Num());
+    // The scene tree depends on nothing but the mesh trees and their order
+    TArray<uint64> MeshHashes;
+    bool bMeshesBuilt = true;
     for (AActor* A : OutActors)
     {
         IObjectInterface* Obj = Cast<IObjectInterface>(A);
         if (ensure(Obj))
             Objects.Add(Obj);
+        MeshHashes.Add(Cast<ATriangleMesh>(A)->GetContentHash());
+        bMeshesBuilt &= MeshHashes.Last() != 0;
     }
-    BvhTree->BuildTree(Objects);
+    const uint64 ContentHash = bMeshesBuilt ? CityHash64(reinterpret_cast<const char*>(MeshHashes.GetData()), MeshHashes.Num() * sizeof(uint64)) : 0;
+    BvhTree->BuildTree(Objects, 1, ContentHash);
     TriangleMeshes.Reserve(OutActors.Num());
     for (AActor* Actor : OutActors)
     {
@@ -164,6 +203,24 @@ void AScreenScene::BuildTree()
     }
 }
 
+uint32 AScreenScene::GetSceneHash() const
+{
+    uint32 Hash = PointerHash(BvhTree);
+    for (ATriangleMesh* Mesh : TriangleMeshes)
+    {
+        if (!IsValid(Mesh))
+            continue;
+        const FTransform Transform = Mesh->GetActorTransform();
+        Hash = HashCombine(Hash, GetTypeHash(Transform.GetLocation()));
+        Hash = HashCombine(Hash, GetTypeHash(Transform.GetRotation().Euler()));
+        Hash = HashCombine(Hash, GetTypeHash(Transform.GetScale3D()));
+        Hash = HashCombine(Hash, GetTypeHash(Mesh->Kd));
+        Hash = HashCombine(Hash, PointerHash(Mesh->KdTexture));
+        Hash = HashCombine(Hash, GetTypeHash(Mesh->GetEmit()));
+    }
+    return Hash;
+}
+
 void AScreenScene::SimpleLight(FIntersection& Position, float& Pdf) const
 {
     float emit_area_sum = 0;
@@ -201,7 +258,8 @@ FLinearColor AScreenScene::CastRay_Implementation(const FLightRay& Ray, int32 De
     FIntersection HitResult = BvhTree->Intersect(Ray, bEnableDrawPath);
     const UTriangle* HitObject = Cast<UTriangle>(HitResult.Object.GetObject());
     FLinearColor hitColor = Texture->BackGroundColor;
-    FVector HitPoint = Ray.Origin + Ray.Direction * 3000 / Ray.Direction.X;
+    FVector HitPoint = Ray(3000 / FVector::DotProduct(Ray.Direction, Camera.GetForward()));
+    const bool bDrawPath = bEnableDrawPath ? ENABLE_DRAW_DEBUG && bDrawDebugPaths : SampleDebugPath();
 
     if (HitResult.bBlockingHit && HitObject) {
         HitPoint = HitResult.Coords;
@@ -216,10 +274,12 @@ FLinearColor AScreenScene::CastRay_Implementation(const FLightRay& Ray, int32 De
             bool inShadow = BvhTree->Intersect(FLightRay(ShadowPointOrig, LightDir)).bBlockingHit;
             float LdotN = inShadow ? 0 : FMath::Max(0.f, FVector::DotProduct(LightDir, N));
             LightAmt += FLinearColor::White * LdotN;
-            UKismetSystemLibrary::DrawDebugLine(GetWorld(), ShadowPointOrig, Lights[i], LdotN <= 0 ? FLinearColor::Black : hitColor);
+            if (bDrawPath)
+                AddDebugPath(ShadowPointOrig, Lights[i], LdotN <= 0 ? FLinearColor::Black : hitColor);
         }
         hitColor = (LightAmt * (HitObject->GetColor() * 0.6f));
     }
-    UKismetSystemLibrary::DrawDebugLine(GetWorld(), Ray.Origin, HitPoint, hitColor);
+    if (bDrawPath)
+        AddDebugPath(Ray.Origin, HitPoint, hitColor);
     return hitColor;
 }
\ No newline at end of file
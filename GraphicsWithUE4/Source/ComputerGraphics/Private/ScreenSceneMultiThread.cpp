@@ -6,49 +6,285 @@
 #include "Kismet/KismetSystemLibrary.h"
 #include "BVHTree.h"
 #include "DynamicTextureComponent.h"
+#include "Async/Async.h"
+#include "RenderStats.h"
+#include "RenderTrace.h"
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("Camera rays"), STAT_CameraRays, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Shadow rays"), STAT_ShadowRays, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Indirect rays"), STAT_IndirectRays, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("BVH nodes visited"), STAT_NodesVisited, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("BVH leaves visited"), STAT_LeavesVisited, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Primitives tested"), STAT_PrimitivesTested, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Paths finished"), STAT_PathsFinished, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Russian roulette terminations"), STAT_RouletteTerminations, STATGROUP_RayTracer);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Average path length"), STAT_AveragePathLength, STATGROUP_RayTracer);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Tiles rendered"), STAT_TilesRendered, STATGROUP_RayTracer);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Queued tiles"), STAT_QueuedTiles, STATGROUP_RayTracer);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Pixels in flight"), STAT_PixelsInFlight, STATGROUP_RayTracer);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Worker busy %"), STAT_WorkerBusy, STATGROUP_RayTracer);
 
 // Called when the game starts or when spawned
 void AScreenSceneMultiThread::BeginPlay()
 {
     Super::BeginPlay();
+	const uint32 ThreadCount = WorkerThreads > 0 ? WorkerThreads : FPlatformProcess::GetCurrentCoreNumber();
 	uint32 i = 0;
-	for (; i < FPlatformProcess::GetCurrentCoreNumber(); ++i)
+	for (; i < ThreadCount; ++i)
 	{
-		FRunnableThread::Create(new FDrawTask(i, this), *FString::Printf(TEXT("%s%d"), *StaticClass()->GetFName().ToString(), i));
+		FDrawTask* Task = new FDrawTask(i, this);
+		DrawTasks.Add(Task);
+		DrawThreads.Add(FRunnableThread::Create(Task, *FString::Printf(TEXT("%s%d"), *StaticClass()->GetFName().ToString(), i)));
 	}
 	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:%d threads created."), __LINE__, i);
 }
 
-void AScreenSceneMultiThread::DrawOnePixel()
+void AScreenSceneMultiThread::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
-	if (CurrentDrawingY < Texture->Height)
+	CancelFrame();
+	for (FRunnableThread* Thread : DrawThreads)
 	{
-		ensure(WorkQueue.Enqueue(FPointToCompute(CurrentDrawingX, CurrentDrawingY)));
-		++CurrentCompute;
-		++CurrentDrawingX;
-		if (CurrentDrawingX >= Texture->Width)
+		if (Thread)
 		{
-			++CurrentDrawingY;
-			CurrentDrawingX = 0;
+			// Calls FDrawTask::Stop and waits for Run to return
+			Thread->Kill(true);
+			delete Thread;
 		}
 	}
+	DrawThreads.Reset();
+	for (FDrawTask* Task : DrawTasks)
+	{
+		delete Task;
+	}
+	DrawTasks.Reset();
+	FrameStartThreadCounters.Reset();
+	// The task only holds the shared denoiser and result, waiting keeps its cost out of the next level
+	while (Denoiser.IsValid() && Denoiser->bRunning)
+	{
+		FPlatformProcess::Sleep(0.001f);
+	}
+	Super::EndPlay(EndPlayReason);
+}
+
+// Enqueues the next tile of the frame
+void AScreenSceneMultiThread::DrawOnePixel()
+{
+	if (NextTile < FrameTiles.Num())
+	{
+		const FTileToCompute& Tile = FrameTiles[NextTile++];
+		FPlatformAtomics::InterlockedIncrement(&QueuedTiles);
+		ensure(WorkQueue.Enqueue(Tile));
+		CurrentCompute += Tile.Num();
+	}
 	else
 	{
 		bEnableDrawFrame = false;
-		CurrentDrawingY = 0;
 	}
 }
 
+// Enqueues one row worth of tiles
 void AScreenSceneMultiThread::DrawOneLinePixel()
 {
 	if (CurrentCompute - CurrentDraw > MaxWorkCountPerTick)
 		return;
-	for (int32 i = 0; i < Texture->Width; ++i)
+	for (int32 i = 0; i < Texture->Width; i += FMath::Max(TileSize, 1))
 	{
 		DrawOnePixel();
 	}
 }
 
+void AScreenSceneMultiThread::BuildFrameTiles()
+{
+	const int32 Size = FMath::Max(TileSize, 1);
+	FrameTiles.Reset();
+	NextTile = 0;
+	TArray<int32> Missing;
+	for (int32 Y = 0; Y < Texture->Height; Y += Size)
+	{
+		for (int32 X = 0; X < Texture->Width; X += Size)
+		{
+			FTileToCompute Tile(X, Y, FMath::Min(Size, Texture->Width - X), FMath::Min(Size, Texture->Height - Y), FrameIndex);
+			Tile.Camera = Camera;
+			Tile.CacheVersion = PrimaryHitCacheVersion;
+			int32 Count = 0;
+			if (IsAccumulating())
+			{
+				for (int32 Row = Tile.Y; Row < Tile.Y + Tile.Height; ++Row)
+				{
+					for (int32 Column = Tile.X; Column < Tile.X + Tile.Width; ++Column)
+					{
+						Count += History[Row * Texture->Width + Column].A > 0 ? 0 : 1;
+					}
+				}
+				// The quick pass only fills the holes
+				if (bReducedPass && Count == 0)
+				{
+					continue;
+				}
+			}
+			FrameTiles.Add(Tile);
+			Missing.Add(Count);
+		}
+	}
+	if (IsAccumulating())
+	{
+		TArray<int32> Order;
+		for (int32 i = 0; i < FrameTiles.Num(); ++i)
+		{
+			Order.Add(i);
+		}
+		Order.StableSort([&Missing](int32 A, int32 B) { return Missing[A] > Missing[B]; });
+		TArray<FTileToCompute> Sorted;
+		Sorted.Reserve(Order.Num());
+		for (int32 Index : Order)
+		{
+			Sorted.Add(FrameTiles[Index]);
+		}
+		FrameTiles = MoveTemp(Sorted);
+	}
+}
+
+void AScreenSceneMultiThread::ReprojectHistory()
+{
+	const int32 PixelCount = Texture->Width * Texture->Height;
+	ReprojectedHistory.Reset(PixelCount);
+	ReprojectedHistory.AddZeroed(PixelCount);
+	ReprojectedPositions.Reset(PixelCount);
+	ReprojectedPositions.AddZeroed(PixelCount);
+	ReprojectedDepths.Init(TNumericLimits<float>::Max(), PixelCount);
+	for (int32 Pixel = 0; Pixel < PixelCount; ++Pixel)
+	{
+		// Misses have no depth to reproject with
+		if (History[Pixel].A <= 0 || HistoryPositions[Pixel].W <= 0)
+		{
+			continue;
+		}
+		float X, Y, Depth;
+		if (!Camera.Project(FVector(HistoryPositions[Pixel]), X, Y, Depth))
+		{
+			continue;
+		}
+		const int32 NewX = FMath::RoundToInt(X);
+		const int32 NewY = FMath::RoundToInt(Y);
+		if (NewX < 0 || NewY < 0 || NewX >= Texture->Width || NewY >= Texture->Height)
+		{
+			continue;
+		}
+		// Nearest surface wins, the covered ones are disoccluded later by the hit check in AccumulateTile
+		const int32 NewPixel = NewY * Texture->Width + NewX;
+		if (Depth < ReprojectedDepths[NewPixel])
+		{
+			ReprojectedDepths[NewPixel] = Depth;
+			ReprojectedHistory[NewPixel] = History[Pixel];
+			ReprojectedPositions[NewPixel] = HistoryPositions[Pixel];
+		}
+	}
+	Swap(History, ReprojectedHistory);
+	Swap(HistoryPositions, ReprojectedPositions);
+}
+
+void AScreenSceneMultiThread::PresentHistory()
+{
+	TArray<FLinearColor> Row;
+	Row.SetNumUninitialized(Texture->Width);
+	for (int32 Y = 0; Y < Texture->Height; ++Y)
+	{
+		for (int32 X = 0; X < Texture->Width; ++X)
+		{
+			Row[X] = GetHistoryColor(Y * Texture->Width + X);
+		}
+		Texture->SetSpan(0, Y, Texture->Width, Row.GetData());
+	}
+}
+
+void AScreenSceneMultiThread::WriteTile(const FTileToCompute& Tile, const FLinearColor* Colors, const FIntersection* Hits)
+{
+	if (Tile.Frame != FrameIndex)
+	{
+		return;
+	}
+	const bool bStoreDenoiseInput = bDenoise && Hits && Denoiser.IsValid() && Denoiser->GetWidth() == Texture->Width && Denoiser->GetHeight() == Texture->Height;
+	if (bStoreDenoiseInput)
+	{
+		for (int32 Index = 0; Index < Tile.Num(); ++Index)
+		{
+			Denoiser->SetInput((Tile.Y + Index / Tile.Width) * Texture->Width + Tile.X + Index % Tile.Width, Colors[Index], Hits[Index]);
+		}
+	}
+	if (OfflineColors)
+	{
+		for (int32 Row = 0; Row < Tile.Height; ++Row)
+		{
+			FMemory::Memcpy(&(*OfflineColors)[(Tile.Y + Row) * Texture->Width + Tile.X], Colors + Row * Tile.Width, Tile.Width * sizeof(FLinearColor));
+		}
+	}
+	// The accumulated image would flicker between noisy passes and filtered ones
+	if (!bStoreDenoiseInput || !IsAccumulating())
+	{
+		Texture->SetPixels(Tile.X, Tile.Y, Tile.Width, Tile.Height, Colors);
+	}
+	FPlatformAtomics::InterlockedAdd(&CurrentDraw, Tile.Num());
+}
+
+void AScreenSceneMultiThread::WriteTile(const FTileToCompute& Tile, const FColor* Colors)
+{
+	if (Tile.Frame == FrameIndex)
+	{
+		Texture->SetPixels(Tile.X, Tile.Y, Tile.Width, Tile.Height, Colors);
+		FPlatformAtomics::InterlockedAdd(&CurrentDraw, Tile.Num());
+	}
+}
+
+void AScreenSceneMultiThread::LaunchDenoise()
+{
+	if (!Denoiser.IsValid() || Denoiser->bRunning)
+	{
+		return;
+	}
+	DenoisedFrame = FrameIndex;
+	Denoiser->Snapshot();
+	Denoiser->bRunning = true;
+
+	FDenoiseSettings Settings;
+	Settings.Iterations = DenoiseIterations;
+	Settings.ColorSigma = DenoiseColorSigma;
+	Settings.NormalPower = DenoiseNormalPower;
+	Settings.DepthSigma = DenoiseDepthSigma;
+	if (!DenoiseResult.IsValid())
+	{
+		DenoiseResult = MakeShared<FDenoiseResult, ESPMode::ThreadSafe>();
+	}
+	DenoiseResult->bReady = false;
+	DenoiseResult->Epoch = DenoiseEpoch;
+	// Only shared state is captured, the actor may be gone by the time the task ends
+	TSharedPtr<FDenoiser, ESPMode::ThreadSafe> Task = Denoiser;
+	TSharedPtr<FDenoiseResult, ESPMode::ThreadSafe> Result = DenoiseResult;
+	Async(EAsyncExecution::ThreadPool, [Task, Result, Settings]()
+	{
+		const double StartTime = FPlatformTime::Seconds();
+		Task->Run(Settings, Result->Colors);
+		Result->Width = Task->GetWidth();
+		Result->Height = Task->GetHeight();
+		UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:denoised in %.3fs."), __LINE__, FPlatformTime::Seconds() - StartTime);
+		Result->bReady = true;
+		Task->bRunning = false;
+	});
+}
+
+void AScreenSceneMultiThread::ApplyDenoise()
+{
+	if (!DenoiseResult.IsValid() || !DenoiseResult->bReady)
+	{
+		return;
+	}
+	DenoiseResult->bReady = false;
+	if (DenoiseResult->Epoch == DenoiseEpoch && DenoiseResult->Width == Texture->Width && DenoiseResult->Height == Texture->Height
+		&& DenoiseResult->Colors.Num() == Texture->Width * Texture->Height)
+	{
+		Texture->SetPixels(0, 0, Texture->Width, Texture->Height, DenoiseResult->Colors.GetData());
+	}
+}
+
 FLinearColor AScreenSceneMultiThread::CastRayWithSpp(const FLightRay& Ray, int32 Depth)
 {
 	FLinearColor Result(0, 0, 0, 0);
@@ -60,74 +296,500 @@ FLinearColor AScreenSceneMultiThread::CastRayWithSpp(const FLightRay& Ray, int32
 	return FLinearColor(Result.R, Result.G, Result.B, 1);
 }
 
-FLinearColor AScreenSceneMultiThread::CastRayWithMultiThread(const FLightRay& Ray, int32 Depth)
+void AScreenSceneMultiThread::RenderTile(const FTileToCompute& Tile, FTileScratch& Scratch)
 {
-	if (!IsValid(BvhTree))
+	if (RenderMode != EScreenRenderMode::Radiance)
 	{
-		return FLinearColor::Black;
+		RenderTileCost(Tile, Scratch);
+		return;
 	}
-	FIntersection Intersection = BvhTree->Intersect(Ray);
-	FVector LDir(FVector::ZeroVector), LInder(FVector::ZeroVector);
-	if (Intersection.bBlockingHit)
+	TArray<FLightRay>& Rays = Scratch.Rays;
+	TArray<FLinearColor>& Colors = Scratch.Colors;
+	Colors.Reset(Tile.Num());
+	Colors.AddZeroed(Tile.Num());
+	const int32 RaysInPacket = FMath::Clamp(PacketSize, 1, FLightRayPacket::MaxSize);
+	// A newer BeginDraw waits for this tile, give up at the next sample
+	for (int32 i = 0; i < Spp && IsValid(BvhTree) && Tile.Frame == FrameIndex; ++i)
 	{
-		if (Intersection.Emit.Size() > 0)
+		// Without jitter or a lens every sample shares the same primary rays and hits
+		if (i == 0 || bJitterPixels || Tile.Camera.HasLens())
+		{
+			Tile.Camera.GenerateTileRays(Tile.X, Tile.Y, Tile.Width, Tile.Height, Rays, bJitterPixels ? &Scratch.RandomStream : nullptr, &Scratch.RandomStream);
+			TracePrimaryHits(Tile, Scratch);
+		}
+		if (bWavefront)
+		{
+			CastWavefrontWithMultiThread(Scratch);
+		}
+		else
 		{
-			// 打中光源
-			if (Depth == 0)
+			for (int32 Index = 0; Index < Rays.Num(); Index += RaysInPacket)
 			{
-				AsyncTask(ENamedThreads::GameThread,
-					[=]()
-					{
-						UKismetSystemLibrary::DrawDebugLine(GetWorld(), Ray.Origin, Intersection.Coords, Intersection.Emit, 0.1f, 5);
-					}
-				);
-				return FLinearColor(Intersection.Emit);
+				CastPacketWithMultiThread(&Rays[Index], &Scratch.PrimaryHits[Index], FMath::Min(RaysInPacket, Rays.Num() - Index), &Colors[Index]);
 			}
-			else
+		}
+	}
+	if (IsAccumulating())
+	{
+		AccumulateTile(Tile, Scratch);
+		return;
+	}
+	for (int32 Index = 0; Index < Colors.Num(); ++Index)
+	{
+		const FLinearColor Result = Colors[Index] / Spp;
+		Colors[Index] = FLinearColor(Result.R, Result.G, Result.B, 1);
+	}
+	WriteTile(Tile, Colors.GetData(), Scratch.PrimaryHits.GetData());
+}
+
+// Blue through cyan, green and yellow to red
+static FColor HeatColor(float Value)
+{
+	static const FLinearColor Stops[] = { FLinearColor(0, 0, 1), FLinearColor(0, 1, 1), FLinearColor(0, 1, 0), FLinearColor(1, 1, 0), FLinearColor(1, 0, 0) };
+	const float Position = FMath::Clamp(Value, 0.f, 1.f) * (UE_ARRAY_COUNT(Stops) - 1);
+	const int32 Index = FMath::Min(FMath::FloorToInt(Position), (int32)UE_ARRAY_COUNT(Stops) - 2);
+	return FLinearColor::LerpUsingHSV(Stops[Index], Stops[Index + 1], Position - Index).ToFColor(false);
+}
+
+void AScreenSceneMultiThread::RenderTileCost(const FTileToCompute& Tile, FTileScratch& Scratch)
+{
+	// Ray by ray, packets and batches share their traversals between pixels
+	Tile.Camera.GenerateTileRays(Tile.X, Tile.Y, Tile.Width, Tile.Height, Scratch.Rays);
+	TArray<FColor>& Heat = Scratch.Heat;
+	Heat.SetNumUninitialized(Tile.Num(), false);
+	float MaxCost = HeatmapMax;
+	if (MaxCost <= 0)
+	{
+		MaxCost = RenderMode == EScreenRenderMode::BVHNodes ? 500.f : RenderMode == EScreenRenderMode::Primitives ? 100.f : 50.f;
+	}
+	const FTraversalCounters& Traversal = Scratch.Counters.Traversal;
+	for (int32 Index = 0; Index < Scratch.Rays.Num() && IsValid(BvhTree) && Tile.Frame == FrameIndex; ++Index)
+	{
+		const uint64 Nodes = Traversal.Nodes;
+		const uint64 Primitives = Traversal.Primitives;
+		const uint64 StartCycles = FPlatformTime::Cycles64();
+		for (int32 i = 0; i < Spp; ++i)
+		{
+			CastRayWithMultiThread(Scratch.Rays[Index], 0);
+		}
+		float Cost;
+		switch (RenderMode)
+		{
+		case EScreenRenderMode::BVHNodes:
+			Cost = Traversal.Nodes - Nodes;
+			break;
+		case EScreenRenderMode::Primitives:
+			Cost = Traversal.Primitives - Primitives;
+			break;
+		default:
+			Cost = FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles) * 1000;
+			break;
+		}
+		Heat[Index] = HeatColor(Cost / Spp / MaxCost);
+	}
+	WriteTile(Tile, Heat.GetData());
+}
+
+void AScreenSceneMultiThread::AccumulateTile(const FTileToCompute& Tile, FTileScratch& Scratch)
+{
+	if (Tile.Frame != FrameIndex || History.Num() != Texture->Width * Texture->Height)
+	{
+		return;
+	}
+	for (int32 Index = 0; Index < Tile.Num(); ++Index)
+	{
+		const int32 X = Tile.X + Index % Tile.Width;
+		const int32 Y = Tile.Y + Index / Tile.Width;
+		const int32 Pixel = Y * Texture->Width + X;
+		const FIntersection& Hit = Scratch.PrimaryHits[Index];
+		FLinearColor& Sum = History[Pixel];
+		FVector4& Position = HistoryPositions[Pixel];
+		if (Sum.A > 0)
+		{
+			// Disoccluded or moved surface, the old samples belong to something else
+			const bool bWasHit = Position.W > 0;
+			const bool bSameSurface = bWasHit == Hit.bBlockingHit
+				&& (!bWasHit || FVector::DistSquared(FVector(Position), Hit.Coords) <= FMath::Square(ReprojectionTolerance * Hit.Distance));
+			if (!bSameSurface)
 			{
-				// 多次弹射击中光源
-				return FLinearColor::Black;
+				Sum = FLinearColor(0, 0, 0, 0);
 			}
 		}
+		if (Sum.A <= 0)
+		{
+			Position = FVector4(Hit.Coords, Hit.bBlockingHit ? 1.f : 0.f);
+		}
+		Sum += FLinearColor(Scratch.Colors[Index].R, Scratch.Colors[Index].G, Scratch.Colors[Index].B, Spp);
+		Scratch.Colors[Index] = GetHistoryColor(Pixel);
+	}
+	WriteTile(Tile, Scratch.Colors.GetData(), Scratch.PrimaryHits.GetData());
+}
+
+void AScreenSceneMultiThread::RenderTileReduced(const FTileToCompute& Tile, FTileScratch& Scratch)
+{
+	const int32 Block = FMath::Max(MotionResolutionDivisor, 1);
+	TArray<FLightRay>& Rays = Scratch.Rays;
+	TArray<FLinearColor>& Colors = Scratch.Colors;
+	Rays.Reset();
+	for (int32 Y = Tile.Y; Y < Tile.Y + Tile.Height; Y += Block)
+	{
+		for (int32 X = Tile.X; X < Tile.X + Tile.Width; X += Block)
+		{
+			Rays.Add(Tile.Camera.GenerateRay(FMath::Min(X + Block / 2, Tile.X + Tile.Width - 1), FMath::Min(Y + Block / 2, Tile.Y + Tile.Height - 1)));
+		}
+	}
+	Colors.Reset(Rays.Num());
+	Colors.AddZeroed(Rays.Num());
+	if (IsValid(BvhTree))
+	{
+		TraceBatch(Rays, Scratch.PrimaryHits, false, Scratch);
+		Scratch.Counters.CameraRays += Rays.Num();
+		const int32 RaysInPacket = FMath::Clamp(PacketSize, 1, FLightRayPacket::MaxSize);
+		for (int32 Index = 0; Index < Rays.Num(); Index += RaysInPacket)
+		{
+			CastPacketWithMultiThread(&Rays[Index], &Scratch.PrimaryHits[Index], FMath::Min(RaysInPacket, Rays.Num() - Index), &Colors[Index]);
+		}
+	}
+	if (Tile.Frame != FrameIndex)
+	{
+		return;
+	}
+	// Preview only, the block colour is not accumulated
+	const int32 BlocksPerRow = FMath::DivideAndRoundUp(Tile.Width, Block);
+	TArray<FLinearColor>& Preview = Scratch.Preview;
+	Preview.SetNumUninitialized(Tile.Num(), false);
+	for (int32 Y = Tile.Y; Y < Tile.Y + Tile.Height; ++Y)
+	{
+		for (int32 X = Tile.X; X < Tile.X + Tile.Width; ++X)
+		{
+			const int32 Pixel = Y * Texture->Width + X;
+			const FLinearColor Color = History[Pixel].A > 0 ? GetHistoryColor(Pixel) : Colors[((Y - Tile.Y) / Block) * BlocksPerRow + (X - Tile.X) / Block];
+			Preview[(Y - Tile.Y) * Tile.Width + X - Tile.X] = FLinearColor(Color.R, Color.G, Color.B, 1);
+		}
+	}
+	WriteTile(Tile, Preview.GetData());
+}
+
+void AScreenSceneMultiThread::TracePrimaryHits(const FTileToCompute& Tile, FTileScratch& Scratch)
+{
+	TArray<FIntersection>& Hits = Scratch.PrimaryHits;
+	// The version of the camera the rays were generated from, not the current one
+	const uint32 Version = Tile.CacheVersion;
+	const bool bUseCache = bCachePrimaryHits && !bJitterPixels && !Tile.Camera.HasLens() && PrimaryHitCache.Num() == Texture->Width * Texture->Height;
+	if (bUseCache)
+	{
+		bool bCached = true;
+		for (int32 Row = 0; Row < Tile.Height && bCached; ++Row)
+		{
+			for (int32 Column = 0; Column < Tile.Width && bCached; ++Column)
+			{
+				bCached = PrimaryHitVersions[(Tile.Y + Row) * Texture->Width + Tile.X + Column] == Version;
+			}
+		}
+		if (bCached)
+		{
+			Hits.Reset(Tile.Num());
+			for (int32 Row = 0; Row < Tile.Height; ++Row)
+			{
+				Hits.Append(&PrimaryHitCache[(Tile.Y + Row) * Texture->Width + Tile.X], Tile.Width);
+			}
+			return;
+		}
+	}
+
+	TraceBatch(Scratch.Rays, Hits, false, Scratch);
+	Scratch.Counters.CameraRays += Scratch.Rays.Num();
+
+	if (bUseCache)
+	{
+		// Tiles never overlap, so workers write disjoint parts of the cache
+		for (int32 Index = 0; Index < Hits.Num(); ++Index)
+		{
+			const int32 Pixel = (Tile.Y + Index / Tile.Width) * Texture->Width + Tile.X + Index % Tile.Width;
+			PrimaryHitCache[Pixel] = Hits[Index];
+			PrimaryHitVersions[Pixel] = Version;
+		}
+	}
+}
+
+void AScreenSceneMultiThread::InvalidatePrimaryHits()
+{
+	++PrimaryHitCacheVersion;
+}
+
+void AScreenSceneMultiThread::TraceBatch(const TArray<FLightRay>& Rays, TArray<FIntersection>& Intersections, bool bSort, FTileScratch& Scratch)
+{
+	Intersections.Reset(Rays.Num());
+	Intersections.AddDefaulted(Rays.Num());
+	const TArray<FLightRay>* BatchRays = &Rays;
+	TArray<FIntersection>* BatchIntersections = &Intersections;
+	if (bSort)
+	{
+		Scratch.Sorter.Sort(Rays, BvhTree->GetBounds(), Scratch.Order);
+		Scratch.SortedRays.Reset(Rays.Num());
+		for (int32 Index : Scratch.Order)
+		{
+			Scratch.SortedRays.Add(Rays[Index]);
+		}
+		Scratch.SortedIntersections.Reset(Rays.Num());
+		Scratch.SortedIntersections.AddDefaulted(Rays.Num());
+		BatchRays = &Scratch.SortedRays;
+		BatchIntersections = &Scratch.SortedIntersections;
+	}
+
+	const int32 RaysInPacket = FMath::Clamp(PacketSize, 1, FLightRayPacket::MaxSize);
+	FLightRayPacket Packet;
+	for (int32 Index = 0; Index < BatchRays->Num(); Index += RaysInPacket)
+	{
+		if (RaysInPacket > 1)
+		{
+			Packet.Init(BatchRays->GetData() + Index, FMath::Min(RaysInPacket, BatchRays->Num() - Index));
+			BvhTree->IntersectPacket(Packet, Packet.FullMask(), BatchIntersections->GetData() + Index);
+		}
 		else
 		{
-			FIntersection IntersectionLight;
-			float PdfLight = .0f;
-			SimpleLight(IntersectionLight, PdfLight);
-			FVector WS = (IntersectionLight.Coords - Intersection.Coords).GetSafeNormal();
-			FIntersection IntersectionCheckBlock = BvhTree->Intersect(FLightRay(IntersectionLight.Coords, WS));
-			/*Shoot a ray from p to x
-				If the ray is not blocked in the middle*/
-			if (IntersectionCheckBlock.bBlockingHit && IntersectionCheckBlock.Emit.Size() > 0)
+			(*BatchIntersections)[Index] = BvhTree->Intersect((*BatchRays)[Index]);
+		}
+	}
+
+	if (bSort)
+	{
+		// Scatter back to the order of the paths
+		for (int32 i = 0; i < Scratch.Order.Num(); ++i)
+		{
+			Intersections[Scratch.Order[i]] = Scratch.SortedIntersections[i];
+		}
+	}
+}
+
+void AScreenSceneMultiThread::CastWavefrontWithMultiThread(FTileScratch& Scratch)
+{
+	TArray<FPathState>& Paths = Scratch.Paths;
+	Paths.Reset(Scratch.Rays.Num());
+	for (int32 i = 0; i < Scratch.Rays.Num(); ++i)
+	{
+		const FIntersection& Intersection = Scratch.PrimaryHits[i];
+		if (!Intersection.bBlockingHit || Intersection.Emit.Size() > 0)
+		{
+			Scratch.Colors[i] += ShadeEmitter(Scratch.Rays[i], Intersection, 0);
+			continue;
+		}
+		FPathState& Path = Paths.AddDefaulted_GetRef();
+		Path.Ray = Scratch.Rays[i];
+		Path.Intersection = Intersection;
+		Path.Throughput = FVector::OneVector;
+		Path.Radiance = FVector::ZeroVector;
+		Path.FirstHit = Intersection.Coords;
+		Path.Pixel = i;
+		Path.Depth = 0;
+	}
+
+	const float RussianRoulette = .8f;
+	while (Paths.Num() > 0)
+	{
+		// Direct light of every live path
+		Scratch.BounceRays.Reset(Paths.Num());
+		Scratch.IntersectionLights.SetNum(Paths.Num(), false);
+		Scratch.PdfLights.SetNum(Paths.Num(), false);
+		for (int32 i = 0; i < Paths.Num(); ++i)
+		{
+			Scratch.IntersectionLights[i] = FIntersection();
+			Scratch.BounceRays.Add(SampleLightRay(Paths[i].Intersection, Scratch.IntersectionLights[i], Scratch.PdfLights[i]));
+		}
+		TraceBatch(Scratch.BounceRays, Scratch.Intersections, false, Scratch);
+		Scratch.Counters.ShadowRays += Paths.Num();
+		for (int32 i = 0; i < Paths.Num(); ++i)
+		{
+			Paths[i].Radiance += Paths[i].Throughput * DirectLight(Paths[i].Intersection, Scratch.IntersectionLights[i], Scratch.PdfLights[i], Scratch.Intersections[i]);
+		}
+
+		// Russian roulette, the survivors sample their next direction
+		Scratch.BounceRays.Reset();
+		int32 Alive = 0;
+		for (int32 i = 0; i < Paths.Num(); ++i)
+		{
+			if (FMath::FRandRange(0.0f, 1.0f) > RussianRoulette)
 			{
-				// L_dir = emit * eval(wo, ws, N) * dot(ws, N) * dot(ws, NN) / ((x - p) * (x - p)) / pdf_light;
-				LDir = IntersectionLight.Emit; // emit
-				float Product = FVector::DotProduct(Intersection.Normal, WS);				
-				LDir *= ((Product > 0) ? Intersection.Kd / PI : FVector::ZeroVector); // eval(wo,ws,N)
-				LDir *= Product; // dot(ws,N)
-				LDir *= FVector::DotProduct(-WS, IntersectionLight.Normal); // dot(ws, NN)
-				LDir /= FVector::DistSquared(IntersectionLight.Coords, Intersection.Coords); // ((x - p) * (x - p))
-				LDir /= PdfLight; // pdf_light
+				++Scratch.Counters.RouletteTerminations;
+				FinishPath(Paths[i], Scratch);
+				continue;
 			}
+			Paths[Alive] = Paths[i];
+			Scratch.BounceRays.Add(FLightRay(Paths[Alive].Intersection.Coords, Sample(Paths[Alive].Intersection.Normal)));
+			++Alive;
 		}
+		Paths.SetNum(Alive, false);
+
+		// Secondary rays are incoherent, sorting them keeps neighbouring rays in the same BVH nodes
+		TraceBatch(Scratch.BounceRays, Scratch.Intersections, bSortSecondaryRays, Scratch);
+		Scratch.Counters.IndirectRays += Paths.Num();
+		Alive = 0;
+		for (int32 i = 0; i < Paths.Num(); ++i)
+		{
+			FPathState& Path = Paths[i];
+			const FLightRay& Ray = Scratch.BounceRays[i];
+			const FIntersection& IntersectionNoEmit = Scratch.Intersections[i];
+			const float Product = FVector::DotProduct(Path.Intersection.Normal, Ray.Direction);
+			// 非光源
+			if (IntersectionNoEmit.bBlockingHit && IntersectionNoEmit.Emit.IsNearlyZero() && Product > 0)
+			{
+				// eval(wo, wi, N) * dot(wi, N) / pdf(wo, wi, N) / RussianRoulette
+				Path.Throughput *= Path.Intersection.Kd / PI * FVector::DotProduct(Path.Intersection.Normal, -Path.Ray.Direction) / (.5f / PI) / RussianRoulette;
+				Path.Ray = Ray;
+				Path.Intersection = IntersectionNoEmit;
+				++Path.Depth;
+				Paths[Alive++] = Path;
+			}
+			else
+			{
+				FinishPath(Path, Scratch);
+			}
+		}
+		Paths.SetNum(Alive, false);
 	}
-	else
+}
+
+void AScreenSceneMultiThread::FinishPath(const FPathState& Path, FTileScratch& Scratch)
+{
+	Scratch.Colors[Path.Pixel] += FLinearColor(Path.Radiance);
+	++Scratch.Counters.Paths;
+	// Camera segment plus one per bounce
+	Scratch.Counters.PathSegments += Path.Depth + 1;
+	if (SampleDebugPath())
+	{
+		AddDebugPath(Scratch.Rays[Path.Pixel].Origin, Path.FirstHit, FLinearColor(Path.Radiance), 0.1f, 5);
+	}
+}
+
+void AScreenSceneMultiThread::CastPacketWithMultiThread(const FLightRay* Rays, const FIntersection* Intersections, int32 Count, FLinearColor* Colors)
+{
+	// Shadow rays of the first bounce all head for the same light, trace them as a packet too
+	FLightRay ShadowRays[FLightRayPacket::MaxSize];
+	FIntersection IntersectionLights[FLightRayPacket::MaxSize];
+	float PdfLights[FLightRayPacket::MaxSize];
+	uint32 ShadowMask = 0;
+	for (int32 i = 0; i < Count; ++i)
+	{
+		if (Intersections[i].bBlockingHit && Intersections[i].Emit.Size() <= 0)
+		{
+			ShadowRays[i] = SampleLightRay(Intersections[i], IntersectionLights[i], PdfLights[i]);
+			ShadowMask |= 1u << i;
+		}
+		else
+		{
+			ShadowRays[i] = Rays[i];
+		}
+	}
+	FIntersection IntersectionCheckBlocks[FLightRayPacket::MaxSize];
+	if (ShadowMask)
+	{
+		FLightRayPacket ShadowPacket;
+		ShadowPacket.Init(ShadowRays, Count);
+		BvhTree->IntersectPacket(ShadowPacket, ShadowMask, IntersectionCheckBlocks);
+		RAY_STAT_ADD(ShadowRays, FMath::CountBits(ShadowMask));
+	}
+
+	for (int32 i = 0; i < Count; ++i)
+	{
+		if (ShadowMask & (1u << i))
+		{
+			const FVector LDir = DirectLight(Intersections[i], IntersectionLights[i], PdfLights[i], IntersectionCheckBlocks[i]);
+			Colors[i] += ShadeIndirect(Rays[i], Intersections[i], LDir, 0);
+		}
+		else
+		{
+			Colors[i] += ShadeEmitter(Rays[i], Intersections[i], 0);
+		}
+	}
+}
+
+FLinearColor AScreenSceneMultiThread::CastRayWithMultiThread(const FLightRay& Ray, int32 Depth)
+{
+	if (!IsValid(BvhTree))
 	{
-		// 啥也没打着
 		return FLinearColor::Black;
 	}
+	FIntersection Intersection = BvhTree->Intersect(Ray);
+	if (Depth == 0)
+	{
+		RAY_STAT_ADD(CameraRays, 1);
+	}
+	else
+	{
+		RAY_STAT_ADD(IndirectRays, 1);
+	}
+	if (!Intersection.bBlockingHit || Intersection.Emit.Size() > 0)
+	{
+		return ShadeEmitter(Ray, Intersection, Depth);
+	}
+	FIntersection IntersectionLight;
+	float PdfLight = .0f;
+	const FLightRay ShadowRay = SampleLightRay(Intersection, IntersectionLight, PdfLight);
+	const FVector LDir = DirectLight(Intersection, IntersectionLight, PdfLight, BvhTree->Intersect(ShadowRay));
+	RAY_STAT_ADD(ShadowRays, 1);
+	return ShadeIndirect(Ray, Intersection, LDir, Depth);
+}
+
+FLinearColor AScreenSceneMultiThread::ShadeEmitter(const FLightRay& Ray, const FIntersection& Intersection, int32 Depth)
+{
+	if (Depth == 0)
+	{
+		RAY_STAT_ADD(Paths, 1);
+		RAY_STAT_ADD(PathSegments, 1);
+	}
+	if (Intersection.bBlockingHit && Depth == 0)
+	{
+		// 打中光源
+		if (SampleDebugPath())
+		{
+			AddDebugPath(Ray.Origin, Intersection.Coords, FLinearColor(Intersection.Emit), 0.1f, 5);
+		}
+		return FLinearColor(Intersection.Emit);
+	}
+	// 啥也没打着, 或多次弹射击中光源
+	return FLinearColor::Black;
+}
 
+FLightRay AScreenSceneMultiThread::SampleLightRay(const FIntersection& Intersection, FIntersection& IntersectionLight, float& PdfLight) const
+{
+	PdfLight = .0f;
+	SimpleLight(IntersectionLight, PdfLight);
+	FVector WS = (IntersectionLight.Coords - Intersection.Coords).GetSafeNormal();
+	return FLightRay(IntersectionLight.Coords, WS);
+}
+
+FVector AScreenSceneMultiThread::DirectLight(const FIntersection& Intersection, const FIntersection& IntersectionLight, float PdfLight, const FIntersection& IntersectionCheckBlock) const
+{
+	FVector LDir(FVector::ZeroVector);
+	FVector WS = (IntersectionLight.Coords - Intersection.Coords).GetSafeNormal();
+	/*Shoot a ray from p to x
+		If the ray is not blocked in the middle*/
+	if (IntersectionCheckBlock.bBlockingHit && IntersectionCheckBlock.Emit.Size() > 0)
+	{
+		// L_dir = emit * eval(wo, ws, N) * dot(ws, N) * dot(ws, NN) / ((x - p) * (x - p)) / pdf_light;
+		LDir = IntersectionLight.Emit; // emit
+		float Product = FVector::DotProduct(Intersection.Normal, WS);
+		LDir *= ((Product > 0) ? Intersection.Kd / PI : FVector::ZeroVector); // eval(wo,ws,N)
+		LDir *= Product; // dot(ws,N)
+		LDir *= FVector::DotProduct(-WS, IntersectionLight.Normal); // dot(ws, NN)
+		LDir /= FVector::DistSquared(IntersectionLight.Coords, Intersection.Coords); // ((x - p) * (x - p))
+		LDir /= PdfLight; // pdf_light
+	}
+	return LDir;
+}
+
+FLinearColor AScreenSceneMultiThread::ShadeIndirect(const FLightRay& Ray, const FIntersection& Intersection, const FVector& LDir, int32 Depth)
+{
+	FVector LInder(FVector::ZeroVector);
 	float RussianRoulette = .8f;
 	if (FMath::FRandRange(0.0f, 1.0f) > RussianRoulette)
 	{
-		if (Depth == 0)
+		RAY_STAT_ADD(RouletteTerminations, 1);
+		RAY_STAT_ADD(Paths, 1);
+		RAY_STAT_ADD(PathSegments, Depth + 1);
+		if (Depth == 0 && SampleDebugPath())
 		{
-			AsyncTask(ENamedThreads::GameThread,
-				[=]()
-				{
-					UKismetSystemLibrary::DrawDebugLine(GetWorld(), Ray.Origin, Intersection.Coords, LDir, 0.1f, 5);
-				}
-			);
+			AddDebugPath(Ray.Origin, Intersection.Coords, FLinearColor(LDir), 0.1f, 5);
 		}
 		return FLinearColor(LDir);
 	}
@@ -136,6 +798,7 @@ FLinearColor AScreenSceneMultiThread::CastRayWithMultiThread(const FLightRay& Ra
 	FVector WO = Sample(Intersection.Normal);
 	FLightRay TmpRay = FLightRay(Intersection.Coords, WO);
 	FIntersection IntersectionNoEmit = BvhTree->Intersect(TmpRay);
+	RAY_STAT_ADD(IndirectRays, 1);
 	// 非光源
 	if (IntersectionNoEmit.bBlockingHit && IntersectionNoEmit.Emit.IsNearlyZero())
 	{
@@ -147,44 +810,242 @@ FLinearColor AScreenSceneMultiThread::CastRayWithMultiThread(const FLightRay& Ra
 		LInder /= Product > 0 ? .5f / PI : 0; // pdf(wo, wi, N)
 		LInder /= RussianRoulette; // RussianRoulette
 	}
+	else
+	{
+		RAY_STAT_ADD(Paths, 1);
+		RAY_STAT_ADD(PathSegments, Depth + 1);
+	}
 
-	if (Depth == 0)
+	if (Depth == 0 && SampleDebugPath())
 	{
-		AsyncTask(ENamedThreads::GameThread,
-			[=]()
-			{
-				UKismetSystemLibrary::DrawDebugLine(GetWorld(), Ray.Origin, Intersection.Coords, LDir + LInder, 0.1f, 5);
-			}
-		);
+		AddDebugPath(Ray.Origin, Intersection.Coords, FLinearColor(LDir + LInder), 0.1f, 5);
 	}
 
 	return FLinearColor(LDir + LInder);
 }
 
+FRenderCounters AScreenSceneMultiThread::MergeCounters() const
+{
+	FRenderCounters Totals;
+	for (const FDrawTask* Task : DrawTasks)
+	{
+		Totals.Accumulate(Task->GetCounters());
+	}
+	return Totals;
+}
+
+void AScreenSceneMultiThread::PublishStats(const FRenderCounters& Delta) const
+{
+	SET_DWORD_STAT(STAT_CameraRays, Delta.CameraRays);
+	SET_DWORD_STAT(STAT_ShadowRays, Delta.ShadowRays);
+	SET_DWORD_STAT(STAT_IndirectRays, Delta.IndirectRays);
+	SET_DWORD_STAT(STAT_NodesVisited, Delta.Traversal.Nodes);
+	SET_DWORD_STAT(STAT_LeavesVisited, Delta.Traversal.Leaves);
+	SET_DWORD_STAT(STAT_PrimitivesTested, Delta.Traversal.Primitives);
+	SET_DWORD_STAT(STAT_PathsFinished, Delta.Paths);
+	SET_DWORD_STAT(STAT_RouletteTerminations, Delta.RouletteTerminations);
+	SET_FLOAT_STAT(STAT_AveragePathLength, Delta.Paths > 0 ? (float)Delta.PathSegments / Delta.Paths : 0.f);
+	SET_DWORD_STAT(STAT_TilesRendered, Delta.Tiles);
+	SET_DWORD_STAT(STAT_QueuedTiles, QueuedTiles);
+	SET_DWORD_STAT(STAT_PixelsInFlight, CurrentCompute - CurrentDraw);
+	const double Busy = Delta.BusySeconds + Delta.IdleSeconds > 0 ? Delta.BusySeconds / (Delta.BusySeconds + Delta.IdleSeconds) : 0;
+	SET_FLOAT_STAT(STAT_WorkerBusy, (float)(Busy * 100));
+}
+
+void AScreenSceneMultiThread::LogFrameStats(const FRenderCounters& Frame) const
+{
+	const uint64 Rays = FMath::Max<uint64>(Frame.CameraRays + Frame.ShadowRays + Frame.IndirectRays, 1);
+	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:rays camera %llu shadow %llu indirect %llu, per ray %.1f nodes %.1f leaves %.1f primitives, %llu paths of %.2f segments, %llu roulette terminations, upload %.3fs."),
+		__LINE__, Frame.CameraRays, Frame.ShadowRays, Frame.IndirectRays,
+		(double)Frame.Traversal.Nodes / Rays, (double)Frame.Traversal.Leaves / Rays, (double)Frame.Traversal.Primitives / Rays,
+		Frame.Paths, Frame.Paths > 0 ? (double)Frame.PathSegments / Frame.Paths : 0.0, Frame.RouletteTerminations, Texture->GetUploadSeconds() - FrameStartUploadSeconds);
+	for (int32 i = 0; i < DrawTasks.Num(); ++i)
+	{
+		const FRenderCounters Thread = DrawTasks[i]->GetCounters() - FrameStartThreadCounters[i];
+		const double Total = Thread.BusySeconds + Thread.IdleSeconds;
+		UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d[%d]:%llu tiles, busy %.3fs idle %.3fs (%.0f%%)."), __LINE__, i, Thread.Tiles, Thread.BusySeconds, Thread.IdleSeconds, Total > 0 ? Thread.BusySeconds / Total * 100 : 0.0);
+	}
+}
+
 void AScreenSceneMultiThread::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
-	if (!DrawQueue.IsEmpty())
+	// Worker counters are only read here, once per tick
+	const FRenderCounters Totals = MergeCounters();
+	PublishStats(Totals - LastTickCounters);
+	LastTickCounters = Totals;
+	if (FrameStartTime > 0 && !bEnableDrawFrame && CurrentDraw >= CurrentCompute)
 	{
-		struct FDynamicTextureLock Lock(Texture);
-		int32 WorkCount = 0;
-		FPointToDraw Point;
+		UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:frame rendered in %.3fs, wavefront %d, sorted secondary rays %d."), __LINE__, FPlatformTime::Seconds() - FrameStartTime, bWavefront, bWavefront && bSortSecondaryRays);
+		LogFrameStats(Totals - FrameStartCounters);
+		FrameStartTime = 0;
+	}
+	ApplyDenoise();
+	if (bDenoise && RenderMode == EScreenRenderMode::Radiance && !bReducedPass && DenoisedFrame != FrameIndex && !bEnableDrawFrame && CurrentDraw >= CurrentCompute)
+	{
+		LaunchDenoise();
+	}
 
-		while (WorkCount++ < MaxWorkCountPerTick && DrawQueue.Dequeue(Point))
+	if (IsAccumulating() && History.Num() > 0)
+	{
+		const bool bFrameDone = !bEnableDrawFrame && CurrentDraw >= CurrentCompute;
+		if (!GetViewCamera().Equals(Camera))
+		{
+			// Restart at once, the reprojected history covers most of the view
+			BeginDraw();
+		}
+		else if (bFrameDone && (bReducedPass || AccumulatedSpp < MaxAccumulatedSpp))
 		{
-			Texture->SetPixelWithoutLock(Point.Point.X, Point.Point.Y, Point.Color);
-			++CurrentDraw;
+			BeginDraw();
 		}
 	}
 }
 
+void AScreenSceneMultiThread::CancelFrame()
+{
+	// Tiles still in flight belong to the previous frame now
+	FPlatformAtomics::InterlockedIncrement(&FrameIndex);
+	{
+		FScopeLock Lock(&WorkQueueLock);
+		WorkQueue.Empty();
+		QueuedTiles = 0;
+	}
+	while (ActiveTiles > 0)
+	{
+		FPlatformProcess::Sleep(0.f);
+	}
+	FPlatformMisc::MemoryBarrier();
+}
+
 void AScreenSceneMultiThread::BeginDraw()
 {
-	WorkQueue.Empty();
-	DrawQueue.Empty();
+	// Everything below changes state the workers read
+	CancelFrame();
 	CurrentCompute = 0;
 	CurrentDraw = 0;
+	FrameStartCounters = MergeCounters();
+	FrameStartThreadCounters.Reset(DrawTasks.Num());
+	for (const FDrawTask* Task : DrawTasks)
+	{
+		FrameStartThreadCounters.Add(Task->GetCounters());
+	}
+	FrameStartUploadSeconds = Texture->GetUploadSeconds();
+	FrameStartTime = FPlatformTime::Seconds();
+	const FRayCamera PreviousCamera = Camera;
 	Super::BeginDraw();
+
+	// Super::BeginDraw captured the camera of this frame
+	const uint32 SceneHash = GetSceneHash();
+	const bool bSceneChanged = SceneHash != PrimaryHitSceneHash;
+	if (!Camera.Equals(PrimaryHitCamera) || bSceneChanged)
+	{
+		InvalidatePrimaryHits();
+		PrimaryHitCamera = Camera;
+		PrimaryHitSceneHash = SceneHash;
+	}
+	// No worker is running since CancelFrame, so the cache may be reallocated
+	const int32 PixelCount = Texture->Width * Texture->Height;
+	if (bCachePrimaryHits && PrimaryHitCache.Num() != PixelCount)
+	{
+		PrimaryHitCache.SetNum(PixelCount);
+		PrimaryHitVersions.Init(0, PixelCount);
+		InvalidatePrimaryHits();
+	}
+
+	bReducedPass = false;
+	if (IsAccumulating())
+	{
+		if (History.Num() != PixelCount || bSceneChanged)
+		{
+			History.Reset(PixelCount);
+			History.AddZeroed(PixelCount);
+			HistoryPositions.Reset(PixelCount);
+			HistoryPositions.AddZeroed(PixelCount);
+			AccumulatedSpp = 0;
+		}
+		else if (!Camera.Equals(PreviousCamera))
+		{
+			ReprojectHistory();
+			PresentHistory();
+			AccumulatedSpp = 0;
+			bReducedPass = MotionResolutionDivisor > 1;
+		}
+		if (!bReducedPass)
+		{
+			AccumulatedSpp += Spp;
+		}
+	}
+	// Progressive passes only refine the image, the filtered result of an older one is still worth showing
+	if (!IsAccumulating() || AccumulatedSpp <= Spp)
+	{
+		++DenoiseEpoch;
+	}
+	if (bDenoise)
+	{
+		if (!Denoiser.IsValid())
+		{
+			Denoiser = MakeShared<FDenoiser, ESPMode::ThreadSafe>();
+		}
+		if ((Denoiser->GetWidth() != Texture->Width || Denoiser->GetHeight() != Texture->Height) && !Denoiser->bRunning)
+		{
+			Denoiser->Resize(Texture->Width, Texture->Height);
+		}
+	}
+	BuildFrameTiles();
+}
+
+bool AScreenSceneMultiThread::RenderOffline(int32 Width, int32 Height, TArray<FLinearColor>& OutColors)
+{
+	if (Width <= 0 || Height <= 0)
+	{
+		return false;
+	}
+	// Nothing is shown, so nothing is drawn or uploaded
+	bDrawDebugPaths = false;
+	bTemporalReprojection = false;
+	CancelFrame();
+	Texture->bHeadless = true;
+	Texture->Resize(Width, Height);
+	BuildTree();
+	if (!IsValid(BvhTree))
+	{
+		return false;
+	}
+
+	OutColors.Reset(Width * Height);
+	OutColors.AddZeroed(Width * Height);
+	OfflineColors = &OutColors;
+	BeginDraw();
+	while (bEnableDrawFrame || CurrentDraw < CurrentCompute)
+	{
+		// DrawOneLinePixel queues nothing while the workers are a tick behind, leave them the core meanwhile
+		if (bEnableDrawFrame && CurrentCompute - CurrentDraw <= MaxWorkCountPerTick)
+		{
+			DrawOneLinePixel();
+		}
+		else
+		{
+			FPlatformProcess::Sleep(0.001f);
+		}
+	}
+	OfflineColors = nullptr;
+	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d:%dx%d at %d spp rendered in %.3fs."), __LINE__, Width, Height, Spp, FPlatformTime::Seconds() - FrameStartTime);
+
+	if (bDenoise && Denoiser.IsValid())
+	{
+		while (Denoiser->bRunning)
+		{
+			FPlatformProcess::Sleep(0.001f);
+		}
+		FDenoiseSettings Settings;
+		Settings.Iterations = DenoiseIterations;
+		Settings.ColorSigma = DenoiseColorSigma;
+		Settings.NormalPower = DenoiseNormalPower;
+		Settings.DepthSigma = DenoiseDepthSigma;
+		Denoiser->Snapshot();
+		Denoiser->Run(Settings, OutColors);
+	}
+	return true;
 }
 
 FVector AScreenSceneMultiThread::Sample_Implementation(const FVector& Normal) const
@@ -192,39 +1053,80 @@ FVector AScreenSceneMultiThread::Sample_Implementation(const FVector& Normal) co
 	return FVector();
 }
 
-FCriticalSection FDrawTask::CriticalSection;
-
 bool FDrawTask::Init()
 {
+	Scratch.RandomStream.Initialize(ThreadId + 1);
 	return IsValid(Target);
 }
 
 uint32 FDrawTask::Run()
 {
-	while (IsValid(Target))
+	FRenderCounters::Install(&Scratch.Counters);
+	double LastTime = FPlatformTime::Seconds();
+	while (!bStopping && IsValid(Target))
 	{
-		FPointToCompute Point;
+		FTileToCompute Tile;
 		bool IsDeququeSuccess;
 		{
-			FScopeLock Lock(&CriticalSection);
-			FPlatformMisc::MemoryBarrier();
-			IsDeququeSuccess = Target->WorkQueue.Dequeue(Point);
+			RENDER_TRACE_SCOPE(DequeueTile);
+			FScopeLock Lock(&Target->WorkQueueLock);
+			IsDeququeSuccess = Target->WorkQueue.Dequeue(Tile);
+			if (IsDeququeSuccess)
+			{
+				// Counted under the lock, so CancelFrame sees every tile it has to wait for
+				FPlatformAtomics::InterlockedIncrement(&Target->ActiveTiles);
+				FPlatformAtomics::InterlockedDecrement(&Target->QueuedTiles);
+			}
 		}
 		if (IsDeququeSuccess)
 		{
-			FLightRay Ray(FVector(0), FVector((Target->Texture->Height - 1) * 0.5f / FMath::Tan(Target->FOV / 360 * 3.141593f), Point.X - (Target->Texture->Width - 1) * 0.5f, (Target->Texture->Height - 1) * 0.5f - Point.Y).GetSafeNormal());
-			FLinearColor Color = Target->CastRayWithSpp(Ray, 0);
-			ensure(Target->DrawQueue.Enqueue(FPointToDraw(Point, Color)));
+			RENDER_TRACE_SCOPE(TileJob);
+			if (Target->bReducedPass)
+			{
+				Target->RenderTileReduced(Tile, Scratch);
+			}
+			else
+			{
+				Target->RenderTile(Tile, Scratch);
+			}
+			++Scratch.Counters.Tiles;
+			FPlatformAtomics::InterlockedDecrement(&Target->ActiveTiles);
+			const double Now = FPlatformTime::Seconds();
+			Scratch.Counters.BusySeconds += Now - LastTime;
+			LastTime = Now;
+			PublishCounters();
 		}
 		else
 		{
 			FPlatformProcess::Sleep(0.01f);
+			const double Now = FPlatformTime::Seconds();
+			Scratch.Counters.IdleSeconds += Now - LastTime;
+			LastTime = Now;
+			PublishCounters();
 		}
 
 	}
+	FRenderCounters::Install(nullptr);
 	return 0;
 }
 
+FRenderCounters FDrawTask::GetCounters() const
+{
+	FScopeLock Lock(&CountersLock);
+	return PublishedCounters;
+}
+
+void FDrawTask::PublishCounters()
+{
+	FScopeLock Lock(&CountersLock);
+	PublishedCounters = Scratch.Counters;
+}
+
+void FDrawTask::Stop()
+{
+	bStopping = true;
+}
+
 void FDrawTask::Exit()
 {
 	UE_LOG(LogTemp, Log, TEXT(__FUNCTION__" %d[%d]:exit"), __LINE__, ThreadId);
@@ -0,0 +1,307 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "SoftwareTexture.h"
+#include "Engine/Texture2D.h"
+#include "Async/ParallelFor.h"
+
+// Channel value of every 8 bit code without gamma, sRGB textures use FLinearColor::sRGBToLinearTable
+static const struct FLinearDecodeTable
+{
+	float Values[256];
+
+	FLinearDecodeTable()
+	{
+		for (int32 Code = 0; Code < 256; ++Code)
+		{
+			Values[Code] = Code / 255.f;
+		}
+	}
+} LinearDecodeTable;
+
+bool FSoftwareTexture::Init(UTexture2D* Texture)
+{
+	Reset();
+	if (!Texture)
+	{
+		return false;
+	}
+	AddressU = Texture->AddressX;
+	AddressV = Texture->AddressY;
+
+	TArray<FColor> Texels;
+	int32 SizeX = 0;
+	int32 SizeY = 0;
+#if WITH_EDITORONLY_DATA
+	if (Texture->Source.IsValid() && Texture->Source.GetFormat() == TSF_BGRA8)
+	{
+		SizeX = Texture->Source.GetSizeX();
+		SizeY = Texture->Source.GetSizeY();
+		if (const uint8* Data = Texture->Source.LockMip(0))
+		{
+			Texels.Append(reinterpret_cast<const FColor*>(Data), SizeX * SizeY);
+		}
+		Texture->Source.UnlockMip(0);
+	}
+#endif
+	if (Texels.Num() == 0 && Texture->PlatformData && Texture->PlatformData->Mips.Num() > 0 && Texture->PlatformData->PixelFormat == PF_B8G8R8A8)
+	{
+		FTexture2DMipMap& Mip = Texture->PlatformData->Mips[0];
+		SizeX = Mip.SizeX;
+		SizeY = Mip.SizeY;
+		if (const void* Data = Mip.BulkData.LockReadOnly())
+		{
+			Texels.Append(static_cast<const FColor*>(Data), SizeX * SizeY);
+		}
+		Mip.BulkData.Unlock();
+	}
+	if (Texels.Num() == 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:%s can not be read on the CPU, import it as BGRA8 and set its compression to VectorDisplacementmap."), __LINE__, *Texture->GetName());
+		return false;
+	}
+	Init(SizeX, SizeY, Texels.GetData(), Texture->SRGB);
+	return true;
+}
+
+void FSoftwareTexture::Init(int32 InWidth, int32 InHeight, const FColor* Texels, bool bInSRGB)
+{
+	Reset();
+	if (InWidth <= 0 || InHeight <= 0 || !Texels)
+	{
+		return;
+	}
+	bSRGB = bInSRGB;
+	DecodeTable = bSRGB ? FLinearColor::sRGBToLinearTable : LinearDecodeTable.Values;
+	Mips.Reserve(FMath::FloorLog2(FMath::Max(InWidth, InHeight)) + 1);
+
+	FMip& Base = AddMip(InWidth, InHeight);
+	ParallelFor(InHeight, [&](int32 Y)
+	{
+		for (int32 X = 0; X < InWidth; ++X)
+		{
+			Base.Texels[Base.GetIndex(X, Y)] = Texels[Y * InWidth + X];
+		}
+	});
+
+	// Each level averages 2x2 texels of the one above in linear space, odd sizes repeat the last row or column
+	while (Mips.Last().Width > 1 || Mips.Last().Height > 1)
+	{
+		const int32 Source = Mips.Num() - 1;
+		FMip& Level = AddMip(FMath::Max(Mips[Source].Width / 2, 1), FMath::Max(Mips[Source].Height / 2, 1));
+		const FMip& Parent = Mips[Source];
+		ParallelFor(Level.Height, [&](int32 Y)
+		{
+			const int32 Y0 = FMath::Min(Y * 2, Parent.Height - 1);
+			const int32 Y1 = FMath::Min(Y * 2 + 1, Parent.Height - 1);
+			for (int32 X = 0; X < Level.Width; ++X)
+			{
+				const int32 X0 = FMath::Min(X * 2, Parent.Width - 1);
+				const int32 X1 = FMath::Min(X * 2 + 1, Parent.Width - 1);
+				const FLinearColor Average = (Decode(Parent.GetTexel(X0, Y0)) + Decode(Parent.GetTexel(X1, Y0)) + Decode(Parent.GetTexel(X0, Y1)) + Decode(Parent.GetTexel(X1, Y1))) * 0.25f;
+				Level.Texels[Level.GetIndex(X, Y)] = Average.ToFColor(bSRGB);
+			}
+		});
+	}
+}
+
+FSoftwareTexture::FMip& FSoftwareTexture::AddMip(int32 InWidth, int32 InHeight)
+{
+	// Reserved up front, references to earlier levels stay valid
+	FMip& Level = Mips.AddDefaulted_GetRef();
+	Level.Width = InWidth;
+	Level.Height = InHeight;
+	Level.BlocksX = FMath::DivideAndRoundUp(InWidth, BlockSize);
+	Level.Texels.SetNumZeroed(Level.BlocksX * FMath::DivideAndRoundUp(InHeight, BlockSize) * BlockSize * BlockSize);
+	return Level;
+}
+
+void FSoftwareTexture::Reset()
+{
+	Mips.Reset();
+	DecodeTable = nullptr;
+}
+
+float FSoftwareTexture::GetLod(const FVector2D& DeltaX, const FVector2D& DeltaY) const
+{
+	if (!IsValid())
+	{
+		return 0.f;
+	}
+	const FVector2D Size(Mips[0].Width, Mips[0].Height);
+	const float Footprint = FMath::Max((DeltaX * Size).SizeSquared(), (DeltaY * Size).SizeSquared());
+	return Footprint > 1.f ? 0.5f * FMath::Log2(Footprint) : 0.f;
+}
+
+int32 FSoftwareTexture::Address(int32 Coordinate, int32 Size, TextureAddress Mode)
+{
+	switch (Mode)
+	{
+	case TA_Clamp:
+		return FMath::Clamp(Coordinate, 0, Size - 1);
+	case TA_Mirror:
+	{
+		const int32 Period = Size * 2;
+		const int32 Wrapped = (Coordinate % Period + Period) % Period;
+		return Wrapped < Size ? Wrapped : Period - 1 - Wrapped;
+	}
+	default:
+		return (Coordinate % Size + Size) % Size;
+	}
+}
+
+FLinearColor FSoftwareTexture::Sample(const FVector2D& UV, float Lod) const
+{
+	switch (Filter)
+	{
+	case TF_Nearest:
+		return SampleNearest(UV, GetMip(Lod));
+	case TF_Bilinear:
+		return SampleBilinear(UV, GetMip(Lod));
+	default:
+		return SampleTrilinear(UV, Lod);
+	}
+}
+
+FLinearColor FSoftwareTexture::SampleNearest(const FVector2D& UV, int32 Mip) const
+{
+	if (!IsValid())
+	{
+		return FLinearColor::White;
+	}
+	const FMip& Level = Mips[FMath::Clamp(Mip, 0, Mips.Num() - 1)];
+	const int32 X = Address(FMath::FloorToInt(UV.X * Level.Width), Level.Width, AddressU);
+	const int32 Y = Address(FMath::FloorToInt(UV.Y * Level.Height), Level.Height, AddressV);
+	return Decode(Level.GetTexel(X, Y));
+}
+
+FLinearColor FSoftwareTexture::SampleBilinear(const FVector2D& UV, int32 Mip) const
+{
+	if (!IsValid())
+	{
+		return FLinearColor::White;
+	}
+	const FMip& Level = Mips[FMath::Clamp(Mip, 0, Mips.Num() - 1)];
+	// Texel centers sit at half integers
+	const float X = UV.X * Level.Width - 0.5f;
+	const float Y = UV.Y * Level.Height - 0.5f;
+	const int32 FloorX = FMath::FloorToInt(X);
+	const int32 FloorY = FMath::FloorToInt(Y);
+	const float FracX = X - FloorX;
+	const float FracY = Y - FloorY;
+	const int32 X0 = Address(FloorX, Level.Width, AddressU);
+	const int32 X1 = Address(FloorX + 1, Level.Width, AddressU);
+	const int32 Y0 = Address(FloorY, Level.Height, AddressV);
+	const int32 Y1 = Address(FloorY + 1, Level.Height, AddressV);
+	const FLinearColor Top = FMath::Lerp(Decode(Level.GetTexel(X0, Y0)), Decode(Level.GetTexel(X1, Y0)), FracX);
+	const FLinearColor Bottom = FMath::Lerp(Decode(Level.GetTexel(X0, Y1)), Decode(Level.GetTexel(X1, Y1)), FracX);
+	return FMath::Lerp(Top, Bottom, FracY);
+}
+
+FLinearColor FSoftwareTexture::SampleTrilinear(const FVector2D& UV, float Lod) const
+{
+	if (!IsValid())
+	{
+		return FLinearColor::White;
+	}
+	const float Level = FMath::Clamp(Lod, 0.f, float(Mips.Num() - 1));
+	const int32 Mip = FMath::FloorToInt(Level);
+	const float Blend = Level - Mip;
+	const FLinearColor Fine = SampleBilinear(UV, Mip);
+	return Blend > 0.f ? FMath::Lerp(Fine, SampleBilinear(UV, Mip + 1), Blend) : Fine;
+}
+
+void FSoftwareTexture::GatherQuad(int32 Mip, const VectorRegister& U, const VectorRegister& V, bool bNearest, const VectorRegister& Weight, VectorRegister Sums[4]) const
+{
+	const FMip& Level = Mips[Mip];
+	const VectorRegister One = VectorOne();
+	const VectorRegister Offset = VectorSetFloat1(bNearest ? 0.f : 0.5f);
+	const VectorRegister X = VectorSubtract(VectorMultiply(U, VectorSetFloat1(float(Level.Width))), Offset);
+	const VectorRegister Y = VectorSubtract(VectorMultiply(V, VectorSetFloat1(float(Level.Height))), Offset);
+	// Floor from the truncation, one less where it rounded a negative value up
+	const VectorRegister TruncX = VectorTruncate(X);
+	const VectorRegister TruncY = VectorTruncate(Y);
+	const VectorRegister FloorX = VectorSubtract(TruncX, VectorBitwiseAnd(VectorCompareLT(X, TruncX), One));
+	const VectorRegister FloorY = VectorSubtract(TruncY, VectorBitwiseAnd(VectorCompareLT(Y, TruncY), One));
+
+	VectorRegister Weights[4];
+	int32 CornerCount = 1;
+	if (bNearest)
+	{
+		Weights[0] = Weight;
+	}
+	else
+	{
+		const VectorRegister FracX = VectorSubtract(X, FloorX);
+		const VectorRegister FracY = VectorSubtract(Y, FloorY);
+		const VectorRegister Top = VectorMultiply(Weight, VectorSubtract(One, FracY));
+		const VectorRegister Bottom = VectorMultiply(Weight, FracY);
+		Weights[0] = VectorMultiply(Top, VectorSubtract(One, FracX));
+		Weights[1] = VectorMultiply(Top, FracX);
+		Weights[2] = VectorMultiply(Bottom, VectorSubtract(One, FracX));
+		Weights[3] = VectorMultiply(Bottom, FracX);
+		CornerCount = 4;
+	}
+
+	MS_ALIGN(16) float Corner[2][4] GCC_ALIGN(16);
+	VectorStoreAligned(FloorX, Corner[0]);
+	VectorStoreAligned(FloorY, Corner[1]);
+	// Texels of every corner per channel and lane, the gather is the only scalar part
+	MS_ALIGN(16) float Texels[4][4][4] GCC_ALIGN(16);
+	for (int32 Lane = 0; Lane < 4; ++Lane)
+	{
+		const int32 CornerX = int32(Corner[0][Lane]);
+		const int32 CornerY = int32(Corner[1][Lane]);
+		const int32 Columns[2] = { Address(CornerX, Level.Width, AddressU), Address(CornerX + 1, Level.Width, AddressU) };
+		const int32 Rows[2] = { Address(CornerY, Level.Height, AddressV), Address(CornerY + 1, Level.Height, AddressV) };
+		for (int32 Index = 0; Index < CornerCount; ++Index)
+		{
+			const FColor& Texel = Level.GetTexel(Columns[Index & 1], Rows[Index >> 1]);
+			Texels[Index][0][Lane] = DecodeTable[Texel.R];
+			Texels[Index][1][Lane] = DecodeTable[Texel.G];
+			Texels[Index][2][Lane] = DecodeTable[Texel.B];
+			Texels[Index][3][Lane] = Texel.A / 255.f;
+		}
+	}
+	for (int32 Index = 0; Index < CornerCount; ++Index)
+	{
+		for (int32 Channel = 0; Channel < 4; ++Channel)
+		{
+			Sums[Channel] = VectorMultiplyAdd(Weights[Index], VectorLoadAligned(Texels[Index][Channel]), Sums[Channel]);
+		}
+	}
+}
+
+void FSoftwareTexture::SampleQuad(const VectorRegister& U, const VectorRegister& V, float Lod, VectorRegister& OutRed, VectorRegister& OutGreen, VectorRegister& OutBlue, VectorRegister& OutAlpha) const
+{
+	if (!IsValid())
+	{
+		OutRed = OutGreen = OutBlue = OutAlpha = VectorOne();
+		return;
+	}
+	VectorRegister Sums[4] = { VectorZero(), VectorZero(), VectorZero(), VectorZero() };
+	switch (Filter)
+	{
+	case TF_Nearest:
+		GatherQuad(GetMip(Lod), U, V, true, VectorOne(), Sums);
+		break;
+	case TF_Bilinear:
+		GatherQuad(GetMip(Lod), U, V, false, VectorOne(), Sums);
+		break;
+	default:
+	{
+		const float Level = FMath::Clamp(Lod, 0.f, float(Mips.Num() - 1));
+		const int32 Mip = FMath::FloorToInt(Level);
+		const float Blend = Level - Mip;
+		GatherQuad(Mip, U, V, false, VectorSetFloat1(1.f - Blend), Sums);
+		if (Blend > 0.f)
+		{
+			GatherQuad(Mip + 1, U, V, false, VectorSetFloat1(Blend), Sums);
+		}
+	}
+	}
+	OutRed = Sums[0];
+	OutGreen = Sums[1];
+	OutBlue = Sums[2];
+	OutAlpha = Sums[3];
+}
@@ -2,8 +2,10 @@
 
 
 #include "StaticMeshDataComponent.h"
-#include "RawMesh/Public/RawMesh.h"
+#include "Engine/StaticMesh.h"
+#include "StaticMeshResources.h"
 #include "ProceduralMeshComponent.h"
+#include "RaySorter.h"
 
 // Sets default values for this component's properties
 UStaticMeshDataComponent::UStaticMeshDataComponent()
@@ -27,17 +29,13 @@ void UStaticMeshDataComponent::RenderMesh()
 {
 	if (bReady)
 	{
-		TArray<FVector> Normals;
-		TArray<FVector2D> UV0;
-		TArray<FProcMeshTangent> Tangents;
-		ProceduralMesh->UpdateMeshSection_LinearColor(0, Vertices, Normals, UV0, Colors, Tangents);
+		bColorUpdateRequested = true;
 	}
 	else if (IsValid(ProceduralMesh) && Indices.Num() > 0)
 	{
 		TArray<FVector> Normals;
-		TArray<FVector2D> UV0;
 		TArray<FProcMeshTangent> Tangents;
-		ProceduralMesh->CreateMeshSection_LinearColor(0, Vertices, Indices, Normals, UV0, Colors, Tangents, false);
+		ProceduralMesh->CreateMeshSection_LinearColor(0, Vertices, Indices, Normals, UVs, Colors, Tangents, false);
 		if (Material)
 		{
 			ProceduralMesh->SetMaterial(0, Material);
@@ -47,35 +45,239 @@ void UStaticMeshDataComponent::RenderMesh()
 	}
 }
 
+void UStaticMeshDataComponent::SetGeometry(const TArray<FVector>& SourceVertices, const TArray<FVector2D>& SourceUVs, const TArray<uint32>& SourceIndices)
+{
+	const bool bHasUVs = bKeepUVs && SourceUVs.Num() == SourceVertices.Num() && SourceUVs.Num() > 0;
+	Vertices.Reset();
+	UVs.Reset();
+	Indices.Reset(SourceIndices.Num());
+	Min = FVector(TNumericLimits<float>::Max());
+	Max = FVector(-TNumericLimits<float>::Max());
+
+	// Source vertex to output vertex, filled on first use
+	TArray<int32> Remap;
+	Remap.Init(INDEX_NONE, SourceVertices.Num());
+	TMap<TPair<FVector, FVector2D>, int32> Welded;
+	if (bWeldVertices)
+	{
+		Welded.Reserve(SourceVertices.Num());
+	}
+	auto MapVertex = [&](uint32 Source) -> int32
+	{
+		int32& Mapped = Remap[Source];
+		if (Mapped == INDEX_NONE)
+		{
+			const FVector& Position = SourceVertices[Source];
+			const FVector2D UV = bHasUVs ? SourceUVs[Source] : FVector2D::ZeroVector;
+			const int32* Existing = bWeldVertices ? Welded.Find(MakeTuple(Position, UV)) : nullptr;
+			if (Existing)
+			{
+				Mapped = *Existing;
+			}
+			else
+			{
+				Mapped = Vertices.Add(Position);
+				if (bHasUVs)
+				{
+					UVs.Add(UV);
+				}
+				Min = Min.ComponentMin(Position);
+				Max = Max.ComponentMax(Position);
+				if (bWeldVertices)
+				{
+					Welded.Add(MakeTuple(Position, UV), Mapped);
+				}
+			}
+		}
+		return Mapped;
+	};
+	for (int32 i = 0; i + 2 < SourceIndices.Num(); i += 3)
+	{
+		if (!ensure(SourceIndices[i] < (uint32)SourceVertices.Num() && SourceIndices[i + 1] < (uint32)SourceVertices.Num() && SourceIndices[i + 2] < (uint32)SourceVertices.Num()))
+		{
+			continue;
+		}
+		const int32 A = MapVertex(SourceIndices[i]);
+		const int32 B = MapVertex(SourceIndices[i + 1]);
+		const int32 C = MapVertex(SourceIndices[i + 2]);
+		if (A != B && B != C && A != C)
+		{
+			Indices.Add(A);
+			Indices.Add(B);
+			Indices.Add(C);
+		}
+	}
+
+	if (bReorderTriangles && Indices.Num() > 3)
+	{
+		struct FTriangleKey
+		{
+			uint32 Key;
+			int32 First;
+		};
+		const FBounds3 Bound(Min, Max);
+		TArray<FTriangleKey> Keys;
+		Keys.Reserve(Indices.Num() / 3);
+		for (int32 i = 0; i < Indices.Num(); i += 3)
+		{
+			const FVector Centroid = (Vertices[Indices[i]] + Vertices[Indices[i + 1]] + Vertices[Indices[i + 2]]) / 3;
+			Keys.Add({ FRaySorter::GetMortonCode(Centroid, Bound), i });
+		}
+		Keys.Sort([](const FTriangleKey& L, const FTriangleKey& R) { return L.Key < R.Key; });
+		// Vertices follow the triangles, numbered as they are first used
+		TArray<int32> SortedIndices;
+		TArray<FVector> SortedVertices;
+		TArray<FVector2D> SortedUVs;
+		SortedIndices.Reserve(Indices.Num());
+		SortedVertices.Reserve(Vertices.Num());
+		SortedUVs.Reserve(UVs.Num());
+		Remap.Init(INDEX_NONE, Vertices.Num());
+		for (const FTriangleKey& Key : Keys)
+		{
+			for (int32 Corner = 0; Corner < 3; ++Corner)
+			{
+				int32& Mapped = Remap[Indices[Key.First + Corner]];
+				if (Mapped == INDEX_NONE)
+				{
+					Mapped = SortedVertices.Add(Vertices[Indices[Key.First + Corner]]);
+					if (bHasUVs)
+					{
+						SortedUVs.Add(UVs[Indices[Key.First + Corner]]);
+					}
+				}
+				SortedIndices.Add(Mapped);
+			}
+		}
+		Vertices = MoveTemp(SortedVertices);
+		UVs = MoveTemp(SortedUVs);
+		Indices = MoveTemp(SortedIndices);
+	}
+	Colors.Init(FLinearColor::Gray, Vertices.Num());
+}
+
+void UStaticMeshDataComponent::TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction)
+{
+	Super::TickComponent(DeltaTime, TickType, ThisTickFunction);
+	UpdateColors();
+}
+
+void UStaticMeshDataComponent::UpdateColors()
+{
+	if (!bColorUpdateRequested || !bReady || !IsValid(ProceduralMesh))
+	{
+		return;
+	}
+	bColorUpdateRequested = false;
+	FProcMeshSection* Section = ProceduralMesh->GetProcMeshSection(0);
+	if (!Section || Section->ProcVertexBuffer.Num() != Colors.Num())
+	{
+		return;
+	}
+	if (DirtyLast < DirtyFirst)
+	{
+		// Colors was written without SetVertexColor, send everything
+		DirtyFirst = 0;
+		DirtyLast = Colors.Num() - 1;
+	}
+	for (int32 i = DirtyFirst; i <= DirtyLast; ++i)
+	{
+		Section->ProcVertexBuffer[i].Color = Colors[i].ToFColor(false);
+	}
+	DirtyFirst = MAX_int32;
+	DirtyLast = INDEX_NONE;
+	// Empty arrays leave positions, bounds and collision alone, the section is only passed on to the proxy
+	static const TArray<FVector> NoVectors;
+	static const TArray<FVector2D> NoUVs;
+	static const TArray<FColor> NoColors;
+	static const TArray<FProcMeshTangent> NoTangents;
+	ProceduralMesh->UpdateMeshSection(0, NoVectors, NoVectors, NoUVs, NoColors, NoTangents);
+}
+
+bool UStaticMeshDataComponent::ReadRenderData(TArray<FVector>& OutVertices, TArray<FVector2D>& OutUVs, TArray<uint32>& OutIndices) const
+{
+	if (!Mesh->RenderData || Mesh->RenderData->LODResources.Num() == 0)
+	{
+		return false;
+	}
+	FStaticMeshLODResources& Resource = Mesh->RenderData->LODResources[0];
+	FPositionVertexBuffer& PositionBuffer = Resource.VertexBuffers.PositionVertexBuffer;
+	// Without CPU access the copies are dropped once the GPU buffers exist
+	if (!PositionBuffer.GetVertexData() || Resource.IndexBuffer.GetNumIndices() == 0)
+	{
+		return false;
+	}
+	OutVertices.SetNumUninitialized(PositionBuffer.GetNumVertices());
+	for (int32 i = 0; i < OutVertices.Num(); ++i)
+	{
+		OutVertices[i] = PositionBuffer.VertexPosition(i);
+	}
+	OutUVs.Reset();
+	const FStaticMeshVertexBuffer& AttributeBuffer = Resource.VertexBuffers.StaticMeshVertexBuffer;
+	if (AttributeBuffer.GetNumTexCoords() > 0 && AttributeBuffer.GetTexCoordData() && AttributeBuffer.GetNumVertices() == PositionBuffer.GetNumVertices())
+	{
+		OutUVs.SetNumUninitialized(OutVertices.Num());
+		for (int32 i = 0; i < OutUVs.Num(); ++i)
+		{
+			OutUVs[i] = AttributeBuffer.GetVertexUV(i, 0);
+		}
+	}
+	Resource.IndexBuffer.GetCopy(OutIndices);
+	return OutIndices.Num() > 0;
+}
+
+#if WITH_EDITOR
+void UStaticMeshDataComponent::PreSave(const ITargetPlatform* TargetPlatform)
+{
+	Super::PreSave(TargetPlatform);
+	CookedVertices.Empty();
+	CookedUVs.Empty();
+	CookedIndices.Empty();
+	// Only cooked packages carry the geometry, the editor reads the mesh itself
+	TArray<FVector> SourceVertices;
+	TArray<FVector2D> SourceUVs;
+	TArray<uint32> SourceIndices;
+	if (TargetPlatform && IsValid(Mesh) && !HasAnyFlags(RF_ClassDefaultObject) && ReadRenderData(SourceVertices, SourceUVs, SourceIndices))
+	{
+		SetGeometry(SourceVertices, SourceUVs, SourceIndices);
+		CookedVertices = MoveTemp(Vertices);
+		CookedUVs = MoveTemp(UVs);
+		CookedIndices.Append(reinterpret_cast<const uint32*>(Indices.GetData()), Indices.Num());
+		Indices.Empty();
+		Colors.Empty();
+		Min = FVector(TNumericLimits<float>::Max());
+		Max = FVector(-TNumericLimits<float>::Max());
+	}
+}
+#endif
+
 void UStaticMeshDataComponent::BeginPlay()
 {
 	Super::BeginPlay();
 
 	if (IsValid(Mesh))
 	{
+		TArray<FVector> SourceVertices;
+		TArray<FVector2D> SourceUVs;
+		TArray<uint32> SourceIndices;
 #if WITH_EDITOR
-		FStaticMeshLODResources& Resource = Mesh->RenderData->LODResources[0];
-		Vertices.AddUninitialized(Resource.VertexBuffers.PositionVertexBuffer.GetNumVertices());
-		Colors.AddUninitialized(Vertices.Num());
-		TArray<uint32> _Indices;
-		Resource.IndexBuffer.GetCopy(_Indices);
-		Indices.Append(_Indices);
-		for (int32 i = 0; i < Indices.Num(); i += 3)
+		const bool bHasGeometry = ReadRenderData(SourceVertices, SourceUVs, SourceIndices);
+#else
+		const bool bHasGeometry = CookedIndices.Num() > 0 || ReadRenderData(SourceVertices, SourceUVs, SourceIndices);
+		if (CookedIndices.Num() > 0)
 		{
-			Vertices[Indices[i]] = Resource.VertexBuffers.PositionVertexBuffer.VertexPosition(Indices[i]);
-			Colors[Indices[i]] = FLinearColor::Gray;
-			Min = Min.ComponentMin(Vertices[Indices[i]]);
-			Max = Max.ComponentMax(Vertices[Indices[i]]);
-			Vertices[Indices[i + 1]] = Resource.VertexBuffers.PositionVertexBuffer.VertexPosition(Indices[i + 1]);
-			Colors[Indices[i + 1]] = FLinearColor::Gray;
-			Min = Min.ComponentMin(Vertices[Indices[i + 1]]);
-			Max = Max.ComponentMax(Vertices[Indices[i + 1]]);
-			Vertices[Indices[i + 2]] = Resource.VertexBuffers.PositionVertexBuffer.VertexPosition(Indices[i + 2]);
-			Colors[Indices[i + 2]] = FLinearColor::Gray;
-			Min = Min.ComponentMin(Vertices[Indices[i + 2]]);
-			Max = Max.ComponentMax(Vertices[Indices[i + 2]]);
+			SourceVertices = MoveTemp(CookedVertices);
+			SourceUVs = MoveTemp(CookedUVs);
+			SourceIndices = MoveTemp(CookedIndices);
 		}
-		RenderMesh();
 #endif
+		if (bHasGeometry)
+		{
+			SetGeometry(SourceVertices, SourceUVs, SourceIndices);
+			RenderMesh();
+		}
+		else
+		{
+			UE_LOG(LogTemp, Error, TEXT(__FUNCTION__" %d:%s has no geometry on the CPU, recook the map or enable Allow CPU Access on the mesh."), __LINE__, *Mesh->GetName());
+		}
 	}
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "ToneMapper.h"
+
+FToneMapper::FToneMapper()
+{
+	Setup(EToneMapOperator::Clamp, 1.f, true);
+}
+
+void FToneMapper::Setup(EToneMapOperator InOperator, float InExposure, bool bInSRGB)
+{
+	Operator = InOperator;
+	Exposure = FMath::Max(InExposure, 0.f);
+	bSRGB = bInSRGB;
+	for (int32 i = 0; i < TableSize; ++i)
+	{
+		const float Value = (float)i / (TableSize - 1);
+		const float Encoded = !bSRGB ? Value : Value <= 0.0031308f ? Value * 12.92f : FMath::Pow(Value, 1.0f / 2.4f) * 1.055f - 0.055f;
+		EncodeTable[i] = (uint8)FMath::Clamp(FMath::FloorToInt(Encoded * 255.999f), 0, 255);
+	}
+}
+
+void FToneMapper::Convert(const FLinearColor* Source, FColor* Dest, int32 Count) const
+{
+	const VectorRegister Zero = VectorZero();
+	const VectorRegister One = VectorOne();
+	// Alpha skips exposure and the curve
+	const VectorRegister Scale = MakeVectorRegister(Exposure, Exposure, Exposure, 1.f);
+	const VectorRegister Steps = MakeVectorRegister((float)(TableSize - 1), (float)(TableSize - 1), (float)(TableSize - 1), 255.f);
+	const VectorRegister AlphaMask = MakeVectorRegister((uint32)0, (uint32)0, (uint32)0, (uint32)0xffffffff);
+	const VectorRegister Half = VectorSetFloat1(.5f);
+	const VectorRegister AcesA = VectorSetFloat1(2.51f);
+	const VectorRegister AcesB = VectorSetFloat1(0.03f);
+	const VectorRegister AcesC = VectorSetFloat1(2.43f);
+	const VectorRegister AcesD = VectorSetFloat1(0.59f);
+	const VectorRegister AcesE = VectorSetFloat1(0.14f);
+
+	MS_ALIGN(16) float Quantized[4] GCC_ALIGN(16);
+	for (int32 i = 0; i < Count; ++i)
+	{
+		const VectorRegister Color = VectorMax(VectorMultiply(VectorLoad(&Source[i].R), Scale), Zero);
+		VectorRegister Mapped;
+		switch (Operator)
+		{
+		case EToneMapOperator::Reinhard:
+			Mapped = VectorDivide(Color, VectorAdd(Color, One));
+			break;
+		case EToneMapOperator::ACES:
+			// x * (a * x + b) / (x * (c * x + d) + e)
+			Mapped = VectorDivide(VectorMultiply(Color, VectorMultiplyAdd(Color, AcesA, AcesB)), VectorMultiplyAdd(Color, VectorMultiplyAdd(Color, AcesC, AcesD), AcesE));
+			break;
+		default:
+			Mapped = Color;
+			break;
+		}
+		Mapped = VectorSelect(AlphaMask, Color, Mapped);
+		Mapped = VectorMin(Mapped, One);
+		VectorStoreAligned(VectorMultiplyAdd(Mapped, Steps, Half), Quantized);
+		Dest[i] = FColor(EncodeTable[(int32)Quantized[0]], EncodeTable[(int32)Quantized[1]], EncodeTable[(int32)Quantized[2]], (uint8)Quantized[3]);
+	}
+}
+
+FColor FToneMapper::Convert(const FLinearColor& Color) const
+{
+	FColor Result;
+	Convert(&Color, &Result, 1);
+	return Result;
+}
@@ -5,6 +5,8 @@
 #include "StaticMeshDataComponent.h"
 #include "ProceduralMeshComponent.h"
 #include "BVHTree.h"
+#include "RenderTrace.h"
+#include "Hash/CityHash.h"
 
 FBounds3 UTriangle::GetBounds() const
 {
@@ -60,7 +62,7 @@ FIntersection UTriangle::GetIntersection(const FLightRay& Ray, bool bDraw) const
 			HitResult.Normal = Normal;
 			HitResult.Distance = FMath::Sqrt(FVector::DotProduct(Ray(t_tmp) - Ray.Origin, Ray(t_tmp) - Ray.Origin));
 			HitResult.Emit = GetEmit();
-			HitResult.Kd = TriangleMesh->Kd;
+			HitResult.Kd = TriangleMesh->GetKd(GetUV(u, v));
 			HitResult.Object.SetObject(const_cast<UTriangle *>(this));
 		}
 		return HitResult;
@@ -68,6 +70,46 @@ FIntersection UTriangle::GetIntersection(const FLightRay& Ray, bool bDraw) const
 	return IObjectInterface::GetIntersection(Ray);
 }
 
+void UTriangle::SplitBounds(const FBounds3& Box, int32 Axis, float Position, FBounds3& OutLeft, FBounds3& OutRight) const
+{
+	// Pieces start out inverted, a side without any point stays that way
+	OutLeft.pMin = OutRight.pMin = FVector(TNumericLimits<float>::Max());
+	OutLeft.pMax = OutRight.pMax = FVector(-TNumericLimits<float>::Max());
+	// Walk the edges, vertices go to their side and edge crossings to both
+	const FVector Points[3] = { p0, p1, p2 };
+	for (int32 i = 0; i < 3; ++i)
+	{
+		const FVector& A = Points[i];
+		const FVector& B = Points[(i + 1) % 3];
+		if (A[Axis] <= Position)
+			OutLeft.Union(A);
+		if (A[Axis] >= Position)
+			OutRight.Union(A);
+		if ((A[Axis] < Position && B[Axis] > Position) || (A[Axis] > Position && B[Axis] < Position))
+		{
+			const FVector Cut = FMath::Lerp(A, B, (Position - A[Axis]) / (B[Axis] - A[Axis]));
+			OutLeft.Union(Cut);
+			OutRight.Union(Cut);
+		}
+	}
+	// Box may already be a piece of the triangle
+	OutLeft.pMin = OutLeft.pMin.ComponentMax(Box.pMin);
+	OutLeft.pMax = OutLeft.pMax.ComponentMin(Box.pMax);
+	OutRight.pMin = OutRight.pMin.ComponentMax(Box.pMin);
+	OutRight.pMax = OutRight.pMax.ComponentMin(Box.pMax);
+}
+
+FVector2D UTriangle::GetUV(float U, float V) const
+{
+	const TArray<FVector2D>& UVs = MeshData->UVs;
+	if (UVs.Num() == 0)
+	{
+		return FVector2D::ZeroVector;
+	}
+	const int32* Corners = &MeshData->Indices[FirstIndex];
+	return UVs[Corners[0]] * (1 - U - V) + UVs[Corners[1]] * U + UVs[Corners[2]] * V;
+}
+
 FLinearColor UTriangle::GetColor() const
 {
 	return FLinearColor::Gray;
@@ -111,9 +153,9 @@ void UTriangle::SetColor(FLinearColor Color) const
 {
 	if (ensure(MeshData))
 	{
-		MeshData->Colors[MeshData->Indices[FirstIndex]] = Color;
-		MeshData->Colors[MeshData->Indices[FirstIndex + 1]] = Color;
-		MeshData->Colors[MeshData->Indices[FirstIndex + 2]] = Color;
+		MeshData->SetVertexColor(MeshData->Indices[FirstIndex], Color);
+		MeshData->SetVertexColor(MeshData->Indices[FirstIndex + 1], Color);
+		MeshData->SetVertexColor(MeshData->Indices[FirstIndex + 2], Color);
 	}
 }
 
@@ -140,26 +182,49 @@ ATriangleMesh::ATriangleMesh()
 void ATriangleMesh::BeginPlay()
 {
 	Super::BeginPlay();
+	if (KdTexture && KdMap.Init(KdTexture))
+	{
+		KdMap.Filter = KdFilter;
+	}
 	MeshData->OnMeshReady.AddDynamic(this, &ATriangleMesh::BuildTree);
 	MeshData->RenderMesh(RenderMesh);
 }
 
+void ATriangleMesh::OnConstruction(const FTransform& Transform)
+{
+	Super::OnConstruction(Transform);
+	MeshData->bKeepUVs = KdTexture != nullptr;
+}
+
 void ATriangleMesh::BuildTree()
 {
 	BvhTree = NewObject<UBVHTree>();
+	BvhTree->SplitMethod = SplitMethod;
+	BvhTree->MaxReferenceGrowth = MaxReferenceGrowth;
+	BvhTree->NodeLayout = NodeLayout;
+	Triangles.Reset();
 	if (ensure(MeshData->Vertices.Num()))
 	{
 		TArray<IObjectInterface*> Objects;
 		Area = 0;
-		for (int32 i = 0; i < MeshData->Indices.Num(); i += 3)
+		const FVector Location = RenderMesh->GetComponentLocation();
 		{
-			UTriangle* Triangle = NewObject<UTriangle>();
-			Triangle->Init(this, MeshData, RenderMesh->GetComponentLocation(), i);
-			Area += Triangle->GetArea();
-			Triangles.Add(Triangle);
-			Objects.Add(Cast<IObjectInterface>(Triangle));
+			RENDER_TRACE_SCOPE(CreateTriangles);
+			Triangles.Reserve(MeshData->Indices.Num() / 3);
+			Objects.Reserve(MeshData->Indices.Num() / 3);
+			for (int32 i = 0; i < MeshData->Indices.Num(); i += 3)
+			{
+				UTriangle* Triangle = NewObject<UTriangle>();
+				Triangle->Init(this, MeshData, Location, i);
+				Area += Triangle->GetArea();
+				Triangles.Add(Triangle);
+				Objects.Add(Cast<IObjectInterface>(Triangle));
+			}
 		}
-		BvhTree->BuildTree(Objects);
+		ContentHash = CityHash64(reinterpret_cast<const char*>(MeshData->Vertices.GetData()), MeshData->Vertices.Num() * sizeof(FVector));
+		ContentHash = CityHash64WithSeed(reinterpret_cast<const char*>(MeshData->Indices.GetData()), MeshData->Indices.Num() * sizeof(int32), ContentHash);
+		ContentHash = CityHash64WithSeed(reinterpret_cast<const char*>(&Location), sizeof(Location), ContentHash);
+		BvhTree->BuildTree(Objects, 1, ContentHash);
 	}
 }
 
@@ -187,6 +252,15 @@ FIntersection ATriangleMesh::GetIntersection(const FLightRay& Ray, bool bDraw) c
 	return FIntersection();
 }
 
+void ATriangleMesh::GetIntersectionPacket(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits) const
+{
+	if (BvhTree)
+	{
+		ActiveMask = Packet.IntersectBounds(GetBounds(), ActiveMask);
+		BvhTree->IntersectPacket(Packet, ActiveMask, Hits);
+	}
+}
+
 void ATriangleMesh::ClearTriangleColor()
 {
 	if (IsValid(BvhTree))
@@ -0,0 +1,315 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "VertexPipeline.h"
+#include "Async/ParallelFor.h"
+#include "RenderStats.h"
+#include "RenderTrace.h"
+
+DECLARE_CYCLE_STAT(TEXT("Vertex Transform"), STAT_VertexTransform, STATGROUP_RayTracer);
+DECLARE_CYCLE_STAT(TEXT("Triangle Clipping"), STAT_TriangleClipping, STATGROUP_RayTracer);
+
+// Vertices per ParallelFor task, a multiple of 4
+static const int32 TransformBatchSize = 4096;
+
+// Triangles per clipping task, and the most tasks one Run splits into
+static const int32 ClipChunkSize = 8192;
+static const int32 MaxClipChunks = 32;
+
+static const uint32 ClipPlaneCount = 5;
+
+// A triangle gains at most one vertex per plane
+static const int32 MaxClipVertices = 3 + ClipPlaneCount;
+
+void FVertexStream::Set(const TArray<FVector>& Vertices)
+{
+	Num = Vertices.Num();
+	const int32 Padded = Align(Num, 4);
+	X.SetNumUninitialized(Padded, false);
+	Y.SetNumUninitialized(Padded, false);
+	Z.SetNumUninitialized(Padded, false);
+	for (int32 Index = 0; Index < Padded; ++Index)
+	{
+		const FVector Vertex = Index < Num ? Vertices[Index] : FVector::ZeroVector;
+		X[Index] = Vertex.X;
+		Y[Index] = Vertex.Y;
+		Z[Index] = Vertex.Z;
+	}
+}
+
+void FClippedTriangles::Reset()
+{
+	Positions.Reset();
+	Colors.Reset();
+	UVs.Reset();
+	Indices.Reset();
+}
+
+FMatrix FVertexPipeline::MakeViewMatrix(const FVector& Location, const FRotator& Rotation)
+{
+	// Forward, right and up of the engine become Z, X and Y
+	return FTranslationMatrix(-Location) * FInverseRotationMatrix(Rotation) * FMatrix(
+		FPlane(0, 0, 1, 0),
+		FPlane(1, 0, 0, 0),
+		FPlane(0, 1, 0, 0),
+		FPlane(0, 0, 0, 1));
+}
+
+FMatrix FVertexPipeline::MakeProjectionMatrix(ERasterProjection Projection, float FOV, float OrthoWidth, float AspectRatio, float NearPlane, float FarPlane)
+{
+	AspectRatio = FMath::Max(AspectRatio, KINDA_SMALL_NUMBER);
+	NearPlane = FMath::Max(NearPlane, KINDA_SMALL_NUMBER);
+	FarPlane = FMath::Max(FarPlane, NearPlane + KINDA_SMALL_NUMBER);
+	const float DepthRange = FarPlane - NearPlane;
+	if (Projection == ERasterProjection::Orthographic)
+	{
+		const float HalfWidth = FMath::Max(OrthoWidth, KINDA_SMALL_NUMBER) * 0.5f;
+		return FMatrix(
+			FPlane(1 / HalfWidth, 0, 0, 0),
+			FPlane(0, AspectRatio / HalfWidth, 0, 0),
+			FPlane(0, 0, 1 / DepthRange, 0),
+			FPlane(0, 0, -NearPlane / DepthRange, 1));
+	}
+	const float ScaleY = 1 / FMath::Tan(FMath::Clamp(FOV, 1.f, 179.f) / 360 * PI);
+	return FMatrix(
+		FPlane(ScaleY / AspectRatio, 0, 0, 0),
+		FPlane(0, ScaleY, 0, 0),
+		FPlane(0, 0, FarPlane / DepthRange, 1),
+		FPlane(0, 0, -NearPlane * FarPlane / DepthRange, 0));
+}
+
+void FVertexPipeline::SetViewport(int32 InWidth, int32 InHeight, float GuardBand)
+{
+	Width = FMath::Max(InWidth, 1);
+	Height = FMath::Max(InHeight, 1);
+	GuardX = 1 + 2 * FMath::Max(GuardBand, 0.f) / Width;
+	GuardY = 1 + 2 * FMath::Max(GuardBand, 0.f) / Height;
+}
+
+void FVertexPipeline::SetTransform(const FMatrix& Model, const FMatrix& ViewProjection)
+{
+	ModelViewProjection = Model * ViewProjection;
+}
+
+void FVertexPipeline::Run(const FVertexStream& Vertices, const FLinearColor* Colors, const FVector2D* UVs, const int32* Indices, int32 TriangleCount, FVertexPipelineOutput& Output) const
+{
+	TransformVertices(Vertices, Output);
+	ClipTriangles(Vertices, Colors, UVs, Indices, TriangleCount, Output);
+}
+
+void FVertexPipeline::TransformVertices(const FVertexStream& Vertices, FVertexPipelineOutput& Output) const
+{
+	SCOPE_CYCLE_COUNTER(STAT_VertexTransform);
+	RENDER_TRACE_SCOPE(VertexTransform);
+	const int32 VertexCount = Vertices.Num;
+	Output.Positions.SetNumUninitialized(VertexCount, false);
+	Output.ClipCodes.SetNumUninitialized(VertexCount, false);
+
+	VectorRegister Matrix[4][4];
+	for (int32 Row = 0; Row < 4; ++Row)
+	{
+		for (int32 Column = 0; Column < 4; ++Column)
+		{
+			Matrix[Row][Column] = VectorSetFloat1(ModelViewProjection.M[Row][Column]);
+		}
+	}
+
+	ParallelFor(FMath::DivideAndRoundUp(VertexCount, TransformBatchSize), [&](int32 Batch)
+	{
+		const VectorRegister Zero = VectorZero();
+		const VectorRegister One = VectorOne();
+		const VectorRegister HalfWidth = VectorSetFloat1(Width * 0.5f);
+		const VectorRegister HalfHeight = VectorSetFloat1(Height * 0.5f);
+		const VectorRegister NegativeHalfHeight = VectorSetFloat1(Height * -0.5f);
+		const VectorRegister GuardScaleX = VectorSetFloat1(GuardX);
+		const VectorRegister GuardScaleY = VectorSetFloat1(GuardY);
+
+		MS_ALIGN(16) float Screen[4][4] GCC_ALIGN(16);
+		const int32 End = FMath::Min((Batch + 1) * TransformBatchSize, VertexCount);
+		for (int32 Index = Batch * TransformBatchSize; Index < End; Index += 4)
+		{
+			const VectorRegister X = VectorLoadAligned(&Vertices.X[Index]);
+			const VectorRegister Y = VectorLoadAligned(&Vertices.Y[Index]);
+			const VectorRegister Z = VectorLoadAligned(&Vertices.Z[Index]);
+			VectorRegister Clip[4];
+			for (int32 Column = 0; Column < 4; ++Column)
+			{
+				Clip[Column] = VectorMultiplyAdd(X, Matrix[0][Column], VectorMultiplyAdd(Y, Matrix[1][Column], VectorMultiplyAdd(Z, Matrix[2][Column], Matrix[3][Column])));
+			}
+
+			const VectorRegister LimitX = VectorMultiply(Clip[3], GuardScaleX);
+			const VectorRegister LimitY = VectorMultiply(Clip[3], GuardScaleY);
+			const uint32 PlaneMasks[ClipPlaneCount] =
+			{
+				uint32(VectorMaskBits(VectorCompareLT(Clip[2], Zero))),
+				uint32(VectorMaskBits(VectorCompareLT(Clip[0], VectorNegate(LimitX)))),
+				uint32(VectorMaskBits(VectorCompareGT(Clip[0], LimitX))),
+				uint32(VectorMaskBits(VectorCompareLT(Clip[1], VectorNegate(LimitY)))),
+				uint32(VectorMaskBits(VectorCompareGT(Clip[1], LimitY))),
+			};
+
+			// Vertices behind the camera divide by zero or flip, they are dropped below anyway
+			const VectorRegister InvW = VectorDivide(One, Clip[3]);
+			VectorStoreAligned(VectorMultiplyAdd(VectorMultiply(Clip[0], InvW), HalfWidth, HalfWidth), Screen[0]);
+			VectorStoreAligned(VectorMultiplyAdd(VectorMultiply(Clip[1], InvW), NegativeHalfHeight, HalfHeight), Screen[1]);
+			VectorStoreAligned(VectorMultiply(Clip[2], InvW), Screen[2]);
+			VectorStoreAligned(InvW, Screen[3]);
+
+			const int32 LaneCount = FMath::Min(4, End - Index);
+			for (int32 Lane = 0; Lane < LaneCount; ++Lane)
+			{
+				uint8 Code = 0;
+				for (uint32 Plane = 0; Plane < ClipPlaneCount; ++Plane)
+				{
+					Code |= ((PlaneMasks[Plane] >> Lane) & 1) << Plane;
+				}
+				Output.ClipCodes[Index + Lane] = Code;
+				Output.Positions[Index + Lane] = Code ? FVector4(0.f, 0.f, 0.f, -1.f) : FVector4(Screen[0][Lane], Screen[1][Lane], Screen[2][Lane], Screen[3][Lane]);
+			}
+		}
+	});
+}
+
+void FVertexPipeline::ClipTriangles(const FVertexStream& Vertices, const FLinearColor* Colors, const FVector2D* UVs, const int32* Indices, int32 TriangleCount, FVertexPipelineOutput& Output) const
+{
+	SCOPE_CYCLE_COUNTER(STAT_TriangleClipping);
+	RENDER_TRACE_SCOPE(TriangleClipping);
+	Output.Clipped.Reset();
+	if (TriangleCount <= 0)
+	{
+		return;
+	}
+	const int32 Chunks = FMath::Min(FMath::DivideAndRoundUp(TriangleCount, ClipChunkSize), MaxClipChunks);
+	if (Output.ChunkClipped.Num() < Chunks)
+	{
+		Output.ChunkClipped.SetNum(Chunks);
+	}
+
+	const uint8* Codes = Output.ClipCodes.GetData();
+	ParallelFor(Chunks, [&](int32 Chunk)
+	{
+		FClippedTriangles& Clipped = Output.ChunkClipped[Chunk];
+		Clipped.Reset();
+		const int32 End = int64(TriangleCount) * (Chunk + 1) / Chunks;
+		for (int32 Triangle = int64(TriangleCount) * Chunk / Chunks; Triangle < End; ++Triangle)
+		{
+			const int32* Corners = Indices + Triangle * 3;
+			const uint32 Code0 = Codes[Corners[0]];
+			const uint32 Code1 = Codes[Corners[1]];
+			const uint32 Code2 = Codes[Corners[2]];
+			// Inside triangles are drawn from the original indices, the ones outside a single plane are not visible
+			if ((Code0 | Code1 | Code2) && !(Code0 & Code1 & Code2))
+			{
+				ClipTriangle(Vertices, Colors, UVs, Corners, Code0 | Code1 | Code2, Clipped);
+			}
+		}
+	});
+
+	for (int32 Chunk = 0; Chunk < Chunks; ++Chunk)
+	{
+		const FClippedTriangles& Clipped = Output.ChunkClipped[Chunk];
+		const int32 Offset = Output.Clipped.Positions.Num();
+		Output.Clipped.Positions.Append(Clipped.Positions);
+		Output.Clipped.Colors.Append(Clipped.Colors);
+		Output.Clipped.UVs.Append(Clipped.UVs);
+		for (int32 Index : Clipped.Indices)
+		{
+			Output.Clipped.Indices.Add(Index + Offset);
+		}
+	}
+}
+
+float FVertexPipeline::GetPlaneDistance(uint32 Plane, const FVector4& Clip) const
+{
+	switch (Plane)
+	{
+	case 0:
+		return Clip.Z;
+	case 1:
+		return Clip.X + GuardX * Clip.W;
+	case 2:
+		return GuardX * Clip.W - Clip.X;
+	case 3:
+		return Clip.Y + GuardY * Clip.W;
+	default:
+		return GuardY * Clip.W - Clip.Y;
+	}
+}
+
+FVector4 FVertexPipeline::ToViewport(const FVector4& Clip) const
+{
+	const float InvW = 1.f / Clip.W;
+	return FVector4((Clip.X * InvW + 1.f) * Width * 0.5f, (1.f - Clip.Y * InvW) * Height * 0.5f, Clip.Z * InvW, InvW);
+}
+
+void FVertexPipeline::ClipTriangle(const FVertexStream& Vertices, const FLinearColor* Colors, const FVector2D* UVs, const int32* Corners, uint32 Codes, FClippedTriangles& Out) const
+{
+	struct FClipVertex
+	{
+		FVector4 Position;
+		FLinearColor Color;
+		FVector2D UV;
+	};
+
+	// Sutherland-Hodgman against the planes some corner is outside of, ping-ponging between the two polygons
+	FClipVertex Polygons[2][MaxClipVertices];
+	int32 Count = 3;
+	for (int32 Corner = 0; Corner < 3; ++Corner)
+	{
+		Polygons[0][Corner].Position = ModelViewProjection.TransformPosition(Vertices.Get(Corners[Corner]));
+		Polygons[0][Corner].Color = Colors ? Colors[Corners[Corner]] : FLinearColor::White;
+		Polygons[0][Corner].UV = UVs ? UVs[Corners[Corner]] : FVector2D::ZeroVector;
+	}
+
+	int32 Current = 0;
+	for (uint32 Plane = 0; Plane < ClipPlaneCount; ++Plane)
+	{
+		if (!(Codes & (1 << Plane)))
+		{
+			continue;
+		}
+		const FClipVertex* Source = Polygons[Current];
+		FClipVertex* Dest = Polygons[Current ^ 1];
+		int32 DestCount = 0;
+		for (int32 Index = 0; Index < Count; ++Index)
+		{
+			const FClipVertex& From = Source[Index];
+			const FClipVertex& To = Source[(Index + 1) % Count];
+			const float FromDistance = GetPlaneDistance(Plane, From.Position);
+			const float ToDistance = GetPlaneDistance(Plane, To.Position);
+			if (FromDistance >= 0)
+			{
+				Dest[DestCount++] = From;
+			}
+			if ((FromDistance >= 0) != (ToDistance >= 0))
+			{
+				const float Alpha = FromDistance / (FromDistance - ToDistance);
+				Dest[DestCount].Position = From.Position + (To.Position - From.Position) * Alpha;
+				Dest[DestCount].Color = From.Color + (To.Color - From.Color) * Alpha;
+				Dest[DestCount].UV = From.UV + (To.UV - From.UV) * Alpha;
+				++DestCount;
+			}
+		}
+		Count = DestCount;
+		Current ^= 1;
+		if (Count < 3)
+		{
+			return;
+		}
+	}
+
+	// Fan around the first vertex keeps the winding of the triangle
+	const int32 First = Out.Positions.Num();
+	for (int32 Index = 0; Index < Count; ++Index)
+	{
+		Out.Positions.Add(ToViewport(Polygons[Current][Index].Position));
+		Out.Colors.Add(Polygons[Current][Index].Color);
+		Out.UVs.Add(Polygons[Current][Index].UV);
+	}
+	for (int32 Index = 1; Index + 1 < Count; ++Index)
+	{
+		Out.Indices.Add(First);
+		Out.Indices.Add(First + Index);
+		Out.Indices.Add(First + Index + 1);
+	}
+}
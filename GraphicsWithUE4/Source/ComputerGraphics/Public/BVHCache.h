@@ -0,0 +1,57 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/MappedFileHandle.h"
+
+// Depth first node of a cached tree, an interior node's left child is the next node
+struct FBVHFlatNode
+{
+	FVector Min;
+	FVector Max;
+	float Area;
+	// Interior: index of the right child, leaf: first entry of the object indices
+	int32 RightOrFirst;
+	// Objects in a leaf, 0 for interior nodes
+	int32 Count;
+};
+
+// A cache file in memory, the pointers stay valid as long as the view
+struct FBVHCacheView
+{
+	const FBVHFlatNode* Nodes = nullptr;
+	int32 NodeCount = 0;
+	// Positions in the object list the tree was built over
+	const int32* ObjectIndices = nullptr;
+	int32 ObjectIndexCount = 0;
+
+	TUniquePtr<IMappedFileHandle> Handle;
+	TUniquePtr<IMappedFileRegion> Region;
+	// Used when the platform can not map files
+	TArray<uint8> Buffer;
+};
+
+/**
+ * Trees on disk under Saved/BVHCache, one file per key. The key covers whatever the objects were made from
+ * (mesh content, transform) and the build settings, so a file never has to be invalidated, only a format change
+ * bumps Version. Files are memory mapped and checked against key, version and size before use.
+ * Console: RayTracer.BVHCache 0 turns it off.
+ */
+struct COMPUTERGRAPHICS_API FBVHCache
+{
+	static const uint32 Version = 1;
+
+	static bool IsEnabled();
+
+	static void SetEnabled(bool bEnabled);
+
+	static uint64 MakeKey(uint64 ContentHash, uint64 SettingsHash);
+
+	static FString GetPath(uint64 Key);
+
+	// Fails when there is no valid file for Key built over ObjectCount objects
+	static bool Load(uint64 Key, int32 ObjectCount, FBVHCacheView& OutView);
+
+	static bool Save(uint64 Key, int32 ObjectCount, const TArray<FBVHFlatNode>& Nodes, const TArray<int32>& ObjectIndices);
+};
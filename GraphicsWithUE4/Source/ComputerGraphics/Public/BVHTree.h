@@ -7,6 +7,75 @@
 #include "ObjectInterface.h"
 #include "BVHTree.generated.h"
 
+UENUM()
+enum class EBVHSplitMethod : uint8
+{
+	// Halves the objects sorted along the longest centroid axis
+	Median,
+	// Binned surface area heuristic over the object centroids
+	SAH,
+	// SAH that may also cut space and reference straddling objects on both sides (SBVH), for big overlapping objects
+	Spatial,
+};
+
+UENUM()
+enum class EBVHNodeLayout : uint8
+{
+	// Binary nodes on the heap, the only layout that can color the nodes a drawn path visits
+	Pointer,
+	// Four children per 64 byte node with bounds quantized to 8 bits inside the node, see FBVHQuantizedNode
+	Quantized,
+};
+
+/**
+ * Node of a 4 wide tree in one cache line. Child boxes are stored in steps of 2^Exponent from Origin per axis,
+ * rounded outwards, and decoded four at a time during traversal.
+ * Interior children index the node array, leaf children the leaf object list.
+ */
+MS_ALIGN(64) struct FBVHQuantizedNode
+{
+	float Origin[3];
+	int8 Exponent[3];
+	// Bit per used child slot
+	uint8 ChildMask;
+	uint8 QuantizedMin[3][4];
+	uint8 QuantizedMax[3][4];
+	// Objects of leaf children, 0 for interior children
+	uint8 LeafCount[4];
+	int32 Child[4];
+
+	FORCEINLINE float GetScale(int32 Axis) const
+	{
+		// 2^Exponent straight into the float exponent bits
+		const uint32 Bits = (uint32)(Exponent[Axis] + 127) << 23;
+		float Scale;
+		FMemory::Memcpy(&Scale, &Bits, sizeof(Scale));
+		return Scale;
+	}
+
+	FBounds3 GetChildBounds(int32 Index) const;
+
+	// Slab test of the ray against all four children, returns the children entered before TMax and their entry distances
+	FORCEINLINE uint32 IntersectChildren(const VectorRegister RayOrigin[3], const VectorRegister RayInv[3], const VectorRegister& TMax, VectorRegister& OutEntry) const
+	{
+		VectorRegister TEnter = VectorZero();
+		VectorRegister TExit = TMax;
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			const VectorRegister Base = VectorSetFloat1(Origin[Axis]);
+			const VectorRegister Scale = VectorSetFloat1(GetScale(Axis));
+			const VectorRegister Min = VectorMultiplyAdd(VectorLoadByte4(QuantizedMin[Axis]), Scale, Base);
+			const VectorRegister Max = VectorMultiplyAdd(VectorLoadByte4(QuantizedMax[Axis]), Scale, Base);
+			const VectorRegister T0 = VectorMultiply(VectorSubtract(Min, RayOrigin[Axis]), RayInv[Axis]);
+			const VectorRegister T1 = VectorMultiply(VectorSubtract(Max, RayOrigin[Axis]), RayInv[Axis]);
+			TEnter = VectorMax(TEnter, VectorMin(T0, T1));
+			TExit = VectorMin(TExit, VectorMax(T0, T1));
+		}
+		OutEntry = TEnter;
+		return VectorMaskBits(VectorCompareGE(TExit, TEnter)) & ChildMask;
+	}
+} GCC_ALIGN(64);
+
 class FBVHNode : public TSharedFromThis<FBVHNode, ESPMode::ThreadSafe>
 {
 public:
@@ -22,6 +91,22 @@ public:
 	void DrawNode(UObject* WorldContextObject, int32 Depth);
 };
 
+// Ray tracer counters, the hot paths do not count at all when this is 0
+#ifndef WITH_RAY_STATS
+#define WITH_RAY_STATS !UE_BUILD_SHIPPING
+#endif
+
+// Traversal work of one thread, only counted while the thread has installed a set
+struct FTraversalCounters
+{
+	uint64 Nodes = 0;
+	uint64 Leaves = 0;
+	uint64 Primitives = 0;
+
+	// Null when the calling thread does not count
+	static COMPUTERGRAPHICS_API FTraversalCounters*& ForThread();
+};
+
 /**
  * 
  */
@@ -33,11 +118,24 @@ class COMPUTERGRAPHICS_API UBVHTree : public UObject
 public:
 	UBVHTree() : RootNode(nullptr) , DrawDepth(100){}
 
-	void BuildTree(TArray<IObjectInterface*> Objects, int32 MaxTriangleInNode = 1);
+	// Builder for the next BuildTree
+	EBVHSplitMethod SplitMethod = EBVHSplitMethod::Median;
+
+	// Spatial splits stop once they have added this fraction of the object count as extra references
+	float MaxReferenceGrowth = 0.5f;
+
+	// Layout the next BuildTree ends up in, a quantized tree drops the pointer nodes
+	EBVHNodeLayout NodeLayout = EBVHNodeLayout::Pointer;
+
+	// A non-zero ContentHash identifies what the objects were made from, the tree is then read from or written to FBVHCache
+	void BuildTree(TArray<IObjectInterface*> Objects, int32 MaxTriangleInNode = 1, uint64 ContentHash = 0);
 
 	UFUNCTION(BlueprintCallable)
 	FIntersection Intersect(const FLightRay& Ray, bool bDraw = false);
 
+	// Traverses the tree once for all rays of ActiveMask, rays continue alone once the packet diverges
+	void IntersectPacket(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits);
+
 	void ClearTriangleColor();
 
 	UFUNCTION(BlueprintCallable)
@@ -46,13 +144,39 @@ public:
 	void Sample(FIntersection& Position, float& Pdf);
 
 	void DrawTree(UObject* WorldContextObject, int32 Depth);
+
+	FBounds3 GetBounds() const;
+
+	int32 GetNodeCount() const;
+
+	// Object references in all leaves, above the object count when spatial splits duplicated some
+	int32 GetReferenceCount() const;
+
+	// Nodes and their object lists, the objects themselves are not included
+	SIZE_T GetAllocatedSize() const;
 private:
 	TSharedPtr<class FBVHNode, ESPMode::ThreadSafe> RootNode;
+
+	TArray<FBVHQuantizedNode, TAlignedHeapAllocator<64>> QuantizedNodes;
+	// Objects of the quantized leaves, with their share of the tree's area summed up for sampling
+	TArray<IObjectInterface*> LeafObjects;
+	TArray<float> LeafAreaSums;
+	FBounds3 QuantizedBound;
 	int32 _MaxTriangleInNode;
 	int32 DrawDepth;
 	int32 DrawDepthMax;
+	// Below this many active rays a subtree is traced ray by ray
+	static const int32 PacketMinActiveRays = 2;
 	FBVHNode* RecursiveBuild(TArray<IObjectInterface*> Objects);
-	FIntersection GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, const FLightRay& Ray, bool bDraw, int32 Depth);
+	// Collapses the pointer tree into QuantizedNodes, returns the index of the node made from Node
+	int32 Quantize(const FBVHNode& Node);
+	FIntersection IntersectQuantized(const FLightRay& Ray, FTraversalCounters* Counters) const;
+	void IntersectPacketQuantized(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits, FTraversalCounters* Counters) const;
+	void DrawQuantized(UObject* WorldContextObject, int32 NodeIndex, int32 Depth) const;
+	void Flatten(const FBVHNode& Node, const TMap<IObjectInterface*, int32>& ObjectIndices, TArray<struct FBVHFlatNode>& OutNodes, TArray<int32>& OutObjectIndices) const;
+	// Null when the cached nodes do not form a valid tree over Objects
+	FBVHNode* Unflatten(const struct FBVHCacheView& View, const TArray<IObjectInterface*>& Objects, int32 NodeIndex, int32 Depth) const;
+	FIntersection GetIntersection(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, const FLightRay& Ray, bool bDraw, int32 Depth, FTraversalCounters* Counters);
 	void ColorTriangle(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, FLinearColor Color);
 	void GetSample(TSharedRef<FBVHNode, ESPMode::ThreadSafe> NodeRef, float p, FIntersection& Position, float& Pdf);
 };
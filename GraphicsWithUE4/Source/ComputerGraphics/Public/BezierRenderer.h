@@ -0,0 +1,91 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UDynamicTextureComponent;
+
+/**
+ * Batched Bezier curve drawing with anti-aliased strokes.
+ * Render tessellates every curve on the worker threads into the fewest line segments that stay within Tolerance pixels of
+ * it (Wang's bound on the second differences of the control points), evaluating 4 parameters at a time with de Casteljau.
+ * The segments are binned into TileSize square tiles, and every tile covers its pixels with the distance to the nearest
+ * segment of each curve, 4 pixels at a time, so the joints of a curve are not blended twice.
+ */
+struct COMPUTERGRAPHICS_API FBezierRenderer
+{
+	static const int32 TileSize = 32;
+	static const int32 MaxDegree = 15;
+	// Curves needing more are drawn coarser rather than flooding the bins
+	static const int32 MaxSegmentsPerCurve = 1024;
+
+	// Drops the curves, they are in pixels of a InWidth x InHeight target
+	void Resize(int32 InWidth, int32 InHeight);
+
+	// Forgets the curves of the previous frame
+	void Begin();
+
+	/**
+	 * Queues CurveCount curves of the same degree, (Degree + 1) control points each in pixels. Colors holds one color per curve
+	 * and may be null for white, its alpha scales the coverage. Thickness is the stroke width in pixels.
+	 */
+	void AddCurves(const FVector2D* ControlPoints, int32 Degree, int32 CurveCount, const FLinearColor* Colors, float Thickness = 1.f);
+
+	// Tessellates and draws everything added since Begin over ClearColor, Target must have the same size
+	void Render(UDynamicTextureComponent* Target);
+
+	FORCEINLINE int32 GetWidth() const { return Width; }
+	FORCEINLINE int32 GetHeight() const { return Height; }
+	FORCEINLINE int32 GetCurveCount() const { return Curves.Num(); }
+
+	// Segments of the last Render
+	FORCEINLINE int32 GetSegmentCount() const { return Segments.Num(); }
+
+	FLinearColor ClearColor = FLinearColor::White;
+
+	// Largest distance in pixels between a curve and its segments
+	float Tolerance = 0.25f;
+
+private:
+	struct FCurve
+	{
+		int32 FirstPoint;
+		int32 Degree;
+		FLinearColor Color;
+		float HalfThickness;
+		// Filled by Render
+		int32 FirstSegment;
+		int32 SegmentCount;
+	};
+
+	struct FSegment
+	{
+		FVector2D Start;
+		FVector2D End;
+		int32 Curve;
+	};
+
+	// Segments for Tolerance by Wang's formula, at least one
+	int32 GetCurveSegmentCount(const FCurve& Curve) const;
+
+	// Writes the SegmentCount segments of a curve from its FirstSegment on
+	void Tessellate(int32 CurveIndex);
+
+	void BinSegments();
+
+	void RenderTile(int32 Tile, UDynamicTextureComponent* Target) const;
+
+	int32 Width = 0;
+	int32 Height = 0;
+	int32 TilesX = 0;
+	int32 TilesY = 0;
+
+	TArray<FVector2D> Points;
+	TArray<FCurve> Curves;
+	TArray<FSegment> Segments;
+
+	// Segment indices per binning chunk and tile, Bins[Chunk * TileCount + Tile]. Kept across frames for their allocations
+	TArray<TArray<int32>> Bins;
+	int32 ChunkCount = 0;
+};
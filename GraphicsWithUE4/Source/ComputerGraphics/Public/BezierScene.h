@@ -0,0 +1,89 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "BezierRenderer.h"
+#include "BezierScene.generated.h"
+
+/**
+ * Bezier curves drawn with FBezierRenderer into the texture of a screen plane.
+ * Native replacement of the point by point evaluation and per pixel SetPixel calls of the HW04 Bezier blueprint.
+ */
+UCLASS()
+class COMPUTERGRAPHICS_API ABezierScene : public AActor
+{
+	GENERATED_BODY()
+
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
+	class USceneComponent* Root;
+
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
+	class UStaticMeshComponent* StaticMesh;
+
+protected:
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
+	class UDynamicTextureComponent* Texture;
+
+public:
+	// Sets default values for this actor's properties
+	ABezierScene();
+
+	// Curves of Degree + 1 points each in pixels, a trailing partial curve is ignored
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	TArray<FVector2D> ControlPoints;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "1", ClampMax = "15"))
+	int32 Degree = 3;
+
+	// Color per curve, curves past its end use Color
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	TArray<FLinearColor> Colors;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FLinearColor Color = FLinearColor::Black;
+
+	// Stroke width in pixels
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "0"))
+	float Thickness = 1;
+
+	// Largest distance in pixels between the curves and the drawn segments
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "0.01"))
+	float Tolerance = 0.25f;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FLinearColor ClearColor = FLinearColor::White;
+
+	// Replaces ControlPoints and Colors with this many random curves on BeginPlay, for stress tests
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "0"))
+	int32 RandomCurveCount = 0;
+
+	// Redraw every tick, otherwise only when Draw or DrawCurves is called
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bDrawEveryTick = false;
+
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+
+	FBezierRenderer Renderer;
+
+	// Colors of every curve of ControlPoints
+	TArray<FLinearColor> CurveColors;
+
+public:
+	// Called every frame
+	virtual void Tick(float DeltaTime) override;
+
+	UFUNCTION(BlueprintCallable)
+	void Draw();
+
+	// Replaces the curves and draws them at once
+	UFUNCTION(BlueprintCallable)
+	void DrawCurves(const TArray<FVector2D>& InControlPoints, int32 InDegree, const TArray<FLinearColor>& InColors);
+
+	// Segments drawn by the last Draw
+	UFUNCTION(BlueprintCallable)
+	FORCEINLINE int32 GetSegmentCount() const { return Renderer.GetSegmentCount(); }
+};
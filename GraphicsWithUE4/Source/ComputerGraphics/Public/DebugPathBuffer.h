@@ -0,0 +1,50 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "EngineDefines.h"
+
+struct FDebugPathSegment
+{
+	FVector Start;
+	FVector End;
+	FLinearColor Color;
+	float LifeTime;
+	float Thickness;
+};
+
+/**
+ * Bounded ring of debug path segments, written by any number of render threads without locks and drained by the game
+ * thread in one batch per tick. Each slot carries a sequence number telling whether it is free for the writer of that
+ * turn or published for the reader. Segments are dropped while the ring is full.
+ */
+struct COMPUTERGRAPHICS_API FDebugPathBuffer
+{
+	// Capacity is rounded up to a power of two, must not be called while segments are added
+	void Reset(int32 Capacity);
+
+	// True for one call in Interval on the calling thread
+	static bool Sample(int32 Interval);
+
+	// Returns false when the segment was dropped
+	bool Add(const FDebugPathSegment& Segment);
+
+	// Draws everything added so far with the line batchers of World, game thread only. Returns the segment count.
+	int32 Flush(UWorld* World);
+
+	FORCEINLINE int64 GetDropped() const { return Dropped; }
+
+private:
+	struct FSlot
+	{
+		volatile int64 Sequence;
+		FDebugPathSegment Segment;
+	};
+
+	TArray<FSlot> Slots;
+	int64 Mask = -1;
+	volatile int64 WriteIndex = 0;
+	int64 ReadIndex = 0;
+	volatile int64 Dropped = 0;
+};
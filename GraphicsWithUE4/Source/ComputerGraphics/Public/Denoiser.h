@@ -0,0 +1,63 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ObjectInterface.h"
+
+struct FDenoiseSettings
+{
+	int32 Iterations = 4;
+	// Luminance difference at which a neighbour's weight drops to 1/e, halved every iteration
+	float ColorSigma = 1.f;
+	// Exponent of the normal dot product
+	float NormalPower = 64.f;
+	// Depth difference per pixel of distance, as a fraction of the depth
+	float DepthSigma = 0.05f;
+};
+
+/**
+ * Edge-avoiding a-trous wavelet filter for low sample count path tracing.
+ * The color is divided by the albedo of the first hit, smoothed with a 5x5 B3 spline kernel whose taps spread out each
+ * iteration and are weighted by normal, depth and luminance similarity, then multiplied by the albedo again.
+ * Misses and lights are passed through untouched.
+ */
+struct COMPUTERGRAPHICS_API FDenoiser
+{
+	void Resize(int32 InWidth, int32 InHeight);
+
+	// Called by the tile workers, pixels of different tiles may be written concurrently
+	void SetInput(int32 Pixel, const FLinearColor& Color, const FIntersection& Hit);
+
+	// Takes the inputs gathered so far for the next Run, the input buffers keep the older frame until they are overwritten
+	void Snapshot();
+
+	// Filters the snapshot into Output on the task graph worker threads
+	void Run(const FDenoiseSettings& Settings, TArray<FLinearColor>& Output);
+
+	FORCEINLINE int32 GetWidth() const { return Width; }
+	FORCEINLINE int32 GetHeight() const { return Height; }
+
+	// Set while a Run is in flight, Snapshot must not be called meanwhile
+	FThreadSafeBool bRunning;
+
+private:
+	struct FGuide
+	{
+		FVector Albedo;
+		FVector Normal;
+		// Distance to the first hit, negative for pixels that are not filtered
+		float Depth;
+	};
+
+	int32 Width = 0;
+	int32 Height = 0;
+
+	TArray<FLinearColor> InputColors;
+	TArray<FGuide> InputGuides;
+
+	TArray<FLinearColor> Colors;
+	TArray<FGuide> Guides;
+	TArray<FLinearColor> Ping;
+	TArray<FLinearColor> Pong;
+};
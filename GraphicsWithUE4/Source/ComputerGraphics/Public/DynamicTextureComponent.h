@@ -4,8 +4,16 @@
 
 #include "CoreMinimal.h"
 #include "Components/ActorComponent.h"
+#include "ToneMapper.h"
 #include "DynamicTextureComponent.generated.h"
 
+// Copy of the dirty rows handed to the render thread, it is only reused once the previous upload finished
+struct FDynamicTextureUpload
+{
+	TArray<FColor> Pixels;
+	FThreadSafeBool bInFlight;
+};
+
 UCLASS( ClassGroup=(Custom), meta=(BlueprintSpawnableComponent) )
 class COMPUTERGRAPHICS_API UDynamicTextureComponent : public UActorComponent
 {
@@ -22,11 +30,36 @@ protected:
 	UPROPERTY(BlueprintReadOnly)
 	UTexture2D* Texture;
 
-	bool bDirty;
+	// Set by writers on any thread, cleared by the tick before it takes the spans
+	FThreadSafeBool bDirty;
 
 	UStaticMeshComponent* Mesh;
 
-	FColor* DataLocked;
+	// CPU side pixels, writers never touch the texture resource directly
+	TArray<FColor> Pixels;
+
+	// Dirty span of every row as MinX << 32 | MaxX, MinX > MaxX when the row is clean. One 64 bit word, so the upload takes
+	// a span in a single exchange and disjoint writers can run concurrently
+	TArray<int64> DirtySpans;
+
+	TSharedPtr<FDynamicTextureUpload, ESPMode::ThreadSafe> Upload;
+
+	// bHeadless at the last Allocate
+	bool bAllocatedHeadless = false;
+
+	// Output stage of every FLinearColor write
+	FToneMapper ToneMapper;
+
+	double UploadSeconds = 0;
+
+	// Marks the rectangle for the next upload, call after the pixels were written
+	void MarkDirty(int32 X, int32 Y, int32 SizeX, int32 SizeY);
+
+	// Sends the dirty rows to the texture through UpdateTextureRegions
+	void UploadDirtyRegions();
+
+	// (Re)creates the pixels and, unless headless, the texture for the current size
+	void Allocate();
 public:	
 	// Called every frame
 	virtual void TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction) override;
@@ -43,6 +76,42 @@ public:
 
 	bool SetPixelWithoutLock(int X, int Y, FLinearColor Color);
 
+	// Bulk writes of a SizeX x SizeY block, SourcePitch is the row stride of Colors in pixels (0 means SizeX).
+	// Bounds are checked once per call, and writers of disjoint blocks may run concurrently on any thread.
+	bool SetPixels(int32 X, int32 Y, int32 SizeX, int32 SizeY, const FColor* Colors, int32 SourcePitch = 0);
+
+	bool SetPixels(int32 X, int32 Y, int32 SizeX, int32 SizeY, const FLinearColor* Colors, int32 SourcePitch = 0);
+
+	FORCEINLINE bool SetSpan(int32 X, int32 Y, int32 Count, const FColor* Colors) { return SetPixels(X, Y, Count, 1, Colors); }
+
+	FORCEINLINE bool SetSpan(int32 X, int32 Y, int32 Count, const FLinearColor* Colors) { return SetPixels(X, Y, Count, 1, Colors); }
+
+	UFUNCTION(BlueprintCallable)
+	bool SetPixelRect(int32 X, int32 Y, int32 SizeX, int32 SizeY, const TArray<FColor>& Colors);
+
+	UFUNCTION(BlueprintCallable)
+	bool SetPixelRectLinear(int32 X, int32 Y, int32 SizeX, int32 SizeY, const TArray<FLinearColor>& Colors);
+
+	// Float writes go through the tone mapper, changes only affect pixels written afterwards
+	UFUNCTION(BlueprintCallable)
+	void SetToneMapping(EToneMapOperator InOperator, float InExposure = 1.f, bool bInSRGB = true);
+
+	UFUNCTION(BlueprintCallable)
+	bool FillPixels(int32 X, int32 Y, int32 SizeX, int32 SizeY, FColor Color);
+
+	// Drops the pixels written so far. Also reallocates when bHeadless changed since the last allocation
+	void Resize(int32 InWidth, int32 InHeight);
+
+	FORCEINLINE const TArray<FColor>& GetPixels() const { return Pixels; }
+
+	// Game thread time spent in uploads so far
+	FORCEINLINE double GetUploadSeconds() const { return UploadSeconds; }
+
+	FORCEINLINE bool IsRectInside(int32 X, int32 Y, int32 SizeX, int32 SizeY) const
+	{
+		return X >= 0 && Y >= 0 && SizeX > 0 && SizeY > 0 && X + SizeX <= Width && Y + SizeY <= Height && Pixels.Num() == Width * Height;
+	}
+
 	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
 	int32 Width;
 
@@ -52,30 +121,16 @@ public:
 	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
 	FColor BackGroundColor;
 
-	friend struct FDynamicTextureLock;
-};
+	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
+	EToneMapOperator ToneMapOperator = EToneMapOperator::Clamp;
 
-struct FDynamicTextureLock
-{
-	FDynamicTextureLock(UDynamicTextureComponent* LockTarget)
-	{
-		_LockTarget = nullptr;
-		if (LockTarget && LockTarget->Texture && !LockTarget->DataLocked)
-		{
-			FTexture2DMipMap& Mip = LockTarget->Texture->PlatformData->Mips[0];
-			LockTarget->DataLocked = (FColor*)Mip.BulkData.Lock(LOCK_READ_WRITE);
-			_LockTarget = LockTarget;
-		}
-	}
-	~FDynamicTextureLock()
-	{
-		if (_LockTarget)
-		{
-			FTexture2DMipMap& Mip = _LockTarget->Texture->PlatformData->Mips[0];
-			Mip.BulkData.Unlock();
-			_LockTarget->DataLocked = nullptr;
-			_LockTarget->bDirty = true;
-		}
-	}
-	UDynamicTextureComponent* _LockTarget;
-};
\ No newline at end of file
+	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
+	float Exposure = 1.f;
+
+	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
+	bool bSRGB = true;
+
+	// Keep the pixels on the CPU only, no texture is created or uploaded. Used for rendering without a RHI
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bHeadless = false;
+};
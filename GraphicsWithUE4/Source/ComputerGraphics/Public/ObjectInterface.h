@@ -118,6 +118,86 @@ struct FBounds3
     }
 };
 
+// Rays traced together through the BVH, stored as structure of arrays for the SIMD box tests.
+// Directions are expected to be normalized so TMax can be compared with FIntersection::Distance.
+MS_ALIGN(16) struct FLightRayPacket
+{
+    static const int32 MaxSize = 16;
+
+    float OriginX[MaxSize];
+    float OriginY[MaxSize];
+    float OriginZ[MaxSize];
+    float InvX[MaxSize];
+    float InvY[MaxSize];
+    float InvZ[MaxSize];
+    // Distance to the closest hit found so far
+    float TMax[MaxSize];
+
+    const FLightRay* Rays;
+    int32 Num;
+
+    FLightRayPacket() : Rays(nullptr), Num(0) {}
+
+    void Init(const FLightRay* InRays, int32 Count)
+    {
+        check(Count > 0 && Count <= MaxSize);
+        Rays = InRays;
+        Num = Count;
+        for (int32 i = 0; i < MaxSize; ++i)
+        {
+            // Padding lanes repeat the last ray, they are never in an active mask
+            const FLightRay& Ray = Rays[FMath::Min(i, Count - 1)];
+            OriginX[i] = Ray.Origin.X;
+            OriginY[i] = Ray.Origin.Y;
+            OriginZ[i] = Ray.Origin.Z;
+            InvX[i] = Ray.DirectionInv.X;
+            InvY[i] = Ray.DirectionInv.Y;
+            InvZ[i] = Ray.DirectionInv.Z;
+            TMax[i] = Ray.t_max;
+        }
+    }
+
+    FORCEINLINE uint32 FullMask() const { return (1u << Num) - 1; }
+
+    // Returns the rays of ActiveMask that enter the box before their current TMax, four rays per test
+    uint32 IntersectBounds(const FBounds3& Bound, uint32 ActiveMask) const
+    {
+        uint32 HitMask = 0;
+        const VectorRegister MinX = VectorSetFloat1(Bound.pMin.X);
+        const VectorRegister MinY = VectorSetFloat1(Bound.pMin.Y);
+        const VectorRegister MinZ = VectorSetFloat1(Bound.pMin.Z);
+        const VectorRegister MaxX = VectorSetFloat1(Bound.pMax.X);
+        const VectorRegister MaxY = VectorSetFloat1(Bound.pMax.Y);
+        const VectorRegister MaxZ = VectorSetFloat1(Bound.pMax.Z);
+        for (int32 Lane = 0; Lane < Num; Lane += 4)
+        {
+            if (((ActiveMask >> Lane) & 0xF) == 0)
+            {
+                continue;
+            }
+            const VectorRegister OX = VectorLoadAligned(OriginX + Lane);
+            const VectorRegister OY = VectorLoadAligned(OriginY + Lane);
+            const VectorRegister OZ = VectorLoadAligned(OriginZ + Lane);
+            const VectorRegister IX = VectorLoadAligned(InvX + Lane);
+            const VectorRegister IY = VectorLoadAligned(InvY + Lane);
+            const VectorRegister IZ = VectorLoadAligned(InvZ + Lane);
+            const VectorRegister T0X = VectorMultiply(VectorSubtract(MinX, OX), IX);
+            const VectorRegister T1X = VectorMultiply(VectorSubtract(MaxX, OX), IX);
+            const VectorRegister T0Y = VectorMultiply(VectorSubtract(MinY, OY), IY);
+            const VectorRegister T1Y = VectorMultiply(VectorSubtract(MaxY, OY), IY);
+            const VectorRegister T0Z = VectorMultiply(VectorSubtract(MinZ, OZ), IZ);
+            const VectorRegister T1Z = VectorMultiply(VectorSubtract(MaxZ, OZ), IZ);
+            const VectorRegister TEnter = VectorMax(VectorMax(VectorMin(T0X, T1X), VectorMin(T0Y, T1Y)), VectorMin(T0Z, T1Z));
+            const VectorRegister TExit = VectorMin(VectorMin(VectorMax(T0X, T1X), VectorMax(T0Y, T1Y)), VectorMax(T0Z, T1Z));
+            const VectorRegister Hit = VectorBitwiseAnd(
+                VectorBitwiseAnd(VectorCompareGE(TExit, TEnter), VectorCompareGE(TExit, VectorZero())),
+                VectorCompareGE(VectorLoadAligned(TMax + Lane), TEnter));
+            HitMask |= (uint32)VectorMaskBits(Hit) << Lane;
+        }
+        return HitMask & ActiveMask;
+    }
+} GCC_ALIGN(16);
+
 USTRUCT(BlueprintType)
 struct FIntersection
 {
@@ -162,6 +242,31 @@ class COMPUTERGRAPHICS_API IObjectInterface
 public:
     virtual FBounds3 GetBounds() const { return FBounds3(); }
     virtual FIntersection GetIntersection(const FLightRay& Ray, bool bDraw = false) const { return FIntersection(); }
+    // Traces the rays of ActiveMask, Hits and Packet.TMax are only updated with closer hits
+    virtual void GetIntersectionPacket(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits) const
+    {
+        for (int32 i = 0; i < Packet.Num; ++i)
+        {
+            if (ActiveMask & (1u << i))
+            {
+                FIntersection Hit = GetIntersection(Packet.Rays[i]);
+                if (Hit.bBlockingHit && Hit.Distance < Hits[i].Distance)
+                {
+                    Hits[i] = Hit;
+                    Packet.TMax[i] = Hit.Distance;
+                }
+            }
+        }
+    }
+    // Bounds of the parts of the object inside Box below and above Position on Axis, used by spatial splits.
+    // The default only cuts the box, shapes override it for tighter pieces.
+    virtual void SplitBounds(const FBounds3& Box, int32 Axis, float Position, FBounds3& OutLeft, FBounds3& OutRight) const
+    {
+        OutLeft = Box;
+        OutRight = Box;
+        OutLeft.pMax[Axis] = FMath::Min(Box.pMax[Axis], Position);
+        OutRight.pMin[Axis] = FMath::Max(Box.pMin[Axis], Position);
+    }
     virtual void SetColor(FLinearColor Color) const {};
     UFUNCTION(BlueprintCallable, BlueprintNativeEvent)
     FVector GetEmit() const;
@@ -0,0 +1,99 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "Rasterizer.h"
+#include "VertexPipeline.h"
+#include "RasterScene.generated.h"
+
+/**
+ * Software rasterized view of every UStaticMeshDataComponent in the level, drawn into the texture of a screen plane.
+ * Native replacement of the per pixel SetPixel calls of the HW01 / HW02 rasterization blueprints.
+ */
+UCLASS()
+class COMPUTERGRAPHICS_API ARasterScene : public AActor
+{
+	GENERATED_BODY()
+
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
+	class USceneComponent* Root;
+
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
+	class UStaticMeshComponent* StaticMesh;
+
+protected:
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, meta = (AllowPrivateAccess = "true"))
+	class UDynamicTextureComponent* Texture;
+
+public:
+	// Sets default values for this actor's properties
+	ARasterScene();
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float FOV = 90;
+
+	// Render from the player camera instead of the origin looking down +X
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bUsePlayerView = false;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	ERasterProjection Projection = ERasterProjection::Perspective;
+
+	// Width of the view in world units
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "1", EditCondition = "Projection == ERasterProjection::Orthographic"))
+	float OrthoWidth = 1000;
+
+	// Triangles are clipped at the near plane, beyond the far plane the depth test rejects them
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "0.01"))
+	float NearPlane = 10;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "0.01"))
+	float FarPlane = 100000;
+
+	// Samples per pixel, rounded down to 1, 2 or 4
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (ClampMin = "1", ClampMax = "4"))
+	int32 SampleCount = 1;
+
+	// Interpolate the colors at every sample (SSAA) instead of once per pixel (MSAA)
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (EditCondition = "SampleCount > 1"))
+	bool bShadePerSample = false;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bCullBackFaces = false;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FLinearColor ClearColor = FLinearColor::Black;
+
+	// Redraw every tick, otherwise only when Draw is called
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bDrawEveryTick = true;
+
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+
+	UPROPERTY()
+	TArray<class UStaticMeshDataComponent*> Meshes;
+
+	FRasterizer Rasterizer;
+
+	// Positions of Meshes in pipeline layout, converted when a mesh is first drawn
+	TArray<FVertexStream> MeshStreams;
+
+	FVertexPipeline Pipeline;
+
+	// Vertices of the mesh being drawn, reused for every mesh and frame
+	FVertexPipelineOutput Transformed;
+
+	// View and projection for the current view settings and player position
+	FMatrix GetViewProjection() const;
+
+public:
+	// Called every frame
+	virtual void Tick(float DeltaTime) override;
+
+	UFUNCTION(BlueprintCallable)
+	void Draw();
+};
@@ -0,0 +1,110 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UDynamicTextureComponent;
+struct FSoftwareTexture;
+
+/**
+ * Tiled half-space triangle rasterizer with a float depth buffer and 1, 2 or 4 samples per pixel.
+ * AddTriangles sets up the edge functions in 1/8 pixel fixed point and bins every triangle into the TileSize square tiles
+ * its bounds touch. Render then clears, rasterizes and resolves each tile on its own worker, 4 pixels at a time.
+ * Within a tile triangles are drawn in submission order, so equal depths resolve the same way every frame.
+ */
+struct COMPUTERGRAPHICS_API FRasterizer
+{
+	static const int32 TileSize = 32;
+	static const int32 MaxSamples = 4;
+	// Vertices further than this many pixels outside the viewport drop their triangle, the edge functions would lose precision
+	static const int32 GuardBand = 2048;
+
+	// Drops the binned triangles, SampleCount is rounded down to 1, 2 or 4
+	void Resize(int32 InWidth, int32 InHeight, int32 InSampleCount = 1);
+
+	// Forgets the triangles of the previous frame
+	void Begin();
+
+	/**
+	 * Sets up and bins an indexed triangle list on the worker threads. Positions hold X and Y in pixels, Z the depth in [0, 1]
+	 * which must be linear in screen space, smaller is closer, and W the reciprocal of the view depth for perspective correct
+	 * colors. Triangles with a vertex at W <= 0 or outside the guard band are dropped, clipping is up to the caller.
+	 * Colors and UVs may be null. With a Texture the colors are multiplied by it, 4 lookups at a time.
+	 */
+	void AddTriangles(const FVector4* Positions, const FLinearColor* Colors, const FVector2D* UVs, const int32* Indices, int32 TriangleCount, const FSoftwareTexture* Texture = nullptr);
+
+	// Rasterizes everything added since Begin and writes the resolved image to Target, which must have the same size
+	void Render(UDynamicTextureComponent* Target);
+
+	FORCEINLINE int32 GetWidth() const { return Width; }
+	FORCEINLINE int32 GetHeight() const { return Height; }
+	FORCEINLINE int32 GetSampleCount() const { return SampleCount; }
+
+	// Triangles added since Begin, including dropped ones
+	FORCEINLINE int32 GetTriangleCount() const { return Triangles.Num(); }
+
+	FLinearColor ClearColor = FLinearColor::Black;
+
+	// With several samples, shade every covered sample (SSAA) instead of once per pixel for all of them (MSAA)
+	bool bShadePerSample = false;
+
+	// Skip triangles that are counter clockwise on screen, the back faces of Unreal meshes
+	bool bCullBackFaces = false;
+
+private:
+	enum EPlane
+	{
+		PlaneDepth,
+		PlaneInvW,
+		// Color divided by the view depth, divided by the InvW plane again when shading
+		PlaneRed,
+		PlaneGreen,
+		PlaneBlue,
+		PlaneU,
+		PlaneV,
+		PlaneCount
+	};
+
+	struct FTriangle
+	{
+		// E = A * X + B * Y + C over sample positions in 1/8 pixels, inside where all three are >= 0. The fill rule is folded into C
+		int32 A[3];
+		int32 B[3];
+		int64 C[3];
+		// Pixels the samples may cover, inclusive. Empty when the triangle was dropped
+		int32 MinX, MinY, MaxX, MaxY;
+		// Value at (OriginX, OriginY) and derivatives per pixel
+		float OriginX, OriginY;
+		float Plane[PlaneCount][3];
+		const FSoftwareTexture* Texture;
+	};
+
+	bool SetupTriangle(const FVector4* Positions, const FLinearColor* Colors, const FVector2D* UVs, const int32* Corners, FTriangle& Out) const;
+
+	void RasterizeTriangle(const FTriangle& Triangle, int32 TileX, int32 TileY, int32 TileWidth, int32 TileHeight);
+
+	void RenderTile(int32 Tile, UDynamicTextureComponent* Target);
+
+	FORCEINLINE int32 GetSampleIndex(int32 Sample, int32 X, int32 Y) const { return (Sample * Height + Y) * Pitch + X; }
+
+	int32 Width = 0;
+	int32 Height = 0;
+	// Row stride of the sample planes, a multiple of 4 so every 4 pixel group is aligned
+	int32 Pitch = 0;
+	int32 SampleCount = 1;
+	int32 TilesX = 0;
+	int32 TilesY = 0;
+
+	TArray<FTriangle> Triangles;
+
+	// Triangle indices per binning chunk and tile, Bins[Chunk * TileCount + Tile]. Kept across frames for their allocations
+	TArray<TArray<int32>> Bins;
+	int32 ChunkCount = 0;
+
+	// One Pitch x Height plane per sample
+	TArray<float, TAlignedHeapAllocator<16>> Depth;
+	TArray<float, TAlignedHeapAllocator<16>> Red;
+	TArray<float, TAlignedHeapAllocator<16>> Green;
+	TArray<float, TAlignedHeapAllocator<16>> Blue;
+};
@@ -0,0 +1,39 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "RayBenchmarkCommandlet.generated.h"
+
+/**
+ * Times BVH build, primary rays, shadow rays and path tracing on fixed scenes and writes the numbers as JSON, e.g.
+ * UE4Editor-Cmd ComputerGraphics.uproject -run=RayBenchmark -nullrhi -Output=Saved/Benchmark/run.json
+ * Scenes default to bunny=/Game/HW06/HW06 and cornell=/Game/HW07/HW07_MultiThread, -Scenes=Name=Map,Name=Map overrides them.
+ * -Width= -Height= set the ray grid, -Repeat= the runs per test (the fastest counts), -Seed= the light samples,
+ * -PathSpp= and -Threads= the path tracing pass, which only runs for maps with an AScreenSceneMultiThread.
+ * -Split=Median|SAH|Spatial overrides the BVH builder of every tree, -Layout=Pointer|Quantized the node layout.
+ */
+UCLASS()
+class COMPUTERGRAPHICS_API URayBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	URayBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	TSharedPtr<class FJsonObject> RunScene(const FString& Name, const FString& MapName) const;
+
+	int32 Width = 256;
+	int32 Height = 256;
+	int32 Repeat = 3;
+	int32 Seed = 1;
+	int32 PathSpp = 4;
+	int32 Threads = 0;
+	// Empty keeps the builders set on the actors
+	FString SplitMethod;
+	FString NodeLayout;
+};
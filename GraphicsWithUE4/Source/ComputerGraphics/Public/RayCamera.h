@@ -0,0 +1,58 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ObjectInterface.h"
+
+/**
+ * Pinhole / thin lens camera used to generate primary rays.
+ * The basis is computed once in Setup, so each ray only costs a multiply-add and a normalize.
+ * Pixel (X, Y) maps to Forward * Focal + Right * (X - (Width - 1) / 2) + Up * ((Height - 1) / 2 - Y),
+ * FOV is the vertical field of view in degrees.
+ */
+struct COMPUTERGRAPHICS_API FRayCamera
+{
+	FRayCamera();
+
+	void Setup(const FVector& InLocation, const FRotator& InRotation, float InFOV, int32 InWidth, int32 InHeight, float InLensRadius = 0.f, float InFocusDistance = 1000.f);
+
+	FLightRay GenerateRay(float X, float Y) const;
+
+	/**
+	 * Rays for a TileWidth x TileHeight block starting at (X, Y), row major. Sub-pixel jitter is drawn from JitterStream and
+	 * lens samples from LensStream when they are set, without LensStream the rays start at the lens center.
+	 */
+	void GenerateTileRays(int32 X, int32 Y, int32 TileWidth, int32 TileHeight, TArray<FLightRay>& OutRays, FRandomStream* JitterStream = nullptr, FRandomStream* LensStream = nullptr) const;
+
+	bool Equals(const FRayCamera& Other) const;
+
+	/** Pixel coordinates and distance along Forward of a world position, false when it is behind the camera */
+	bool Project(const FVector& Position, float& OutX, float& OutY, float& OutDepth) const;
+
+	FORCEINLINE const FVector& GetLocation() const { return Location; }
+	FORCEINLINE const FVector& GetForward() const { return Forward; }
+
+	// Rays through the same pixel differ for every lens sample
+	FORCEINLINE bool HasLens() const { return LensRadius > 0; }
+
+	FORCEINLINE int32 GetWidth() const { return Width; }
+	FORCEINLINE int32 GetHeight() const { return Height; }
+
+private:
+	void ApplyLens(FLightRay& Ray, FRandomStream& Stream) const;
+
+	FVector Location;
+	FVector Forward;
+	FVector Right;
+	FVector Up;
+	// Unnormalized direction of pixel (0, 0)
+	FVector PixelOrigin;
+	// Distance in pixels to the image plane
+	float Focal;
+
+	int32 Width;
+	int32 Height;
+	float LensRadius;
+	float FocusDistance;
+};
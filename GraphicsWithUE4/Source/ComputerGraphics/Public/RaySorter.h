@@ -0,0 +1,29 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ObjectInterface.h"
+
+/**
+ * Orders incoherent rays so that neighbours in the batch start close together and point the same way.
+ * The key is the direction octant followed by the 30 bit Morton code of the origin cell inside the scene bounds.
+ */
+struct COMPUTERGRAPHICS_API FRaySorter
+{
+	static uint64 GetKey(const FLightRay& Ray, const FBounds3& SceneBound);
+
+	// 30 bit Morton code of the cell of Point on a 1024^3 grid over Bound
+	static uint32 GetMortonCode(const FVector& Point, const FBounds3& Bound);
+
+	/** Fills Order with the indices of Rays sorted by key */
+	void Sort(const TArray<FLightRay>& Rays, const FBounds3& SceneBound, TArray<int32>& Order);
+
+private:
+	struct FRayKey
+	{
+		uint64 Key;
+		int32 Index;
+	};
+	TArray<FRayKey> Keys;
+};
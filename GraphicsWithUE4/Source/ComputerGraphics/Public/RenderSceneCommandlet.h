@@ -0,0 +1,35 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "RenderSceneCommandlet.generated.h"
+
+/**
+ * Renders the AScreenSceneMultiThread of a map without a window or GPU, e.g.
+ * UE4Editor-Cmd ComputerGraphics.uproject -run=RenderScene -nullrhi -Map=/Game/HW07/HW07_MultiThread -Width=784 -Height=784 -Spp=16 -Threads=8 -Output=Saved/Render/Cornell -Denoise
+ * Output is the path without extension, the linear radiance goes to .exr and the tonemapped image to .png.
+ * -Exposure= and -ToneMap=Clamp|Reinhard|ACES control the png.
+ * -Trace[=Path] writes a Chrome trace of the tile jobs, BVH builds and denoise passes, by default next to the images.
+ */
+UCLASS()
+class COMPUTERGRAPHICS_API URenderSceneCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	URenderSceneCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+	// Loads and initializes a map as a game world without starting play, null when the map does not exist
+	static UWorld* LoadWorld(const FString& MapName);
+
+	static void BeginPlay(UWorld* World);
+
+	static void UnloadWorld(UWorld* World);
+
+private:
+	bool SaveImages(const FString& OutputPath, int32 Width, int32 Height, const TArray<FLinearColor>& Colors, const struct FToneMapper& ToneMapper) const;
+};
@@ -0,0 +1,48 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Stats/Stats.h"
+#include "BVHTree.h"
+
+DECLARE_STATS_GROUP(TEXT("RayTracer"), STATGROUP_RayTracer, STATCAT_Advanced);
+
+/**
+ * Work done by one render thread. Only the owning thread writes it and hands a copy to the game thread after every tile,
+ * so the hot paths pay a thread local lookup and an add. Traversal is not counted at all without WITH_RAY_STATS.
+ */
+struct COMPUTERGRAPHICS_API FRenderCounters
+{
+	FTraversalCounters Traversal;
+	uint64 CameraRays = 0;
+	uint64 ShadowRays = 0;
+	uint64 IndirectRays = 0;
+	// Finished paths and the segments they were made of
+	uint64 Paths = 0;
+	uint64 PathSegments = 0;
+	uint64 RouletteTerminations = 0;
+	uint64 Tiles = 0;
+	double BusySeconds = 0;
+	double IdleSeconds = 0;
+
+	void Accumulate(const FRenderCounters& Other);
+
+	FRenderCounters operator-(const FRenderCounters& Other) const;
+
+	// Null when the calling thread does not count
+	static FRenderCounters*& ForThread();
+
+	// Points both this thread's render and traversal counters at Counters
+	static void Install(FRenderCounters* Counters);
+};
+
+#if WITH_RAY_STATS
+#define RAY_STAT_ADD(Member, Value) \
+	if (FRenderCounters* RayStatCounters = FRenderCounters::ForThread()) \
+	{ \
+		RayStatCounters->Member += (Value); \
+	}
+#else
+#define RAY_STAT_ADD(Member, Value)
+#endif
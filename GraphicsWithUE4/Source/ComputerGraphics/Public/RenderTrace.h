@@ -0,0 +1,51 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+
+/**
+ * Timeline of the render jobs. Every RENDER_TRACE_SCOPE is a cpu event for Unreal Insights (-trace=cpu), and while a
+ * capture is running it is also recorded for a Chrome trace file (chrome://tracing, Perfetto) that needs no editor.
+ * Events are kept per thread, so recording only takes an uncontended lock.
+ * Console: RayTracer.Trace.Start, RayTracer.Trace.Stop [Path]
+ */
+struct COMPUTERGRAPHICS_API FRenderTrace
+{
+	static void StartCapture();
+
+	// Writes the events recorded since StartCapture as Chrome trace JSON, Path defaults to Saved/Profiling
+	static bool StopCapture(const FString& Path = FString());
+
+	static FORCEINLINE bool IsCapturing() { return bCapturing; }
+
+	static void Record(const TCHAR* Name, uint64 StartCycles, uint64 EndCycles);
+
+private:
+	static volatile bool bCapturing;
+};
+
+struct FRenderTraceScope
+{
+	FORCEINLINE explicit FRenderTraceScope(const TCHAR* InName)
+		: Name(InName), StartCycles(FRenderTrace::IsCapturing() ? FPlatformTime::Cycles64() : 0)
+	{
+	}
+
+	FORCEINLINE ~FRenderTraceScope()
+	{
+		if (StartCycles && FRenderTrace::IsCapturing())
+		{
+			FRenderTrace::Record(Name, StartCycles, FPlatformTime::Cycles64());
+		}
+	}
+
+private:
+	const TCHAR* Name;
+	uint64 StartCycles;
+};
+
+#define RENDER_TRACE_SCOPE(Name) \
+	TRACE_CPUPROFILER_EVENT_SCOPE(Name); \
+	FRenderTraceScope PREPROCESSOR_JOIN(RenderTraceScope, __LINE__)(TEXT(#Name))
@@ -5,6 +5,9 @@
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
 #include "ObjectInterface.h"
+#include "RayCamera.h"
+#include "DebugPathBuffer.h"
+#include "BVHTree.h"
 #include "ScreenScene.generated.h"
 
 UCLASS()
@@ -37,6 +40,39 @@ public:
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 	int32 TreeDepth = 0;
+
+	// Builder of the tree over the meshes, spatial splits help when big meshes like walls overlap the rest
+	UPROPERTY(EditAnywhere)
+	EBVHSplitMethod SplitMethod = EBVHSplitMethod::Median;
+
+	UPROPERTY(EditAnywhere, meta = (ClampMin = "0", EditCondition = "SplitMethod == EBVHSplitMethod::Spatial"))
+	float MaxReferenceGrowth = 0.5f;
+
+	UPROPERTY(EditAnywhere)
+	EBVHNodeLayout NodeLayout = EBVHNodeLayout::Pointer;
+
+	// Render from the player camera instead of the origin looking down +X
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	bool bUsePlayerView = false;
+
+	// Thin lens aperture, 0 is a pinhole camera. Only tiled renders sample the lens, and they skip the first hit cache then
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float LensRadius = 0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float FocusDistance = 1000;
+
+	// Show paths as debug lines, off for production renders
+	UPROPERTY(EditAnywhere)
+	bool bDrawDebugPaths = true;
+
+	// Only one path in this many is shown, a single BeginPath ray is always shown
+	UPROPERTY(EditAnywhere, meta = (ClampMin = "1", EditCondition = "bDrawDebugPaths"))
+	int32 DebugPathSampleInterval = 64;
+
+	// Segments waiting for the next tick, more are dropped
+	UPROPERTY(EditDefaultsOnly, meta = (ClampMin = "2"))
+	int32 DebugPathCapacity = 16384;
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
@@ -49,6 +85,17 @@ protected:
 
 	bool bEnableDrawFrame;
 
+	FRayCamera Camera;
+
+	// Captures the view for the next frame, the basis stays fixed until the next call
+	virtual void UpdateCamera();
+
+	// Camera for the current view settings and player position
+	FRayCamera GetViewCamera() const;
+
+	// Changes whenever the tree is rebuilt or a mesh moves or changes material
+	uint32 GetSceneHash() const;
+
 	UPROPERTY(BlueprintReadOnly)
 	bool bEnableDrawPath;
 
@@ -59,6 +106,20 @@ protected:
 	virtual FLinearColor CastRayWithSpp(const FLightRay& Ray, int32 Depth);
 
 	TArray<class ATriangleMesh*> TriangleMeshes;
+
+	// Filled from any thread, drawn once per tick
+	FDebugPathBuffer DebugPaths;
+
+	// Whether the path about to be traced on this thread should be shown
+	FORCEINLINE bool SampleDebugPath() const
+	{
+		return ENABLE_DRAW_DEBUG && bDrawDebugPaths && FDebugPathBuffer::Sample(DebugPathSampleInterval);
+	}
+
+	FORCEINLINE void AddDebugPath(const FVector& Start, const FVector& End, const FLinearColor& Color, float LifeTime = 0, float Thickness = 0)
+	{
+		DebugPaths.Add({ Start, End, Color, LifeTime, Thickness });
+	}
 public:	
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
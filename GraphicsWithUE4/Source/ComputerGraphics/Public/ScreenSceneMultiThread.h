@@ -5,37 +5,110 @@
 #include "CoreMinimal.h"
 #include "ScreenScene.h"
 #include "HAL/Runnable.h"
+#include "RaySorter.h"
+#include "Denoiser.h"
+#include "RenderStats.h"
 #include "ScreenSceneMultiThread.generated.h"
 
+UENUM(BlueprintType)
+enum class EScreenRenderMode : uint8
+{
+	Radiance,
+	// BVH nodes visited per sample, every ray of the path included
+	BVHNodes,
+	// Leaf objects tested per sample
+	Primitives,
+	// Wall time per sample in microseconds
+	Microseconds
+};
+
+struct FTileToCompute
+{
+	int32 X;
+	int32 Y;
+	int32 Width;
+	int32 Height;
+	// BeginDraw call the tile belongs to, results of older frames are dropped
+	int32 Frame;
+	// Copy of the frame's camera, the actor's changes with every BeginDraw
+	FRayCamera Camera;
+	// First-hit cache version matching Camera, hits traced for the tile are stored with it
+	uint32 CacheVersion;
+public:
+	FORCEINLINE FTileToCompute() : X(0), Y(0), Width(0), Height(0), Frame(0), CacheVersion(0) { }
+	FORCEINLINE FTileToCompute(int32 x, int32 y, int32 w, int32 h, int32 frame = 0) : X(x), Y(y), Width(w), Height(h), Frame(frame), CacheVersion(0) { }
+	FORCEINLINE int32 Num() const { return Width * Height; }
+};
+
+// One path of the wavefront tracer, Intersection is the non emitting surface the path currently sits on
+struct FPathState
+{
+	FLightRay Ray;
+	FIntersection Intersection;
+	FVector Throughput;
+	FVector Radiance;
+	FVector FirstHit;
+	int32 Pixel;
+	int32 Depth;
+};
+
+// Per worker buffers, reused across tiles
+struct FTileScratch
+{
+	FRandomStream RandomStream;
+	TArray<FLightRay> Rays;
+	TArray<FIntersection> PrimaryHits;
+	TArray<FLinearColor> Colors;
+	TArray<FLinearColor> Preview;
+	TArray<FColor> Heat;
+
+	TArray<FPathState> Paths;
+	TArray<FLightRay> BounceRays;
+	TArray<FLightRay> SortedRays;
+	TArray<FIntersection> Intersections;
+	TArray<FIntersection> SortedIntersections;
+	TArray<FIntersection> IntersectionLights;
+	TArray<float> PdfLights;
+	TArray<int32> Order;
+	FRaySorter Sorter;
+
+	// Written by the owning worker only
+	FRenderCounters Counters;
+};
+
 class FDrawTask : public FRunnable
 {
 public:
 	FDrawTask(int32 Id, class AScreenSceneMultiThread* Actor) :ThreadId(Id), Target(Actor) {}
 	virtual bool Init() override;
 	virtual uint32 Run() override;
+	virtual void Stop() override;
 	virtual void Exit() override;
+
+	// Counters as of the last finished tile, the live ones are written without synchronization
+	FRenderCounters GetCounters() const;
 private:
+	// Hands Scratch.Counters over to the game thread
+	void PublishCounters();
+
 	int32 ThreadId;
 	class AScreenSceneMultiThread* Target;
-	static FCriticalSection CriticalSection;
-};
+	FThreadSafeBool bStopping;
 
-struct FPointToCompute
-{
-	int32 X;
-	int32 Y;
-public:
-	FORCEINLINE FPointToCompute() : X(0), Y(0) { }
-	FORCEINLINE FPointToCompute(int32 x, int32 y) : X(x), Y(y) { }
+	FTileScratch Scratch;
+
+	mutable FCriticalSection CountersLock;
+	FRenderCounters PublishedCounters;
 };
 
-struct FPointToDraw
+// Filtered image of a denoise on the thread pool, shared with the task and picked up by the game thread
+struct FDenoiseResult
 {
-	FPointToCompute Point;
-	FLinearColor Color;
-public:
-	FORCEINLINE FPointToDraw(FPointToCompute point = FPointToCompute(), FLinearColor InColor = FLinearColor::Black) : Point(point), Color(InColor) { }
-	FORCEINLINE FPointToDraw(int32 x, int32 y, FLinearColor InColor = FLinearColor::Black) : Point(x, y), Color(InColor){ }
+	TArray<FLinearColor> Colors;
+	int32 Width = 0;
+	int32 Height = 0;
+	int32 Epoch = 0;
+	FThreadSafeBool bReady;
 };
 
 /**
@@ -51,6 +124,9 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	// Stops the workers and waits for the denoiser, neither may outlive the actor
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 	virtual void DrawOnePixel() override;
 
 	virtual void DrawOneLinePixel() override;
@@ -59,6 +135,85 @@ protected:
 
 	FLinearColor CastRayWithMultiThread(const FLightRay& Ray, int32 Depth);
 
+	// Shades Count coherent rays from their primary hits, the shadow rays are traced as packets. Adds to Colors
+	void CastPacketWithMultiThread(const FLightRay* Rays, const FIntersection* Intersections, int32 Count, FLinearColor* Colors);
+
+	// Fills Scratch.PrimaryHits for Scratch.Rays, from the first-hit cache when it is up to date
+	void TracePrimaryHits(const FTileToCompute& Tile, FTileScratch& Scratch);
+
+	// Ray missed or hit a light
+	FLinearColor ShadeEmitter(const FLightRay& Ray, const FIntersection& Intersection, int32 Depth);
+
+	// Picks a point on a light, the returned ray goes from there to the shading point
+	FLightRay SampleLightRay(const FIntersection& Intersection, FIntersection& IntersectionLight, float& PdfLight) const;
+
+	FVector DirectLight(const FIntersection& Intersection, const FIntersection& IntersectionLight, float PdfLight, const FIntersection& IntersectionCheckBlock) const;
+
+	// Russian roulette and the indirect bounce, LDir is the direct light already gathered at Intersection
+	FLinearColor ShadeIndirect(const FLightRay& Ray, const FIntersection& Intersection, const FVector& LDir, int32 Depth);
+
+	// Iterative version of CastRayWithMultiThread for all of Scratch.Rays, the rays of every bounce are traced as one batch
+	void CastWavefrontWithMultiThread(FTileScratch& Scratch);
+
+	// Traces Rays in packets, in Morton order when bSort is set. Hits are written back in the original order
+	void TraceBatch(const TArray<FLightRay>& Rays, TArray<FIntersection>& Intersections, bool bSort, FTileScratch& Scratch);
+
+	void FinishPath(const FPathState& Path, FTileScratch& Scratch);
+
+	// Traces Spp samples for every pixel of the tile, called from the worker threads
+	void RenderTile(const FTileToCompute& Tile, FTileScratch& Scratch);
+
+	// One sample per MotionResolutionDivisor block for the pixels without history, used right after the camera moved
+	void RenderTileReduced(const FTileToCompute& Tile, FTileScratch& Scratch);
+
+	// Traces the tile ray by ray and writes the colour mapped cost of every pixel instead of its radiance
+	void RenderTileCost(const FTileToCompute& Tile, FTileScratch& Scratch);
+
+	// Adds the samples of a tile to the history, or restarts pixels whose first hit no longer matches it
+	void AccumulateTile(const FTileToCompute& Tile, FTileScratch& Scratch);
+
+	// Fills FrameTiles, tiles with the most pixels lacking history come first
+	void BuildFrameTiles();
+
+	// Drops the queued tiles and waits for the ones being rendered, which stop at their next sample.
+	// Afterwards no worker touches the history, the caches, the denoiser or the texture until new tiles are queued
+	void CancelFrame();
+
+	// Moves the history into the view of Camera, pixels that are not covered lose their samples
+	void ReprojectHistory();
+
+	// Writes the whole history to the texture
+	void PresentHistory();
+
+	// Writes a finished tile to the texture, unless BeginDraw started another frame meanwhile. Hits are the denoiser guides
+	void WriteTile(const FTileToCompute& Tile, const FLinearColor* Colors, const FIntersection* Hits = nullptr);
+
+	// Already colour mapped pixels, never denoised or accumulated
+	void WriteTile(const FTileToCompute& Tile, const FColor* Colors);
+
+	// Filters the last full pass on the thread pool, ApplyDenoise writes it once done
+	void LaunchDenoise();
+
+	// Writes a finished filtered image to the texture unless the image restarted meanwhile, game thread only
+	void ApplyDenoise();
+
+	// Sum of the counters of all workers
+	FRenderCounters MergeCounters() const;
+
+	// Sets the STATGROUP_RayTracer values from the work done since the last tick
+	void PublishStats(const FRenderCounters& Delta) const;
+
+	void LogFrameStats(const FRenderCounters& Frame) const;
+
+	// Heatmaps are never accumulated over frames
+	FORCEINLINE bool IsAccumulating() const { return bTemporalReprojection && RenderMode == EScreenRenderMode::Radiance; }
+
+	FORCEINLINE FLinearColor GetHistoryColor(int32 Pixel) const
+	{
+		const FLinearColor& Sum = History[Pixel];
+		return Sum.A > 0 ? FLinearColor(Sum.R / Sum.A, Sum.G / Sum.A, Sum.B / Sum.A, 1) : FLinearColor::Black;
+	}
+
 public:
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
@@ -68,13 +223,137 @@ public:
 	UPROPERTY(EditAnywhere)
 	int32 MaxWorkCountPerTick = 4096;
 
+	// Edge length in pixels of the square blocks handed to the worker threads
+	UPROPERTY(EditAnywhere)
+	int32 TileSize = 16;
+
+	// Radiance, or the cost of every pixel from blue (none) to red (HeatmapMax)
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	EScreenRenderMode RenderMode = EScreenRenderMode::Radiance;
+
+	// Cost shown as red, 0 picks a default for the mode
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float HeatmapMax = 0;
+
+	// Jitter primary rays inside the pixel for every sample
+	UPROPERTY(EditAnywhere)
+	bool bJitterPixels = false;
+
+	// Rays traced together, 1 traces every ray on its own
+	UPROPERTY(EditAnywhere, meta = (ClampMin = "1", ClampMax = "16"))
+	int32 PacketSize = 16;
+
+	// Trace the bounces of a tile breadth first, every bounce of all its paths as one batch
+	UPROPERTY(EditAnywhere)
+	bool bWavefront = false;
+
+	// Sort the secondary rays of every wavefront bounce by origin cell and direction octant before tracing them
+	UPROPERTY(EditAnywhere, meta = (EditCondition = "bWavefront"))
+	bool bSortSecondaryRays = false;
+
+	// Keep the first hit of every pixel across samples and frames, only used without pixel jitter and with a pinhole camera
+	UPROPERTY(EditAnywhere)
+	bool bCachePrimaryHits = true;
+
+	// Accumulate samples over frames, reproject them when the camera moves and keep refining while it stands still
+	UPROPERTY(EditAnywhere)
+	bool bTemporalReprojection = false;
+
+	// Reprojected pixels are kept while the new first hit is within this fraction of the hit distance
+	UPROPERTY(EditAnywhere)
+	float ReprojectionTolerance = 0.02f;
+
+	// Block size of the quick pass drawn while the camera moves
+	UPROPERTY(EditAnywhere, meta = (ClampMin = "1"))
+	int32 MotionResolutionDivisor = 4;
+
+	// Progressive passes stop once every pixel has this many samples
+	UPROPERTY(EditAnywhere)
+	int32 MaxAccumulatedSpp = 256;
+
+	// Filter every finished pass with the albedo, normal and depth of the first hits. With temporal reprojection only the filtered image is shown
+	UPROPERTY(EditAnywhere)
+	bool bDenoise = false;
+
+	UPROPERTY(EditAnywhere, meta = (ClampMin = "1", ClampMax = "8"))
+	int32 DenoiseIterations = 4;
+
+	UPROPERTY(EditAnywhere)
+	float DenoiseColorSigma = 1.f;
+
+	UPROPERTY(EditAnywhere)
+	float DenoiseNormalPower = 64.f;
+
+	UPROPERTY(EditAnywhere)
+	float DenoiseDepthSigma = 0.05f;
+
+	// Worker threads started in BeginPlay, 0 keeps the default count
+	UPROPERTY(EditDefaultsOnly)
+	int32 WorkerThreads = 0;
+
+	/**
+	 * Renders one full frame synchronously into OutColors (row major, linear radiance) without touching the GPU.
+	 * The worker threads must be running, i.e. BeginPlay has been called. Returns false when there is nothing to render.
+	 */
+	bool RenderOffline(int32 Width, int32 Height, TArray<FLinearColor>& OutColors);
+
+	// Forces the first-hit cache to be rebuilt, the camera and the meshes are checked on every BeginDraw
+	UFUNCTION(BlueprintCallable)
+	void InvalidatePrimaryHits();
+
 	UFUNCTION(BlueprintNativeEvent)
 	FVector Sample(const FVector& Normal) const;
 	FVector Sample_Implementation(const FVector& Normal) const;
 
 private:
-	TQueue<FPointToCompute> WorkQueue;
-	TQueue<FPointToDraw, EQueueMode::Mpsc> DrawQueue;
+	TQueue<FTileToCompute> WorkQueue;
+	// Guards the consumer side of WorkQueue, which is single consumer
+	FCriticalSection WorkQueueLock;
+	// Tiles in WorkQueue, the pixel queue to the game thread is gone since workers write the texture themselves
+	volatile int32 QueuedTiles = 0;
+	// Tiles dequeued and not finished yet, counted under WorkQueueLock
+	volatile int32 ActiveTiles = 0;
 	int32 CurrentCompute;
-	int32 CurrentDraw;
+	// Pixels written by the workers, updated atomically
+	volatile int32 CurrentDraw;
+	double FrameStartTime;
+
+	// First hit of every pixel, an entry is valid while its version matches PrimaryHitCacheVersion.
+	// Only resized after CancelFrame, workers read and write disjoint tiles of it
+	TArray<FIntersection> PrimaryHitCache;
+	TArray<uint32> PrimaryHitVersions;
+	uint32 PrimaryHitCacheVersion = 1;
+	FRayCamera PrimaryHitCamera;
+	uint32 PrimaryHitSceneHash = 0;
+
+	TArray<FTileToCompute> FrameTiles;
+	int32 NextTile;
+
+	// Radiance sum per pixel with the sample count in alpha, and the first hit it was gathered from (W is 0 for misses)
+	TArray<FLinearColor> History;
+	TArray<FVector4> HistoryPositions;
+	TArray<FLinearColor> ReprojectedHistory;
+	TArray<FVector4> ReprojectedPositions;
+	TArray<float> ReprojectedDepths;
+	// Read by the workers to give up on tiles of older frames
+	volatile int32 FrameIndex = 0;
+	int32 AccumulatedSpp = 0;
+	bool bReducedPass = false;
+
+	TSharedPtr<FDenoiser, ESPMode::ThreadSafe> Denoiser;
+	TSharedPtr<FDenoiseResult, ESPMode::ThreadSafe> DenoiseResult;
+	TArray<FDrawTask*> DrawTasks;
+	TArray<FRunnableThread*> DrawThreads;
+	FRenderCounters LastTickCounters;
+	FRenderCounters FrameStartCounters;
+	TArray<FRenderCounters> FrameStartThreadCounters;
+	double FrameStartUploadSeconds = 0;
+
+	// Set by RenderOffline, finished tiles are copied here as well
+	TArray<FLinearColor>* OfflineColors = nullptr;
+
+	// Last frame handed to the denoiser
+	int32 DenoisedFrame = 0;
+	// Changes whenever the image restarts, older filtered results are dropped
+	int32 DenoiseEpoch = 0;
 };
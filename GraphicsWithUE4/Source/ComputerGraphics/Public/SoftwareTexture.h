@@ -0,0 +1,85 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/Texture.h"
+
+/**
+ * CPU copy of a texture with a box filtered mip chain, for the path tracer and the software rasterizer.
+ * Every mip is stored in 8x8 texel blocks, so the 2x2 footprint of a bilinear lookup rarely leaves a block.
+ * Filtering happens in linear space, sRGB texels are decoded through the engine's lookup table.
+ */
+struct COMPUTERGRAPHICS_API FSoftwareTexture
+{
+	// Copies mip 0 of the source art in the editor, of uncompressed (BGRA8) platform data otherwise, and its address modes
+	bool Init(class UTexture2D* Texture);
+
+	void Init(int32 InWidth, int32 InHeight, const FColor* Texels, bool bInSRGB);
+
+	void Reset();
+
+	FORCEINLINE bool IsValid() const { return Mips.Num() > 0; }
+	FORCEINLINE int32 GetWidth() const { return IsValid() ? Mips[0].Width : 0; }
+	FORCEINLINE int32 GetHeight() const { return IsValid() ? Mips[0].Height : 0; }
+	FORCEINLINE int32 GetMipCount() const { return Mips.Num(); }
+
+	// Level of detail for a pixel footprint given as UV derivatives along the screen axes
+	float GetLod(const FVector2D& DeltaX, const FVector2D& DeltaY) const;
+
+	// Lookup with Filter. Nearest and bilinear read the level closest to Lod, TF_Default is trilinear
+	FLinearColor Sample(const FVector2D& UV, float Lod = 0.f) const;
+
+	FLinearColor SampleNearest(const FVector2D& UV, int32 Mip) const;
+
+	FLinearColor SampleBilinear(const FVector2D& UV, int32 Mip) const;
+
+	FLinearColor SampleTrilinear(const FVector2D& UV, float Lod) const;
+
+	// Four lookups with Filter at once, one lane per pixel of a quad. Address and weight math run in SIMD, the results are per channel
+	void SampleQuad(const VectorRegister& U, const VectorRegister& V, float Lod, VectorRegister& OutRed, VectorRegister& OutGreen, VectorRegister& OutBlue, VectorRegister& OutAlpha) const;
+
+	TextureAddress AddressU = TA_Wrap;
+	TextureAddress AddressV = TA_Wrap;
+	TextureFilter Filter = TF_Trilinear;
+
+private:
+	static const int32 BlockBits = 3;
+	static const int32 BlockSize = 1 << BlockBits;
+
+	struct FMip
+	{
+		int32 Width;
+		int32 Height;
+		int32 BlocksX;
+		// BlockSize x BlockSize blocks in row major order, row major texels within a block
+		TArray<FColor> Texels;
+
+		FORCEINLINE int32 GetIndex(int32 X, int32 Y) const
+		{
+			return (((Y >> BlockBits) * BlocksX + (X >> BlockBits)) << (BlockBits * 2)) | ((Y & (BlockSize - 1)) << BlockBits) | (X & (BlockSize - 1));
+		}
+
+		FORCEINLINE const FColor& GetTexel(int32 X, int32 Y) const { return Texels[GetIndex(X, Y)]; }
+	};
+
+	FORCEINLINE FLinearColor Decode(const FColor& Texel) const
+	{
+		return FLinearColor(DecodeTable[Texel.R], DecodeTable[Texel.G], DecodeTable[Texel.B], Texel.A / 255.f);
+	}
+
+	FORCEINLINE int32 GetMip(float Lod) const { return FMath::Clamp(FMath::RoundToInt(Lod), 0, Mips.Num() - 1); }
+
+	// Texel coordinate after the address mode, Size is the mip size along that axis
+	static int32 Address(int32 Coordinate, int32 Size, TextureAddress Mode);
+
+	FMip& AddMip(int32 InWidth, int32 InHeight);
+
+	// Adds Weight times the bilinear (or nearest) lookups of one mip to the channel sums
+	void GatherQuad(int32 Mip, const VectorRegister& U, const VectorRegister& V, bool bNearest, const VectorRegister& Weight, VectorRegister Sums[4]) const;
+
+	TArray<FMip> Mips;
+	bool bSRGB = true;
+	// Channel value of every 8 bit code, sRGB or linear
+	const float* DecodeTable = nullptr;
+};
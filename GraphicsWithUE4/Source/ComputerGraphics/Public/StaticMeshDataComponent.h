@@ -30,6 +30,10 @@ public:
 	UPROPERTY(BlueprintReadOnly)
 	TArray<FLinearColor> Colors;
 
+	// First texture coordinate of every vertex, empty without bKeepUVs or when the mesh has none
+	UPROPERTY(BlueprintReadOnly)
+	TArray<FVector2D> UVs;
+
 	UPROPERTY(BlueprintReadOnly)
 	FVector Min;
 
@@ -39,19 +43,74 @@ public:
 	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
 	class UMaterial* Material;
 
+	// Merge vertices at the same position, the render data splits them along UV and normal seams
+	UPROPERTY(EditDefaultsOnly)
+	bool bWeldVertices = true;
+
+	// Keep the texture coordinates, welding then stops at UV seams. Set by the owner when it samples a texture
+	UPROPERTY()
+	bool bKeepUVs = false;
+
+	// Sort triangles along a Morton curve over their centroids and number vertices in first use order
+	UPROPERTY(EditDefaultsOnly)
+	bool bReorderTriangles = false;
+
+	/**
+	 * Fills Vertices, UVs, Indices, Colors and the bounds from an indexed triangle list in one pass over the indices.
+	 * Unused vertices and triangles that collapse when welding are left out. SourceUVs is ignored without bKeepUVs and
+	 * may be empty, otherwise only vertices with the same texture coordinate are welded.
+	 */
+	void SetGeometry(const TArray<FVector>& SourceVertices, const TArray<FVector2D>& SourceUVs, const TArray<uint32>& SourceIndices);
+
+	// Creates the mesh section once, afterwards color changes are sent on the next tick
 	void RenderMesh();
 
 	void RenderMesh(class UProceduralMeshComponent* InMesh);
 
+	// Writes Colors and remembers the vertex for the next color update, game thread only
+	FORCEINLINE void SetVertexColor(int32 Index, const FLinearColor& Color)
+	{
+		Colors[Index] = Color;
+		DirtyFirst = FMath::Min(DirtyFirst, Index);
+		DirtyLast = FMath::Max(DirtyLast, Index);
+	}
+
+	virtual void TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction) override;
+
 	FORCEINLINE bool IsReady() const { return bReady; }
 
 	FOnMeshReadySignature OnMeshReady;
+
+#if WITH_EDITOR
+	virtual void PreSave(const class ITargetPlatform* TargetPlatform) override;
+#endif
 protected:
 	// Called when the game starts
 	virtual void BeginPlay() override;
 
 private:
+	// Welded geometry saved when cooking, so packaged builds need no CPU copy of the render data
+	UPROPERTY()
+	TArray<FVector> CookedVertices;
+
+	UPROPERTY()
+	TArray<FVector2D> CookedUVs;
+
+	UPROPERTY()
+	TArray<uint32> CookedIndices;
+
+	// LOD 0 of Mesh, cooked meshes only keep it in memory with Allow CPU Access. OutUVs is empty without texture coordinates
+	bool ReadRenderData(TArray<FVector>& OutVertices, TArray<FVector2D>& OutUVs, TArray<uint32>& OutIndices) const;
+
 	class UProceduralMeshComponent* ProceduralMesh;
 
 	bool bReady;
+
+	// Vertices whose colors changed since the last update, empty while DirtyLast < DirtyFirst
+	int32 DirtyFirst = MAX_int32;
+	int32 DirtyLast = INDEX_NONE;
+	bool bColorUpdateRequested = false;
+
+	// Sends the changed range to the render thread, at most once per tick
+	void UpdateColors();
 };
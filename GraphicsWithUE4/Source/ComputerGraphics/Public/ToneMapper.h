@@ -0,0 +1,46 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ToneMapper.generated.h"
+
+UENUM(BlueprintType)
+enum class EToneMapOperator : uint8
+{
+	// Hard clip at 1, same as FLinearColor::ToFColor
+	Clamp,
+	// x / (1 + x)
+	Reinhard,
+	// Narkowicz fit of the ACES filmic curve
+	ACES
+};
+
+/**
+ * Converts float framebuffers to 8 bit colors: exposure, tonemap and gamma encoding.
+ * The curve runs on all four channels of a pixel at once, the gamma encoding is a table lookup instead of a pow per channel.
+ * Alpha is only clamped.
+ */
+struct COMPUTERGRAPHICS_API FToneMapper
+{
+	FToneMapper();
+
+	void Setup(EToneMapOperator InOperator, float InExposure, bool bInSRGB);
+
+	void Convert(const FLinearColor* Source, FColor* Dest, int32 Count) const;
+
+	FColor Convert(const FLinearColor& Color) const;
+
+	FORCEINLINE EToneMapOperator GetOperator() const { return Operator; }
+	FORCEINLINE float GetExposure() const { return Exposure; }
+	FORCEINLINE bool IsSRGB() const { return bSRGB; }
+
+private:
+	// Tonemapped values in [0, 1] are quantized to this many steps before the lookup
+	static const int32 TableSize = 4096;
+
+	EToneMapOperator Operator;
+	float Exposure;
+	bool bSRGB;
+	uint8 EncodeTable[TableSize];
+};
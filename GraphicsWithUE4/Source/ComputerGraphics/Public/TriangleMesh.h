@@ -5,6 +5,8 @@
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
 #include "ObjectInterface.h"
+#include "BVHTree.h"
+#include "SoftwareTexture.h"
 #include "TriangleMesh.generated.h"
 
 UCLASS()
@@ -23,11 +25,16 @@ private:
 	// 法线
 	FVector Normal;
 	FVector e1, e2;
+
+	// Texture coordinate at barycentrics (U, V) of p1 and p2
+	FVector2D GetUV(float U, float V) const;
 public:
 	virtual FBounds3 GetBounds() const override;
 
 	virtual FIntersection GetIntersection(const FLightRay& Ray, bool bDraw = false) const override;
 
+	virtual void SplitBounds(const FBounds3& Box, int32 Axis, float Position, FBounds3& OutLeft, FBounds3& OutRight) const override;
+
 	virtual void SetColor(FLinearColor Color) const override;
 
 	FLinearColor GetColor() const;
@@ -64,16 +71,42 @@ public:
 	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
 	FVector Kd;
 
+	// Scales Kd at the first texture coordinate of the hit, copied to the CPU when play begins
+	UPROPERTY(EditDefaultsOnly, BlueprintReadOnly)
+	class UTexture2D* KdTexture;
+
+	// Paths carry no footprint, so trilinear filtering only ever reads the top mip
+	UPROPERTY(EditDefaultsOnly)
+	TEnumAsByte<TextureFilter> KdFilter = TF_Bilinear;
+
+	UPROPERTY(EditAnywhere)
+	EBVHSplitMethod SplitMethod = EBVHSplitMethod::Median;
+
+	// Spatial splits only, extra triangle references allowed as a fraction of the triangle count
+	UPROPERTY(EditAnywhere, meta = (ClampMin = "0", EditCondition = "SplitMethod == EBVHSplitMethod::Spatial"))
+	float MaxReferenceGrowth = 0.5f;
+
+	// Quantized nodes take a fraction of the memory, but drawn paths no longer color the visited nodes
+	UPROPERTY(EditAnywhere)
+	EBVHNodeLayout NodeLayout = EBVHNodeLayout::Pointer;
+
 	float Area;
 protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	// Mesh data only splits vertices at UV seams when KdTexture needs the coordinates
+	virtual void OnConstruction(const FTransform& Transform) override;
+
 	UPROPERTY(BlueprintReadOnly)
 	class UBVHTree* BvhTree;
 
 	UPROPERTY()
 	TArray<UTriangle*> Triangles;
+
+	uint64 ContentHash = 0;
+
+	FSoftwareTexture KdMap;
 public:
 	UFUNCTION()
 	void BuildTree();
@@ -82,6 +115,8 @@ public:
 
 	virtual FIntersection GetIntersection(const FLightRay& Ray, bool bDraw = false) const override;
 
+	virtual void GetIntersectionPacket(FLightRayPacket& Packet, uint32 ActiveMask, FIntersection* Hits) const override;
+
 	virtual void SetColor(FLinearColor Color) const {};
 
 	virtual void ClearTriangleColor();
@@ -92,6 +127,26 @@ public:
 
 	FORCEINLINE float GetArea() const { return Area; };
 
+	FORCEINLINE FVector GetKd(const FVector2D& UV) const
+	{
+		if (!KdMap.IsValid())
+		{
+			return Kd;
+		}
+		const FLinearColor Texel = KdMap.Sample(UV);
+		return Kd * FVector(Texel.R, Texel.G, Texel.B);
+	}
+
+	// Invalid without KdTexture
+	FORCEINLINE const FSoftwareTexture& GetKdMap() const { return KdMap; }
+
+	FORCEINLINE int32 GetTriangleCount() const { return Triangles.Num(); }
+
+	FORCEINLINE const UBVHTree* GetTree() const { return BvhTree; }
+
+	// Hash of the vertices, indices and location the tree was built from
+	FORCEINLINE uint64 GetContentHash() const { return ContentHash; }
+
 	void Sample(UPARAM(ref) FIntersection& Position, UPARAM(ref) float& Pdf);
 
 	UFUNCTION(BlueprintCallable)
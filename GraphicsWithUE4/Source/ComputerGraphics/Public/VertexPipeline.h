@@ -0,0 +1,103 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VertexPipeline.generated.h"
+
+UENUM(BlueprintType)
+enum class ERasterProjection : uint8
+{
+	Perspective,
+	Orthographic
+};
+
+// Mesh positions as separate X, Y and Z arrays, zero padded to a multiple of 4 so the pipeline loads whole registers
+struct COMPUTERGRAPHICS_API FVertexStream
+{
+	void Set(const TArray<FVector>& Vertices);
+
+	FORCEINLINE FVector Get(int32 Index) const { return FVector(X[Index], Y[Index], Z[Index]); }
+
+	TArray<float, TAlignedHeapAllocator<16>> X;
+	TArray<float, TAlignedHeapAllocator<16>> Y;
+	TArray<float, TAlignedHeapAllocator<16>> Z;
+	int32 Num = 0;
+};
+
+struct COMPUTERGRAPHICS_API FClippedTriangles
+{
+	TArray<FVector4> Positions;
+	TArray<FLinearColor> Colors;
+	TArray<FVector2D> UVs;
+	TArray<int32> Indices;
+
+	void Reset();
+};
+
+// Written by FVertexPipeline::Run, the arrays keep their allocations so steady frames allocate nothing
+struct COMPUTERGRAPHICS_API FVertexPipelineOutput
+{
+	// Rasterizer input of every vertex: pixels, depth in [0, 1] and 1 / w. W is -1 for vertices outside a clip plane
+	TArray<FVector4> Positions;
+
+	// Bit per clip plane the vertex is outside of, see FVertexPipeline::EClipPlane
+	TArray<uint8> ClipCodes;
+
+	// The visible parts of the triangles crossing a clip plane
+	FClippedTriangles Clipped;
+
+	// Per worker pieces of Clipped
+	TArray<FClippedTriangles> ChunkClipped;
+};
+
+/**
+ * Model / view / projection transform and viewport mapping for FRasterizer.
+ * Vertices are transformed 4 at a time from a FVertexStream with the combined matrix, classified against the near plane
+ * and the guard band and mapped to pixels. Triangles with a vertex outside are clipped in homogeneous space afterwards,
+ * the rest keep their original indices. The far plane is left to the depth test.
+ * Matrices use the engine's row vector convention, view space is X right, Y up and Z forward.
+ */
+struct COMPUTERGRAPHICS_API FVertexPipeline
+{
+	enum EClipPlane
+	{
+		ClipNear = 1 << 0,
+		ClipLeft = 1 << 1,
+		ClipRight = 1 << 2,
+		ClipBottom = 1 << 3,
+		ClipTop = 1 << 4,
+	};
+
+	// World to view space of a camera looking down its X axis
+	static FMatrix MakeViewMatrix(const FVector& Location, const FRotator& Rotation);
+
+	// View to clip space with depth in [0, 1]. FOV is vertical in degrees, OrthoWidth the view width in world units
+	static FMatrix MakeProjectionMatrix(ERasterProjection Projection, float FOV, float OrthoWidth, float AspectRatio, float NearPlane, float FarPlane);
+
+	// GuardBand is how far in pixels vertices may go outside the viewport before their triangles are clipped
+	void SetViewport(int32 InWidth, int32 InHeight, float GuardBand);
+
+	void SetTransform(const FMatrix& Model, const FMatrix& ViewProjection);
+
+	// Transforms the vertices and clips the triangles of Indices that need it. Colors may be null for white, UVs for zero
+	void Run(const FVertexStream& Vertices, const FLinearColor* Colors, const FVector2D* UVs, const int32* Indices, int32 TriangleCount, FVertexPipelineOutput& Output) const;
+
+private:
+	void TransformVertices(const FVertexStream& Vertices, FVertexPipelineOutput& Output) const;
+
+	void ClipTriangles(const FVertexStream& Vertices, const FLinearColor* Colors, const FVector2D* UVs, const int32* Indices, int32 TriangleCount, FVertexPipelineOutput& Output) const;
+
+	void ClipTriangle(const FVertexStream& Vertices, const FLinearColor* Colors, const FVector2D* UVs, const int32* Corners, uint32 Codes, FClippedTriangles& Out) const;
+
+	FVector4 ToViewport(const FVector4& Clip) const;
+
+	float GetPlaneDistance(uint32 Plane, const FVector4& Clip) const;
+
+	FMatrix ModelViewProjection = FMatrix::Identity;
+	float Width = 1.f;
+	float Height = 1.f;
+	// Guard band edges in normalized device coordinates
+	float GuardX = 1.f;
+	float GuardY = 1.f;
+};